@@ -6,9 +6,12 @@
 #include "vs_test_p.h"
 #include <QWindow>
 #include <qmath.h>
-#include <QtCore/qcryptographichash.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qthreadpool.h>
 #include <QtCore/private/qsystemerror_p.h>
 #include "qrhid3dhelpers_p.h"
+#include "qrhid3dpitchedcopy_p.h"
 
 #include <cstdio>
 
@@ -25,7 +28,9 @@ using namespace Qt::StringLiterals;
   buffers are USAGE_DYNAMIC and updating is done by mapping with WRITE_DISCARD.
   (so here QRhiBuffer keeps a copy of the buffer contents and all of it is
   memcpy'd every time, leaving the rest (juggling with the memory area Map
-  returns) to the driver).
+  returns) to the driver). With QT_D3D11_PARTIAL_DYNAMIC_UPLOADS=1 large
+  dynamic vertex and index buffers are USAGE_DEFAULT as well, with only the
+  changed ranges of the copy uploaded via UpdateSubresource.
 */
 
 /*!
@@ -208,6 +213,7 @@ static IDXGIFactory1 *createDXGIFactory2()
 bool QRhiD3D11::create(QRhi::Flags flags)
 {
     rhiFlags = flags;
+    QRhiD3D::BytecodeStore::instance()->ref(); // dropped in destroy(), which runs even when this fails
 
     uint devFlags = 0;
     if (debugLayer)
@@ -413,6 +419,22 @@ bool QRhiD3D11::create(QRhi::Flags flags)
     if (FAILED(context->QueryInterface(__uuidof(ID3DUserDefinedAnnotation), reinterpret_cast<void **>(&annotations))))
         annotations = nullptr;
 
+    parallelReplay = false;
+    if (qEnvironmentVariableIntValue("QT_D3D11_PARALLEL_REPLAY")) {
+        D3D11_FEATURE_DATA_THREADING threading = {};
+        if (SUCCEEDED(dev->CheckFeatureSupport(D3D11_FEATURE_THREADING, &threading, sizeof(threading)))
+                && threading.DriverCommandLists)
+        {
+            parallelReplay = true;
+        }
+        qCDebug(QRHI_LOG_INFO, "Parallel command replay on deferred contexts: %s",
+                parallelReplay ? "enabled" : "not supported by the driver");
+    }
+
+    timingScopes = qEnvironmentVariableIntValue("QT_D3D11_GPU_TIMING_SCOPES");
+    partialDynamicUploads = qEnvironmentVariableIntValue("QT_D3D11_PARTIAL_DYNAMIC_UPLOADS");
+    replayTiming = qEnvironmentVariableIntValue("QT_D3D11_REPLAY_TIMING");
+
     deviceLost = false;
 
     nativeHandlesStruct.dev = dev;
@@ -432,11 +454,298 @@ void QRhiD3D11::clearShaderCache()
     m_shaderCache.clear();
 }
 
+template<typename T, typename Desc, typename CreateFunc>
+static bool lookupOrCreateStateObject(QHash<QByteArray, ID3D11DeviceChild *> *cache,
+                                      quint64 *hits, quint64 *misses,
+                                      char typeTag, const Desc &desc, T **state,
+                                      CreateFunc create, const char *what)
+{
+    QByteArray key(1 + qsizetype(sizeof(Desc)), Qt::Uninitialized);
+    key[0] = typeTag;
+    memcpy(key.data() + 1, &desc, sizeof(Desc));
+
+    auto it = cache->constFind(key);
+    if (it != cache->constEnd()) {
+        *hits += 1;
+        *state = static_cast<T *>(it.value());
+        (*state)->AddRef();
+        return true;
+    }
+
+    *misses += 1;
+    HRESULT hr = create(&desc, state);
+    if (FAILED(hr)) {
+        qWarning("Failed to create %s: %s", what,
+            qPrintable(QSystemError::windowsComString(hr)));
+        *state = nullptr;
+        return false;
+    }
+    if (cache->count() >= QRhiD3D11::MAX_STATE_OBJECT_CACHE_ENTRIES) {
+        for (ID3D11DeviceChild *obj : std::as_const(*cache))
+            obj->Release();
+        cache->clear();
+    }
+    (*state)->AddRef();
+    cache->insert(key, *state);
+    return true;
+}
+
+bool QRhiD3D11::cachedStateObject(const D3D11_RASTERIZER_DESC &desc, ID3D11RasterizerState **state)
+{
+    return lookupOrCreateStateObject(&m_stateObjectCache,
+                                     &stats.stateObjectCacheHits, &stats.stateObjectCacheMisses,
+                                     'r', desc, state,
+                                     [this](const D3D11_RASTERIZER_DESC *d, ID3D11RasterizerState **s) {
+                                         return dev->CreateRasterizerState(d, s);
+                                     }, "rasterizer state");
+}
+
+bool QRhiD3D11::cachedStateObject(const D3D11_DEPTH_STENCIL_DESC &desc, ID3D11DepthStencilState **state)
+{
+    return lookupOrCreateStateObject(&m_stateObjectCache,
+                                     &stats.stateObjectCacheHits, &stats.stateObjectCacheMisses,
+                                     'd', desc, state,
+                                     [this](const D3D11_DEPTH_STENCIL_DESC *d, ID3D11DepthStencilState **s) {
+                                         return dev->CreateDepthStencilState(d, s);
+                                     }, "depth-stencil state");
+}
+
+bool QRhiD3D11::cachedStateObject(const D3D11_BLEND_DESC &desc, ID3D11BlendState **state)
+{
+    return lookupOrCreateStateObject(&m_stateObjectCache,
+                                     &stats.stateObjectCacheHits, &stats.stateObjectCacheMisses,
+                                     'b', desc, state,
+                                     [this](const D3D11_BLEND_DESC *d, ID3D11BlendState **s) {
+                                         return dev->CreateBlendState(d, s);
+                                     }, "blend state");
+}
+
+bool QRhiD3D11::cachedStateObject(const D3D11_SAMPLER_DESC &desc, ID3D11SamplerState **state)
+{
+    return lookupOrCreateStateObject(&m_stateObjectCache,
+                                     &stats.stateObjectCacheHits, &stats.stateObjectCacheMisses,
+                                     's', desc, state,
+                                     [this](const D3D11_SAMPLER_DESC *d, ID3D11SamplerState **s) {
+                                         return dev->CreateSamplerState(d, s);
+                                     }, "sampler state");
+}
+
+void QRhiD3D11::clearStateObjectCache()
+{
+    for (ID3D11DeviceChild *obj : std::as_const(m_stateObjectCache))
+        obj->Release();
+
+    m_stateObjectCache.clear();
+}
+
+// Returns the input signature chunk (ISGN, or ISG1 with newer compilers) from
+// a DXBC container, or the whole bytecode if it cannot be found.
+static QByteArray vertexInputSignature(const QByteArray &bytecode)
+{
+    const char *p = bytecode.constData();
+    const quint32 size = quint32(bytecode.size());
+    // "DXBC", 16 bytes checksum, version, total size, chunk count, chunk offsets
+    if (size < 32 || memcmp(p, "DXBC", 4))
+        return bytecode;
+    quint32 chunkCount;
+    memcpy(&chunkCount, p + 28, 4);
+    if (chunkCount > (size - 32) / 4)
+        return bytecode;
+    for (quint32 i = 0; i < chunkCount; ++i) {
+        quint32 chunkOffset;
+        memcpy(&chunkOffset, p + 32 + i * 4, 4);
+        if (chunkOffset > size - 8)
+            return bytecode;
+        quint32 chunkSize;
+        memcpy(&chunkSize, p + chunkOffset + 4, 4);
+        if (chunkSize > size - chunkOffset - 8)
+            return bytecode;
+        if (!memcmp(p + chunkOffset, "ISGN", 4) || !memcmp(p + chunkOffset, "ISG1", 4))
+            return QByteArray(p + chunkOffset, int(chunkSize + 8));
+    }
+    return bytecode;
+}
+
+bool QRhiD3D11::cachedInputLayout(const D3D11_INPUT_ELEMENT_DESC *inputDescs, int inputDescCount,
+                                  const QByteArray &vsByteCode, ID3D11InputLayout **inputLayout)
+{
+    QByteArray key;
+    for (int i = 0; i < inputDescCount; ++i) {
+        const D3D11_INPUT_ELEMENT_DESC &desc(inputDescs[i]);
+        key.append(desc.SemanticName);
+        key.append('\0');
+        const UINT v[] = { desc.SemanticIndex, UINT(desc.Format), desc.InputSlot,
+                           desc.AlignedByteOffset, UINT(desc.InputSlotClass), desc.InstanceDataStepRate };
+        key.append(reinterpret_cast<const char *>(v), sizeof(v));
+    }
+    key.append(vertexInputSignature(vsByteCode));
+
+    auto it = m_inputLayoutCache.constFind(key);
+    if (it != m_inputLayoutCache.constEnd()) {
+        *inputLayout = it.value();
+        (*inputLayout)->AddRef();
+        return true;
+    }
+
+    HRESULT hr = dev->CreateInputLayout(inputDescs, UINT(inputDescCount),
+                                        vsByteCode, SIZE_T(vsByteCode.size()), inputLayout);
+    if (FAILED(hr)) {
+        qWarning("Failed to create input layout: %s",
+            qPrintable(QSystemError::windowsComString(hr)));
+        *inputLayout = nullptr;
+        return false;
+    }
+    if (m_inputLayoutCache.count() >= MAX_INPUT_LAYOUT_CACHE_ENTRIES)
+        clearInputLayoutCache();
+    (*inputLayout)->AddRef();
+    m_inputLayoutCache.insert(key, *inputLayout);
+    return true;
+}
+
+void QRhiD3D11::clearInputLayoutCache()
+{
+    for (ID3D11InputLayout *inputLayout : std::as_const(m_inputLayoutCache))
+        inputLayout->Release();
+
+    m_inputLayoutCache.clear();
+}
+
+ID3D11Query *QRhiD3D11::acquireTimingQuery(D3D11_QUERY type)
+{
+    ID3D11Query *query = type == D3D11_QUERY_TIMESTAMP_DISJOINT ? freeTimingQueries.takeDisjointQuery()
+                                                                 : freeTimingQueries.takeTimestampQuery();
+    if (query)
+        return query;
+
+    D3D11_QUERY_DESC queryDesc = {};
+    queryDesc.Query = type;
+    HRESULT hr = dev->CreateQuery(&queryDesc, &query);
+    if (FAILED(hr)) {
+        qWarning("Failed to create timing query: %s",
+                 qPrintable(QSystemError::windowsComString(hr)));
+        return nullptr;
+    }
+    return query;
+}
+
+void QRhiD3D11::recordTimingQuery(QD3D11CommandBuffer *cbD, ID3D11Query *query, bool begin)
+{
+    QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
+    cmd.cmd = QD3D11CommandBuffer::Command::TimingQuery;
+    cmd.args.timingQuery.query = query;
+    cmd.args.timingQuery.begin = begin;
+}
+
+void QRhiD3D11::beginTimingFrame(QD3D11CommandBuffer *cbD)
+{
+    if (!timingScopes)
+        return;
+
+    resolveTimingFrames();
+
+    Q_ASSERT(!timingFrameActive);
+    currentTimingFrame.disjointQuery = acquireTimingQuery(D3D11_QUERY_TIMESTAMP_DISJOINT);
+    if (!currentTimingFrame.disjointQuery)
+        return;
+
+    recordTimingQuery(cbD, currentTimingFrame.disjointQuery, true);
+    timingFrameActive = true;
+}
+
+void QRhiD3D11::endTimingFrame(QD3D11CommandBuffer *cbD)
+{
+    if (!timingFrameActive)
+        return;
+
+    // unbalanced debugMarkBegin() calls are closed at the end of the frame
+    while (!currentTimingFrame.openScopes.isEmpty())
+        endTimingScope(cbD);
+
+    recordTimingQuery(cbD, currentTimingFrame.disjointQuery, false);
+    timingFrameActive = false;
+
+    if (currentTimingFrame.scopes.isEmpty()) {
+        currentTimingFrame.recycle(&freeTimingQueries);
+        return;
+    }
+
+    if (pendingTimingFrames.count() >= MAX_PENDING_TIMING_FRAMES) {
+        pendingTimingFrames.first().recycle(&freeTimingQueries);
+        pendingTimingFrames.removeFirst();
+    }
+    pendingTimingFrames.append(currentTimingFrame);
+    currentTimingFrame = {};
+}
+
+void QRhiD3D11::beginTimingScope(QD3D11CommandBuffer *cbD, const QByteArray &name)
+{
+    ID3D11Query *beginQuery = acquireTimingQuery(D3D11_QUERY_TIMESTAMP);
+    ID3D11Query *endQuery = beginQuery ? acquireTimingQuery(D3D11_QUERY_TIMESTAMP) : nullptr;
+    if (currentTimingFrame.openScope(name, beginQuery, endQuery))
+        recordTimingQuery(cbD, beginQuery, false);
+    else if (beginQuery)
+        freeTimingQueries.timestampQueries.append(beginQuery);
+}
+
+void QRhiD3D11::endTimingScope(QD3D11CommandBuffer *cbD)
+{
+    if (ID3D11Query *endQuery = currentTimingFrame.closeScope())
+        recordTimingQuery(cbD, endQuery, false);
+}
+
+void QRhiD3D11::resolveTimingFrames()
+{
+    while (!pendingTimingFrames.isEmpty()) {
+        TimingFrame &frame(pendingTimingFrames.first());
+        const UINT flags = D3D11_ASYNC_GETDATA_DONOTFLUSH;
+        D3D11_QUERY_DATA_TIMESTAMP_DISJOINT dj;
+        if (context->GetData(frame.disjointQuery, &dj, sizeof(dj), flags) != S_OK)
+            return; // frames complete in order, no point in looking further
+
+        QVarLengthArray<quint64, 64> timestamps(frame.scopes.count() * 2);
+        bool ok = !dj.Disjoint && dj.Frequency;
+        for (qsizetype i = 0, count = frame.scopes.count(); ok && i < count; ++i) {
+            const TimingFrame::Scope &scope(frame.scopes[i]);
+            HRESULT hr = context->GetData(scope.beginQuery, &timestamps[i * 2], sizeof(quint64), flags);
+            if (hr == S_OK)
+                hr = context->GetData(scope.endQuery, &timestamps[i * 2 + 1], sizeof(quint64), flags);
+            if (hr == S_FALSE)
+                return;
+            ok = hr == S_OK;
+        }
+
+        if (ok)
+            lastTimingScopesJson = QRhiD3D::timingScopesToJson(frame, timestamps.constData(), dj.Frequency);
+
+        frame.recycle(&freeTimingQueries);
+        pendingTimingFrames.removeFirst();
+    }
+}
+
+void QRhiD3D11::releaseTimingQueries()
+{
+    timingFrameActive = false;
+    currentTimingFrame.recycle(&freeTimingQueries);
+    for (TimingFrame &frame : pendingTimingFrames)
+        frame.recycle(&freeTimingQueries);
+    pendingTimingFrames.clear();
+
+    freeTimingQueries.releaseAll([](ID3D11Query *query) { query->Release(); });
+}
+
 void QRhiD3D11::destroy()
 {
     finishActiveReadbacks();
+    for (ID3D11Texture2D *tex : std::as_const(pendingUploadStagingTextures))
+        tex->Release();
+    pendingUploadStagingTextures.clear();
+    stagingPool.releaseAll();
 
     clearShaderCache();
+    clearStateObjectCache();
+    clearInputLayoutCache();
+    releaseTimingQueries();
+    QRhiD3D::BytecodeStore::instance()->deref();
 
     if (ofr.tsDisjointQuery) {
         ofr.tsDisjointQuery->Release();
@@ -449,6 +758,20 @@ void QRhiD3D11::destroy()
         }
     }
 
+    delete replayThreadPool;
+    replayThreadPool = nullptr;
+
+    for (int i = 0; i < MAX_REPLAY_CONTEXTS; ++i) {
+        if (deferredAnnotations[i]) {
+            deferredAnnotations[i]->Release();
+            deferredAnnotations[i] = nullptr;
+        }
+        if (deferredContexts[i]) {
+            deferredContexts[i]->Release();
+            deferredContexts[i] = nullptr;
+        }
+    }
+
     if (annotations) {
         annotations->Release();
         annotations = nullptr;
@@ -730,7 +1053,11 @@ bool QRhiD3D11::makeThreadLocalNativeContextCurrent()
 void QRhiD3D11::releaseCachedResources()
 {
     clearShaderCache();
+    clearStateObjectCache();
+    clearInputLayoutCache();
     m_bytecodeCache.clear();
+    // keep only what was used in the current frame
+    stagingPool.trim(readbackFrameCounter);
 }
 
 bool QRhiD3D11::isDeviceLost() const
@@ -850,6 +1177,7 @@ void QRhiD3D11::setPipelineCacheData(const QByteArray &data)
 
     m_bytecodeCache.clear();
 
+    int skipped = 0;
     const char *p = data.constData() + dataOffset;
     for (quint32 i = 0; i < header.count; ++i) {
         quint32 len = 0;
@@ -881,6 +1209,13 @@ void QRhiD3D11::setPipelineCacheData(const QByteArray &data)
         memcpy(bytecode.data(), p, len);
         p += len;
 
+        // Data saved before the source hash changed from SHA-1 (as hex) can
+        // never match, and would otherwise be saved again and again.
+        if (sourceHash.size() != QRhiD3D::BYTECODE_STORE_SOURCE_HASH_SIZE) {
+            skipped += 1;
+            continue;
+        }
+
         BytecodeCacheKey cacheKey;
         cacheKey.sourceHash = sourceHash;
         cacheKey.target = target;
@@ -888,8 +1223,11 @@ void QRhiD3D11::setPipelineCacheData(const QByteArray &data)
         cacheKey.compileFlags = flags;
 
         m_bytecodeCache.insert(cacheKey, bytecode);
+        QRhiD3D::BytecodeStore::instance()->insert(cacheKey, bytecode);
     }
 
+    if (skipped)
+        qCDebug(QRHI_LOG_INFO, "setPipelineCacheData: Skipped %d shaders with an outdated source hash", skipped);
     qCDebug(QRHI_LOG_INFO, "Seeded bytecode cache with %d shaders", int(m_bytecodeCache.count()));
 }
 
@@ -1098,21 +1436,18 @@ void QRhiD3D11::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
         // operations, not here
         cmd.args.bindShaderResources.offsetOnlyChange = !srbChanged && !srbRebuilt && !srbUpdate && srbD->hasDynamicOffset;
         cmd.args.bindShaderResources.dynamicOffsetCount = 0;
-        if (srbD->hasDynamicOffset) {
-            if (dynamicOffsetCount < QD3D11CommandBuffer::MAX_DYNAMIC_OFFSET_COUNT) {
-                cmd.args.bindShaderResources.dynamicOffsetCount = dynamicOffsetCount;
-                uint *p = cmd.args.bindShaderResources.dynamicOffsetPairs;
-                for (int i = 0; i < dynamicOffsetCount; ++i) {
-                    const QRhiCommandBuffer::DynamicOffset &dynOfs(dynamicOffsets[i]);
-                    const uint binding = uint(dynOfs.first);
-                    Q_ASSERT(aligned(dynOfs.second, 256u) == dynOfs.second);
-                    const quint32 offsetInConstants = dynOfs.second / 16;
-                    *p++ = binding;
-                    *p++ = offsetInConstants;
-                }
-            } else {
-                qWarning("Too many dynamic offsets (%d, max is %d)",
-                         dynamicOffsetCount, QD3D11CommandBuffer::MAX_DYNAMIC_OFFSET_COUNT);
+        cmd.args.bindShaderResources.dynamicOffsetPairs = nullptr;
+        if (srbD->hasDynamicOffset && dynamicOffsetCount > 0) {
+            cmd.args.bindShaderResources.dynamicOffsetCount = dynamicOffsetCount;
+            uint *p = cbD->allocPayload<uint>(dynamicOffsetCount * 2);
+            cmd.args.bindShaderResources.dynamicOffsetPairs = p;
+            for (int i = 0; i < dynamicOffsetCount; ++i) {
+                const QRhiCommandBuffer::DynamicOffset &dynOfs(dynamicOffsets[i]);
+                const uint binding = uint(dynOfs.first);
+                Q_ASSERT(aligned(dynOfs.second, 256u) == dynOfs.second);
+                const quint32 offsetInConstants = dynOfs.second / 16;
+                *p++ = binding;
+                *p++ = offsetInConstants;
             }
         }
     }
@@ -1146,12 +1481,10 @@ void QRhiD3D11::setVertexInput(QRhiCommandBuffer *cb,
         QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
         cmd.cmd = QD3D11CommandBuffer::Command::BindVertexBuffers;
         cmd.args.bindVertexBuffers.startSlot = startBinding;
-        if (bindingCount > QD3D11CommandBuffer::MAX_VERTEX_BUFFER_BINDING_COUNT) {
-            qWarning("Too many vertex buffer bindings (%d, max is %d)",
-                     bindingCount, QD3D11CommandBuffer::MAX_VERTEX_BUFFER_BINDING_COUNT);
-            bindingCount = QD3D11CommandBuffer::MAX_VERTEX_BUFFER_BINDING_COUNT;
-        }
         cmd.args.bindVertexBuffers.slotCount = bindingCount;
+        cmd.args.bindVertexBuffers.buffers = cbD->allocPayload<ID3D11Buffer *>(bindingCount);
+        cmd.args.bindVertexBuffers.offsets = cbD->allocPayload<UINT>(bindingCount);
+        cmd.args.bindVertexBuffers.strides = cbD->allocPayload<UINT>(bindingCount);
         QD3D11GraphicsPipeline *psD = QRHI_RES(QD3D11GraphicsPipeline, cbD->currentGraphicsPipeline);
         const QRhiVertexInputLayout &inputLayout(psD->m_vertexInputLayout);
         const int inputBindingCount = inputLayout.cendBindings() - inputLayout.cbeginBindings();
@@ -1288,21 +1621,27 @@ void QRhiD3D11::drawIndexed(QRhiCommandBuffer *cb, quint32 indexCount,
 
 void QRhiD3D11::debugMarkBegin(QRhiCommandBuffer *cb, const QByteArray &name)
 {
+    QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
+    if (timingFrameActive)
+        beginTimingScope(cbD, name);
+
     if (!debugMarkers || !annotations)
         return;
 
-    QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
     QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
     cmd.cmd = QD3D11CommandBuffer::Command::DebugMarkBegin;
-    qstrncpy(cmd.args.debugMark.s, name.constData(), sizeof(cmd.args.debugMark.s));
+    cmd.args.debugMark.s = cbD->copyString(name);
 }
 
 void QRhiD3D11::debugMarkEnd(QRhiCommandBuffer *cb)
 {
+    QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
+    if (timingFrameActive)
+        endTimingScope(cbD);
+
     if (!debugMarkers || !annotations)
         return;
 
-    QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
     QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
     cmd.cmd = QD3D11CommandBuffer::Command::DebugMarkEnd;
 }
@@ -1315,7 +1654,7 @@ void QRhiD3D11::debugMarkMsg(QRhiCommandBuffer *cb, const QByteArray &msg)
     QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
     QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
     cmd.cmd = QD3D11CommandBuffer::Command::DebugMarkMsg;
-    qstrncpy(cmd.args.debugMark.s, msg.constData(), sizeof(cmd.args.debugMark.s));
+    cmd.args.debugMark.s = cbD->copyString(msg);
 }
 
 const QRhiNativeHandles *QRhiD3D11::nativeHandles(QRhiCommandBuffer *cb)
@@ -1370,6 +1709,11 @@ QRhi::FrameOpResult QRhiD3D11::beginFrame(QRhiSwapChain *swapChain, QRhi::BeginF
     contextState.currentSwapChain = swapChainD;
     const int currentFrameSlot = swapChainD->currentFrameSlot;
 
+    stats.redundantStateCalls = currentFrameRedundantStateCalls;
+    currentFrameRedundantStateCalls = {};
+    stats.replayTiming = currentFrameReplayTiming;
+    currentFrameReplayTiming = {};
+
     // if we have a waitable object, now is the time to wait on it
     if (swapChainD->frameLatencyWaitableObject) {
         // only wait when endFrame() called Present(), otherwise this would become a 1 sec timeout
@@ -1385,7 +1729,10 @@ QRhi::FrameOpResult QRhiD3D11::beginFrame(QRhiSwapChain *swapChain, QRhi::BeginF
                 swapChainD->msaaRtv[currentFrameSlot] : swapChainD->backBufferRtv;
     swapChainD->rt.d.dsv = swapChainD->ds ? swapChainD->ds->dsv : nullptr;
 
-    finishActiveReadbacks();
+    readbackFrameCounter += 1;
+    finishActiveReadbacks(false);
+    if (readbackFrameCounter > STAGING_POOL_MAX_IDLE_FRAMES)
+        stagingPool.trim(readbackFrameCounter - STAGING_POOL_MAX_IDLE_FRAMES);
 
     if (swapChainD->timestamps.active[swapChainD->currentTimestampPairIndex]) {
         double elapsedSec = 0;
@@ -1403,6 +1750,8 @@ QRhi::FrameOpResult QRhiD3D11::beginFrame(QRhiSwapChain *swapChain, QRhi::BeginF
     cmd.args.beginFrame.tsDisjointQuery = recordTimestamps ? tsDisjoint : nullptr;
     cmd.args.beginFrame.swapchainData = rtData(&swapChainD->rt);
 
+    beginTimingFrame(&swapChainD->cb);
+
     return QRhi::FrameOpSuccess;
 }
 
@@ -1412,6 +1761,8 @@ QRhi::FrameOpResult QRhiD3D11::endFrame(QRhiSwapChain *swapChain, QRhi::EndFrame
     Q_ASSERT(contextState.currentSwapChain = swapChainD);
     const int currentFrameSlot = swapChainD->currentFrameSlot;
 
+    endTimingFrame(&swapChainD->cb);
+
     QD3D11CommandBuffer::Command &cmd(swapChainD->cb.commands.get());
     cmd.cmd = QD3D11CommandBuffer::Command::EndFrame;
     cmd.args.endFrame.tsQuery = nullptr; // done later manually, see below
@@ -1476,6 +1827,11 @@ QRhi::FrameOpResult QRhiD3D11::beginOffscreenFrame(QRhiCommandBuffer **cb, QRhi:
     Q_UNUSED(flags);
     ofr.active = true;
 
+    stats.redundantStateCalls = currentFrameRedundantStateCalls;
+    currentFrameRedundantStateCalls = {};
+    stats.replayTiming = currentFrameReplayTiming;
+    currentFrameReplayTiming = {};
+
     ofr.cbWrapper.resetState();
     *cb = &ofr.cbWrapper;
 
@@ -1509,6 +1865,8 @@ QRhi::FrameOpResult QRhiD3D11::beginOffscreenFrame(QRhiCommandBuffer **cb, QRhi:
     cmd.args.beginFrame.tsDisjointQuery = ofr.tsDisjointQuery ? ofr.tsDisjointQuery : nullptr;
     cmd.args.beginFrame.swapchainData = nullptr;
 
+    beginTimingFrame(&ofr.cbWrapper);
+
     return QRhi::FrameOpSuccess;
 }
 
@@ -1517,6 +1875,8 @@ QRhi::FrameOpResult QRhiD3D11::endOffscreenFrame(QRhi::EndFrameFlags flags)
     Q_UNUSED(flags);
     ofr.active = false;
 
+    endTimingFrame(&ofr.cbWrapper);
+
     QD3D11CommandBuffer::Command &cmd(ofr.cbWrapper.commands.get());
     cmd.cmd = QD3D11CommandBuffer::Command::EndFrame;
     cmd.args.endFrame.tsQuery = ofr.tsQueries[1] ? ofr.tsQueries[1] : nullptr;
@@ -1782,6 +2142,36 @@ void QRhiD3D11::enqueueSubresUpload(QD3D11Texture *texD, QD3D11CommandBuffer *cb
     }
 }
 
+// Adds [start, end) to the list, merging with overlapping or adjacent
+// ranges. When there are too many disjoint ranges, they are all collapsed
+// into one that covers everything.
+static void addDirtyRange(QVarLengthArray<QPair<quint32, quint32>, 4> *ranges, quint32 start, quint32 end)
+{
+    if (start >= end)
+        return;
+
+    for (qsizetype i = 0; i < ranges->count(); ) {
+        const QPair<quint32, quint32> &r(ranges->at(i));
+        if (start <= r.second && r.first <= end) {
+            start = qMin(start, r.first);
+            end = qMax(end, r.second);
+            ranges->remove(i);
+        } else {
+            ++i;
+        }
+    }
+
+    if (ranges->count() == ranges->capacity()) {
+        for (const QPair<quint32, quint32> &r : std::as_const(*ranges)) {
+            start = qMin(start, r.first);
+            end = qMax(end, r.second);
+        }
+        ranges->clear();
+    }
+
+    ranges->append({ start, end });
+}
+
 void QRhiD3D11::enqueueResourceUpdates(QRhiCommandBuffer *cb, QRhiResourceUpdateBatch *resourceUpdates)
 {
     QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
@@ -1794,6 +2184,7 @@ void QRhiD3D11::enqueueResourceUpdates(QRhiCommandBuffer *cb, QRhiResourceUpdate
             Q_ASSERT(bufD->m_type == QRhiBuffer::Dynamic);
             memcpy(bufD->dynBuf + u.offset, u.data.constData(), size_t(u.data.size()));
             bufD->hasPendingDynamicUpdates = true;
+            addDirtyRange(&bufD->dirtyRanges, u.offset, u.offset + quint32(u.data.size()));
         } else if (u.type == QRhiResourceUpdateBatchPrivate::BufferOp::StaticUpload) {
             QD3D11Buffer *bufD = QRHI_RES(QD3D11Buffer, u.buf);
             Q_ASSERT(bufD->m_type != QRhiBuffer::Dynamic);
@@ -1825,17 +2216,11 @@ void QRhiD3D11::enqueueResourceUpdates(QRhiCommandBuffer *cb, QRhiResourceUpdate
                 BufferReadback readback;
                 readback.result = u.result;
                 readback.byteSize = u.readSize;
+                readback.frame = readbackFrameCounter;
 
-                D3D11_BUFFER_DESC desc = {};
-                desc.ByteWidth = readback.byteSize;
-                desc.Usage = D3D11_USAGE_STAGING;
-                desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-                HRESULT hr = dev->CreateBuffer(&desc, nullptr, &readback.stagingBuf);
-                if (FAILED(hr)) {
-                    qWarning("Failed to create buffer: %s",
-                        qPrintable(QSystemError::windowsComString(hr)));
+                readback.stagingBuf = acquireReadbackStagingBuffer(readback.byteSize);
+                if (!readback.stagingBuf)
                     continue;
-                }
 
                 QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
                 cmd.cmd = QD3D11CommandBuffer::Command::CopySubRes;
@@ -1862,6 +2247,8 @@ void QRhiD3D11::enqueueResourceUpdates(QRhiCommandBuffer *cb, QRhiResourceUpdate
         const QRhiResourceUpdateBatchPrivate::TextureOp &u(ud->textureOps[opIdx]);
         if (u.type == QRhiResourceUpdateBatchPrivate::TextureOp::Upload) {
             QD3D11Texture *texD = QRHI_RES(QD3D11Texture, u.dst);
+            if (enqueueBatchedSubresUploads(texD, cbD, u))
+                continue;
             for (int layer = 0, maxLayer = u.subresDesc.count(); layer < maxLayer; ++layer) {
                 for (int level = 0; level < QRhi::MAX_MIP_LEVELS; ++level) {
                     for (const QRhiTextureSubresourceUploadDescription &subresDesc : std::as_const(u.subresDesc[layer][level]))
@@ -1958,13 +2345,9 @@ void QRhiD3D11::enqueueResourceUpdates(QRhiCommandBuffer *cb, QRhiResourceUpdate
             desc.SampleDesc.Count = 1;
             desc.Usage = D3D11_USAGE_STAGING;
             desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-            ID3D11Texture2D *stagingTex;
-            HRESULT hr = dev->CreateTexture2D(&desc, nullptr, &stagingTex);
-            if (FAILED(hr)) {
-                qWarning("Failed to create readback staging texture: %s",
-                    qPrintable(QSystemError::windowsComString(hr)));
+            ID3D11Texture2D *stagingTex = acquireStagingTexture(desc);
+            if (!stagingTex)
                 return;
-            }
 
             QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
             cmd.cmd = QD3D11CommandBuffer::Command::CopySubRes;
@@ -1992,6 +2375,12 @@ void QRhiD3D11::enqueueResourceUpdates(QRhiCommandBuffer *cb, QRhiResourceUpdate
             readback.bpl = bpl;
             readback.pixelSize = pixelSize;
             readback.format = format;
+            readback.conversion = cbD->readbackConversions.take(u.result);
+            if (readback.conversion && !QRhiD3D::canConvertPixels(format)) {
+                qWarning("Readback conversions need RGBA8 or BGRA8 data, ignoring");
+                readback.conversion = {};
+            }
+            readback.frame = readbackFrameCounter;
 
             activeTextureReadbacks.append(readback);
         } else if (u.type == QRhiResourceUpdateBatchPrivate::TextureOp::GenMips) {
@@ -2005,63 +2394,357 @@ void QRhiD3D11::enqueueResourceUpdates(QRhiCommandBuffer *cb, QRhiResourceUpdate
     ud->free();
 }
 
-void QRhiD3D11::finishActiveReadbacks()
+static inline bool operator==(const QD3D11StagingPool::Key &a, const QD3D11StagingPool::Key &b)
+{
+    return a.format == b.format && a.width == b.width && a.height == b.height
+            && a.cpuAccessFlags == b.cpuAccessFlags;
+}
+
+ID3D11Resource *QD3D11StagingPool::take(const Key &key)
+{
+    // most recently recycled first
+    for (int i = entries.count() - 1; i >= 0; --i) {
+        if (entries[i].key == key) {
+            ID3D11Resource *resource = entries[i].resource;
+            entries.remove(i);
+            return resource;
+        }
+    }
+    return nullptr;
+}
+
+// For uploads: the least recently recycled entry is the least likely to be
+// still read by the GPU.
+ID3D11Resource *QD3D11StagingPool::takeOldest(const Key &key)
+{
+    for (int i = 0; i < entries.count(); ++i) {
+        if (entries[i].key == key) {
+            ID3D11Resource *resource = entries[i].resource;
+            entries.remove(i);
+            return resource;
+        }
+    }
+    return nullptr;
+}
+
+void QD3D11StagingPool::recycle(const Key &key, ID3D11Resource *resource, quint64 frame)
+{
+    if (entries.count() == MAX_ENTRIES) {
+        int lru = 0;
+        for (int i = 1; i < entries.count(); ++i) {
+            if (entries[i].lastUsedFrame < entries[lru].lastUsedFrame)
+                lru = i;
+        }
+        entries[lru].resource->Release();
+        entries.remove(lru);
+    }
+    entries.append({ key, resource, frame });
+}
+
+void QD3D11StagingPool::trim(quint64 unusedSinceFrame)
+{
+    for (int i = entries.count() - 1; i >= 0; --i) {
+        if (entries[i].lastUsedFrame < unusedSinceFrame) {
+            entries[i].resource->Release();
+            entries.remove(i);
+        }
+    }
+}
+
+void QD3D11StagingPool::releaseAll()
+{
+    for (const Entry &e : std::as_const(entries))
+        e.resource->Release();
+    entries.clear();
+}
+
+ID3D11Texture2D *QRhiD3D11::acquireStagingTexture(const D3D11_TEXTURE2D_DESC &desc)
+{
+    const QD3D11StagingPool::Key key = { desc.Format, desc.Width, desc.Height, desc.CPUAccessFlags };
+    if (ID3D11Resource *res = stagingPool.take(key))
+        return static_cast<ID3D11Texture2D *>(res);
+
+    ID3D11Texture2D *tex = nullptr;
+    HRESULT hr = dev->CreateTexture2D(&desc, nullptr, &tex);
+    if (FAILED(hr)) {
+        qWarning("Failed to create staging texture: %s",
+            qPrintable(QSystemError::windowsComString(hr)));
+        return nullptr;
+    }
+    return tex;
+}
+
+// Returns a staging texture mapped for writing. Pooled textures the GPU still
+// copies from are skipped (and stay in the pool), a new one is only created
+// when none of the pooled ones can be mapped without waiting.
+ID3D11Texture2D *QRhiD3D11::acquireMappedUploadStagingTexture(const D3D11_TEXTURE2D_DESC &desc,
+                                                              D3D11_MAPPED_SUBRESOURCE *mp)
+{
+    const QD3D11StagingPool::Key key = { desc.Format, desc.Width, desc.Height, desc.CPUAccessFlags };
+    QVarLengthArray<ID3D11Texture2D *, QD3D11StagingPool::MAX_ENTRIES> busy;
+    ID3D11Texture2D *tex = nullptr;
+    while (ID3D11Resource *res = stagingPool.takeOldest(key)) {
+        ID3D11Texture2D *pooledTex = static_cast<ID3D11Texture2D *>(res);
+        const HRESULT hr = context->Map(pooledTex, 0, D3D11_MAP_WRITE, D3D11_MAP_FLAG_DO_NOT_WAIT, mp);
+        if (SUCCEEDED(hr)) {
+            tex = pooledTex;
+            break;
+        }
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING) {
+            busy.append(pooledTex);
+        } else {
+            qWarning("Failed to map upload staging texture: %s",
+                qPrintable(QSystemError::windowsComString(hr)));
+            pooledTex->Release();
+        }
+    }
+    for (ID3D11Texture2D *busyTex : std::as_const(busy))
+        recycleStagingTexture(busyTex);
+    if (tex)
+        return tex;
+
+    HRESULT hr = dev->CreateTexture2D(&desc, nullptr, &tex);
+    if (FAILED(hr)) {
+        qWarning("Failed to create staging texture: %s",
+            qPrintable(QSystemError::windowsComString(hr)));
+        return nullptr;
+    }
+    hr = context->Map(tex, 0, D3D11_MAP_WRITE, 0, mp);
+    if (FAILED(hr)) {
+        qWarning("Failed to map upload staging texture: %s",
+            qPrintable(QSystemError::windowsComString(hr)));
+        tex->Release();
+        return nullptr;
+    }
+    return tex;
+}
+
+ID3D11Buffer *QRhiD3D11::acquireReadbackStagingBuffer(UINT byteSize)
+{
+    const QD3D11StagingPool::Key key = { DXGI_FORMAT_UNKNOWN, byteSize, 0, D3D11_CPU_ACCESS_READ };
+    if (ID3D11Resource *res = stagingPool.take(key))
+        return static_cast<ID3D11Buffer *>(res);
+
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = byteSize;
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    ID3D11Buffer *buf = nullptr;
+    HRESULT hr = dev->CreateBuffer(&desc, nullptr, &buf);
+    if (FAILED(hr)) {
+        qWarning("Failed to create buffer: %s",
+            qPrintable(QSystemError::windowsComString(hr)));
+        return nullptr;
+    }
+    return buf;
+}
+
+void QRhiD3D11::recycleStagingTexture(ID3D11Texture2D *tex)
+{
+    D3D11_TEXTURE2D_DESC desc;
+    tex->GetDesc(&desc);
+    stagingPool.recycle({ desc.Format, desc.Width, desc.Height, desc.CPUAccessFlags }, tex, readbackFrameCounter);
+}
+
+void QRhiD3D11::recycleReadbackStagingBuffer(ID3D11Buffer *buf)
+{
+    D3D11_BUFFER_DESC desc;
+    buf->GetDesc(&desc);
+    stagingPool.recycle({ DXGI_FORMAT_UNKNOWN, desc.ByteWidth, 0, desc.CPUAccessFlags }, buf, readbackFrameCounter);
+}
+
+// Texture atlases tend to get many small sub-rectangle updates per frame.
+// Instead of an UpdateSubresource (and a retained QImage or QByteArray) for
+// each of them, their data is written into one staging texture right away and
+// the commands are just CopySubresourceRegion calls from that. Returns false
+// when the upload is not suitable, that is when anything in it is not a
+// small, uncompressed 2D sub-rectangle, or when there are too few of them.
+bool QRhiD3D11::enqueueBatchedSubresUploads(QD3D11Texture *texD, QD3D11CommandBuffer *cbD,
+                                            const QRhiResourceUpdateBatchPrivate::TextureOp &u)
+{
+    if (!texD->tex || texD->sampleDesc.Count > 1 || isCompressedFormat(texD->m_format))
+        return false;
+
+    quint32 bpp = 0;
+    textureFormatInfo(texD->m_format, QSize(1, 1), &bpp, nullptr, nullptr);
+    if (!bpp)
+        return false;
+
+    struct Upload {
+        UINT subres;
+        QPoint dst;
+        const uchar *src;
+        quint32 srcPitch;
+    };
+    QVarLengthArray<Upload, 64> uploads;
+    QVarLengthArray<QSize, 64> sizes;
+    for (int layer = 0, maxLayer = u.subresDesc.count(); layer < maxLayer; ++layer) {
+        for (int level = 0; level < QRhi::MAX_MIP_LEVELS; ++level) {
+            for (const QRhiTextureSubresourceUploadDescription &subresDesc : std::as_const(u.subresDesc[layer][level])) {
+                Upload upload;
+                upload.subres = D3D11CalcSubresource(UINT(level), UINT(layer), texD->mipLevelCount);
+                upload.dst = subresDesc.destinationTopLeft();
+                QSize size;
+                if (!subresDesc.image().isNull()) {
+                    // the image is kept alive by the update batch
+                    const QImage img = subresDesc.image();
+                    if (quint32(img.depth()) != bpp * 8)
+                        return false;
+                    const QPoint sp = subresDesc.sourceTopLeft();
+                    size = subresDesc.sourceSize().isEmpty() ? img.size() : subresDesc.sourceSize();
+                    if (sp.x() < 0 || sp.y() < 0 || sp.x() + size.width() > img.width() || sp.y() + size.height() > img.height())
+                        return false;
+                    upload.srcPitch = quint32(img.bytesPerLine());
+                    upload.src = img.constBits() + sp.y() * img.bytesPerLine() + sp.x() * bpp;
+                } else if (!subresDesc.data().isEmpty()) {
+                    size = subresDesc.sourceSize().isEmpty() ? q->sizeForMipLevel(level, texD->m_pixelSize)
+                                                             : subresDesc.sourceSize();
+                    upload.srcPitch = subresDesc.dataStride() ? subresDesc.dataStride() : size.width() * bpp;
+                    const QByteArray data = subresDesc.data();
+                    if (size.isEmpty() || data.size() < qsizetype(upload.srcPitch) * (size.height() - 1) + size.width() * bpp)
+                        return false;
+                    upload.src = reinterpret_cast<const uchar *>(data.constData());
+                } else {
+                    return false;
+                }
+                if (size.isEmpty() || size.width() > MAX_BATCHED_SUBRES_UPLOAD_SIZE || size.height() > MAX_BATCHED_SUBRES_UPLOAD_SIZE)
+                    return false;
+                uploads.append(upload);
+                sizes.append(size);
+            }
+        }
+    }
+    if (uploads.count() < MIN_BATCHED_SUBRES_UPLOADS)
+        return false;
+
+    QVarLengthArray<QPoint, 64> positions(uploads.count());
+    const QSize usedSize = QRhiD3D::packUploadRects(sizes.constData(), int(sizes.count()),
+                                           MAX_UPLOAD_STAGING_TEXTURE_SIZE, positions.data());
+    if (usedSize.isEmpty())
+        return false;
+
+    // power of two sizes so that the staging textures are reusable
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = qMax(64u, qNextPowerOfTwo(quint32(usedSize.width() - 1)));
+    desc.Height = qMax(64u, qNextPowerOfTwo(quint32(usedSize.height() - 1)));
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = texD->dxgiFormat;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    D3D11_MAPPED_SUBRESOURCE mp;
+    ID3D11Texture2D *stagingTex = acquireMappedUploadStagingTexture(desc, &mp);
+    if (!stagingTex)
+        return false;
+
+    quint64 byteCount = 0;
+    for (qsizetype i = 0, count = uploads.count(); i < count; ++i) {
+        const QPoint &pos(positions[i]);
+        const QSize &size(sizes[i]);
+        const quint32 rowBytes = size.width() * bpp;
+        uchar *dst = static_cast<uchar *>(mp.pData) + pos.y() * mp.RowPitch + pos.x() * bpp;
+        QRhiD3D::copyPitchedRows(dst, mp.RowPitch, uploads[i].src, uploads[i].srcPitch, rowBytes, size.height());
+        byteCount += rowBytes * size.height();
+    }
+    context->Unmap(stagingTex, 0);
+
+    for (qsizetype i = 0, count = uploads.count(); i < count; ++i) {
+        const QPoint &pos(positions[i]);
+        const QSize &size(sizes[i]);
+        QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
+        cmd.cmd = QD3D11CommandBuffer::Command::CopySubRes;
+        cmd.args.copySubRes.dst = texD->tex;
+        cmd.args.copySubRes.dstSubRes = uploads[i].subres;
+        cmd.args.copySubRes.dstX = UINT(uploads[i].dst.x());
+        cmd.args.copySubRes.dstY = UINT(uploads[i].dst.y());
+        cmd.args.copySubRes.dstZ = 0;
+        cmd.args.copySubRes.src = stagingTex;
+        cmd.args.copySubRes.srcSubRes = 0;
+        cmd.args.copySubRes.hasSrcBox = true;
+        D3D11_BOX box;
+        box.left = UINT(pos.x());
+        box.top = UINT(pos.y());
+        box.front = 0;
+        // back, right, bottom are exclusive
+        box.right = UINT(pos.x() + size.width());
+        box.bottom = UINT(pos.y() + size.height());
+        box.back = 1;
+        cmd.args.copySubRes.srcBox = box;
+    }
+    pendingUploadStagingTextures.append(stagingTex);
+
+    stats.batchedSubresUploads += uploads.count();
+    stats.batchedSubresUploadBytes += byteCount;
+    return true;
+}
+
+void QRhiD3D11::finishActiveReadbacks(bool forced)
 {
     QVarLengthArray<std::function<void()>, 4> completedCallbacks;
 
-    for (int i = activeTextureReadbacks.count() - 1; i >= 0; --i) {
-        const QRhiD3D11::TextureReadback &readback(activeTextureReadbacks[i]);
-        readback.result->format = readback.format;
-        readback.result->pixelSize = readback.pixelSize;
+    // The copies complete in submission order, so stop at the first one the
+    // GPU is not done with, unless it has been waiting for too long.
+    int completedCount = 0;
+    for (int ie = activeTextureReadbacks.count(); completedCount != ie; ++completedCount) {
+        const QRhiD3D11::TextureReadback &readback(activeTextureReadbacks[completedCount]);
+        const bool wait = forced || readbackFrameCounter - readback.frame >= READBACK_MAX_FRAME_LATENCY;
 
         D3D11_MAPPED_SUBRESOURCE mp;
-        HRESULT hr = context->Map(readback.stagingTex, 0, D3D11_MAP_READ, 0, &mp);
+        HRESULT hr = context->Map(readback.stagingTex, 0, D3D11_MAP_READ,
+                                  wait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &mp);
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+            break;
+
+        readback.result->format = QRhiD3D::convertedFormat(readback.format, readback.conversion);
+        readback.result->pixelSize = readback.pixelSize;
         if (SUCCEEDED(hr)) {
             readback.result->data.resize(int(readback.byteSize));
             // nothing says the rows are tightly packed in the texture, must take
             // the stride into account
-            char *dst = readback.result->data.data();
-            char *src = static_cast<char *>(mp.pData);
-            for (int y = 0, h = readback.pixelSize.height(); y != h; ++y) {
-                memcpy(dst, src, readback.bpl);
-                dst += readback.bpl;
-                src += mp.RowPitch;
-            }
+            QRhiD3D::copyPitchedRows(readback.result->data.data(), readback.bpl,
+                                     mp.pData, mp.RowPitch,
+                                     readback.bpl, readback.pixelSize.height(),
+                                     readback.conversion);
             context->Unmap(readback.stagingTex, 0);
+            recycleStagingTexture(readback.stagingTex);
         } else {
             qWarning("Failed to map readback staging texture: %s",
                 qPrintable(QSystemError::windowsComString(hr)));
+            readback.stagingTex->Release();
         }
 
-        readback.stagingTex->Release();
-
         if (readback.result->completed)
             completedCallbacks.append(readback.result->completed);
-
-        activeTextureReadbacks.removeLast();
     }
+    activeTextureReadbacks.remove(0, completedCount);
 
-    for (int i = activeBufferReadbacks.count() - 1; i >= 0; --i) {
-        const QRhiD3D11::BufferReadback &readback(activeBufferReadbacks[i]);
+    completedCount = 0;
+    for (int ie = activeBufferReadbacks.count(); completedCount != ie; ++completedCount) {
+        const QRhiD3D11::BufferReadback &readback(activeBufferReadbacks[completedCount]);
+        const bool wait = forced || readbackFrameCounter - readback.frame >= READBACK_MAX_FRAME_LATENCY;
 
         D3D11_MAPPED_SUBRESOURCE mp;
-        HRESULT hr = context->Map(readback.stagingBuf, 0, D3D11_MAP_READ, 0, &mp);
+        HRESULT hr = context->Map(readback.stagingBuf, 0, D3D11_MAP_READ,
+                                  wait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &mp);
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+            break;
+
         if (SUCCEEDED(hr)) {
             readback.result->data.resize(int(readback.byteSize));
             memcpy(readback.result->data.data(), mp.pData, readback.byteSize);
             context->Unmap(readback.stagingBuf, 0);
+            recycleReadbackStagingBuffer(readback.stagingBuf);
         } else {
             qWarning("Failed to map readback staging texture: %s",
                 qPrintable(QSystemError::windowsComString(hr)));
+            readback.stagingBuf->Release();
         }
 
-        readback.stagingBuf->Release();
-
         if (readback.result->completed)
             completedCallbacks.append(readback.result->completed);
-
-        activeBufferReadbacks.removeLast();
     }
+    activeBufferReadbacks.remove(0, completedCount);
 
     for (auto f : completedCallbacks)
         f();
@@ -2294,7 +2977,7 @@ void QRhiD3D11::updateShaderResourceBindings(QD3D11ShaderResourceBindings *srbD,
 
     struct Stage {
         struct Buffer {
-            int binding; // stored and sent along in XXorigbindings just for applyDynamicOffsets()
+            int binding; // QRhi binding, needed for mapping dynamic offsets
             int breg; // b0, b1, ...
             ID3D11Buffer *buffer;
             uint offsetInConstants;
@@ -2320,7 +3003,6 @@ void QRhiD3D11::updateShaderResourceBindings(QD3D11ShaderResourceBindings *srbD,
         {
             for (const Buffer &buf : buffers) {
                 batches.ubufs.feed(buf.breg, buf.buffer);
-                batches.ubuforigbindings.feed(buf.breg, UINT(buf.binding));
                 batches.ubufoffsets.feed(buf.breg, buf.offsetInConstants);
                 batches.ubufsizes.feed(buf.breg, buf.sizeInConstants);
             }
@@ -2542,6 +3224,37 @@ void QRhiD3D11::updateShaderResourceBindings(QD3D11ShaderResourceBindings *srbD,
     res[RBM_FRAGMENT].buildBufferBatches(srbD->fsUniformBufferBatches);
     res[RBM_COMPUTE].buildBufferBatches(srbD->csUniformBufferBatches);
 
+    QD3D11ShaderResourceBindings::StageUniformBufferBatches *stageUniformBufferBatches[RBM_SUPPORTED_STAGES] = {
+        &srbD->vsUniformBufferBatches,
+        &srbD->hsUniformBufferBatches,
+        &srbD->dsUniformBufferBatches,
+        &srbD->gsUniformBufferBatches,
+        &srbD->fsUniformBufferBatches,
+        &srbD->csUniformBufferBatches
+    };
+    srbD->flatUbufOffsets.clear();
+    srbD->dynamicOffsetTargets.clear();
+    srbD->dynamicOffsetTargetIndex.clear();
+    for (int stage = 0; stage < RBM_SUPPORTED_STAGES; ++stage) {
+        stageUniformBufferBatches[stage]->flatOffsetBase = int(srbD->flatUbufOffsets.count());
+        for (const Stage::Buffer &buf : std::as_const(res[stage].buffers)) {
+            srbD->dynamicOffsetTargets.append({ uint(buf.binding), int(srbD->flatUbufOffsets.count()) });
+            srbD->flatUbufOffsets.append(buf.offsetInConstants);
+        }
+    }
+    if (srbD->hasDynamicOffset && !srbD->dynamicOffsetTargets.isEmpty()) {
+        std::sort(srbD->dynamicOffsetTargets.begin(), srbD->dynamicOffsetTargets.end(),
+                  [](const QD3D11ShaderResourceBindings::DynamicOffsetTarget &a,
+                     const QD3D11ShaderResourceBindings::DynamicOffsetTarget &b)
+        {
+            return a.binding < b.binding;
+        });
+        srbD->dynamicOffsetTargetIndex.resize(srbD->dynamicOffsetTargets.last().binding + 1);
+        std::fill(srbD->dynamicOffsetTargetIndex.begin(), srbD->dynamicOffsetTargetIndex.end(), -1);
+        for (int i = int(srbD->dynamicOffsetTargets.count()) - 1; i >= 0; --i)
+            srbD->dynamicOffsetTargetIndex[srbD->dynamicOffsetTargets[i].binding] = i;
+    }
+
     res[RBM_VERTEX].buildSamplerBatches(srbD->vsSamplerBatches);
     res[RBM_HULL].buildSamplerBatches(srbD->hsSamplerBatches);
     res[RBM_DOMAIN].buildSamplerBatches(srbD->dsSamplerBatches);
@@ -2559,37 +3272,60 @@ void QRhiD3D11::executeBufferHostWrites(QD3D11Buffer *bufD)
 
     Q_ASSERT(bufD->m_type == QRhiBuffer::Dynamic);
     bufD->hasPendingDynamicUpdates = false;
+
+    if (bufD->dynamicWithDefaultUsage) {
+        // Only the changed ranges. UpdateSubresource takes care of not
+        // disturbing what the GPU may still be reading.
+        for (const QPair<quint32, quint32> &r : std::as_const(bufD->dirtyRanges)) {
+            D3D11_BOX box;
+            box.left = r.first;
+            box.top = 0;
+            box.front = 0;
+            box.right = r.second;
+            box.bottom = 1;
+            box.back = 1;
+            context->UpdateSubresource(bufD->buffer, 0, &box, bufD->dynBuf + r.first, 0, 0);
+            stats.dynamicBufferBytesCopied += r.second - r.first;
+        }
+        bufD->dirtyRanges.clear();
+        return;
+    }
+
+    // WRITE_DISCARD gives undefined contents, so all of it has to be written.
+    bufD->dirtyRanges.clear();
     D3D11_MAPPED_SUBRESOURCE mp;
     HRESULT hr = context->Map(bufD->buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mp);
     if (SUCCEEDED(hr)) {
         memcpy(mp.pData, bufD->dynBuf, bufD->m_size);
         context->Unmap(bufD->buffer, 0);
+        stats.dynamicBufferBytesCopied += bufD->m_size;
     } else {
         qWarning("Failed to map buffer: %s",
             qPrintable(QSystemError::windowsComString(hr)));
     }
 }
 
-static void applyDynamicOffsets(UINT *offsets,
-                                int batchIndex,
-                                const QRhiBatchedBindings<UINT> *originalBindings,
-                                const QRhiBatchedBindings<UINT> *staticOffsets,
+// Returns the uniform buffer offsets of all stages with the dynamic offsets
+// applied. Entries with no corresponding dynamic offset keep their static
+// value.
+static void applyDynamicOffsets(QVarLengthArray<UINT, 16> *offsets,
+                                const QD3D11ShaderResourceBindings *srbD,
                                 const uint *dynOfsPairs, int dynOfsPairCount)
 {
-    const int count = staticOffsets->batches[batchIndex].resources.count();
-    // Make a copy of the offset list, the entries that have no corresponding
-    // dynamic offset will continue to use the existing offset value.
-    for (int b = 0; b < count; ++b) {
-        offsets[b] = staticOffsets->batches[batchIndex].resources[b];
-        for (int di = 0; di < dynOfsPairCount; ++di) {
-            const uint binding = dynOfsPairs[2 * di];
-            // binding is the SPIR-V style binding point here, nothing to do
-            // with the native one.
-            if (binding == originalBindings->batches[batchIndex].resources[b]) {
-                const uint offsetInConstants = dynOfsPairs[2 * di + 1];
-                offsets[b] = offsetInConstants;
-                break;
-            }
+    *offsets = srbD->flatUbufOffsets;
+    const int indexCount = int(srbD->dynamicOffsetTargetIndex.count());
+    for (int di = 0; di < dynOfsPairCount; ++di) {
+        // binding is the SPIR-V style binding point here, nothing to do
+        // with the native one.
+        const uint binding = dynOfsPairs[2 * di];
+        if (binding >= uint(indexCount))
+            continue;
+        const uint offsetInConstants = dynOfsPairs[2 * di + 1];
+        for (int t = srbD->dynamicOffsetTargetIndex[binding];
+             t >= 0 && t < srbD->dynamicOffsetTargets.count() && srbD->dynamicOffsetTargets[t].binding == binding;
+             ++t)
+        {
+            (*offsets)[srbD->dynamicOffsetTargets[t].flatIndex] = offsetInConstants;
         }
     }
 }
@@ -2607,6 +3343,7 @@ static inline uint clampedResourceCount(uint startSlot, int countSlots, uint max
 #define SETUBUFBATCH(stagePrefixL, stagePrefixU) \
     if (srbD->stagePrefixL##UniformBufferBatches.present) { \
         const QD3D11ShaderResourceBindings::StageUniformBufferBatches &batches(srbD->stagePrefixL##UniformBufferBatches); \
+        int flatOffsetIndex = batches.flatOffsetBase; \
         for (int i = 0, ie = batches.ubufs.batches.count(); i != ie; ++i) { \
             const uint count = clampedResourceCount(batches.ubufs.batches[i].startBinding, \
                                                     batches.ubufs.batches[i].resources.count(), \
@@ -2614,22 +3351,20 @@ static inline uint clampedResourceCount(uint startSlot, int countSlots, uint max
                                                     #stagePrefixU " cbuf"); \
             if (count) { \
                 if (!dynOfsPairCount) { \
-                    context->stagePrefixU##SetConstantBuffers1(batches.ubufs.batches[i].startBinding, \
+                    rs->context->stagePrefixU##SetConstantBuffers1(batches.ubufs.batches[i].startBinding, \
                                                    count, \
                                                    batches.ubufs.batches[i].resources.constData(), \
                                                    batches.ubufoffsets.batches[i].resources.constData(), \
                                                    batches.ubufsizes.batches[i].resources.constData()); \
                 } else { \
-                    applyDynamicOffsets(offsets, i, \
-                                        &batches.ubuforigbindings, &batches.ubufoffsets, \
-                                        dynOfsPairs, dynOfsPairCount); \
-                    context->stagePrefixU##SetConstantBuffers1(batches.ubufs.batches[i].startBinding, \
+                    rs->context->stagePrefixU##SetConstantBuffers1(batches.ubufs.batches[i].startBinding, \
                                                    count, \
                                                    batches.ubufs.batches[i].resources.constData(), \
-                                                   offsets, \
+                                                   offsets.constData() + flatOffsetIndex, \
                                                    batches.ubufsizes.batches[i].resources.constData()); \
                 } \
             } \
+            flatOffsetIndex += batches.ubufs.batches[i].resources.count(); \
         } \
     }
 
@@ -2639,14 +3374,14 @@ static inline uint clampedResourceCount(uint startSlot, int countSlots, uint max
             const uint count = clampedResourceCount(batch.startBinding, batch.resources.count(), \
                                                     D3D11_COMMONSHADER_SAMPLER_SLOT_COUNT, #stagePrefixU " sampler"); \
             if (count) \
-                context->stagePrefixU##SetSamplers(batch.startBinding, count, batch.resources.constData()); \
+                rs->context->stagePrefixU##SetSamplers(batch.startBinding, count, batch.resources.constData()); \
         } \
         for (const auto &batch : srbD->stagePrefixL##SamplerBatches.shaderresources.batches) { \
             const uint count = clampedResourceCount(batch.startBinding, batch.resources.count(), \
                                                     D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT, #stagePrefixU " SRV"); \
             if (count) { \
-                context->stagePrefixU##SetShaderResources(batch.startBinding, count, batch.resources.constData()); \
-                contextState.stagePrefixL##HighestActiveSrvBinding = qMax(contextState.stagePrefixL##HighestActiveSrvBinding, \
+                rs->context->stagePrefixU##SetShaderResources(batch.startBinding, count, batch.resources.constData()); \
+                rs->contextState->stagePrefixL##HighestActiveSrvBinding = qMax(rs->contextState->stagePrefixL##HighestActiveSrvBinding, \
                                                               int(batch.startBinding + count) - 1); \
             } \
         } \
@@ -2658,21 +3393,23 @@ static inline uint clampedResourceCount(uint startSlot, int countSlots, uint max
             const uint count = clampedResourceCount(batch.startBinding, batch.resources.count(), \
                                                     D3D11_1_UAV_SLOT_COUNT, #stagePrefixU " UAV"); \
             if (count) { \
-                context->stagePrefixU##SetUnorderedAccessViews(batch.startBinding, \
+                rs->context->stagePrefixU##SetUnorderedAccessViews(batch.startBinding, \
                                                    count, \
                                                    batch.resources.constData(), \
                                                    nullptr); \
-                contextState.stagePrefixL##HighestActiveUavBinding = qMax(contextState.stagePrefixL##HighestActiveUavBinding, \
+                rs->contextState->stagePrefixL##HighestActiveUavBinding = qMax(rs->contextState->stagePrefixL##HighestActiveUavBinding, \
                                                               int(batch.startBinding + count) - 1); \
             } \
         } \
     }
 
-void QRhiD3D11::bindShaderResources(QD3D11ShaderResourceBindings *srbD,
+void QRhiD3D11::bindShaderResources(ReplayState *rs, QD3D11ShaderResourceBindings *srbD,
                                     const uint *dynOfsPairs, int dynOfsPairCount,
                                     bool offsetOnlyChange)
 {
-    UINT offsets[QD3D11CommandBuffer::MAX_DYNAMIC_OFFSET_COUNT];
+    QVarLengthArray<UINT, 16> offsets;
+    if (dynOfsPairCount)
+        applyDynamicOffsets(&offsets, srbD, dynOfsPairs, dynOfsPairCount);
 
     SETUBUFBATCH(vs, VS)
     SETUBUFBATCH(hs, HS)
@@ -2693,17 +3430,17 @@ void QRhiD3D11::bindShaderResources(QD3D11ShaderResourceBindings *srbD,
     }
 }
 
-void QRhiD3D11::resetShaderResources()
+void QRhiD3D11::resetShaderResources(ReplayState *rs)
 {
     // Output cannot be bound on input etc.
 
-    if (contextState.vsHasIndexBufferBound) {
-        context->IASetIndexBuffer(nullptr, DXGI_FORMAT_R16_UINT, 0);
-        contextState.vsHasIndexBufferBound = false;
+    if (rs->contextState->vsHasIndexBufferBound) {
+        rs->context->IASetIndexBuffer(nullptr, DXGI_FORMAT_R16_UINT, 0);
+        rs->contextState->vsHasIndexBufferBound = false;
     }
 
-    if (contextState.vsHighestActiveVertexBufferBinding >= 0) {
-        const int count = contextState.vsHighestActiveVertexBufferBinding + 1;
+    if (rs->contextState->vsHighestActiveVertexBufferBinding >= 0) {
+        const int count = rs->contextState->vsHighestActiveVertexBufferBinding + 1;
         QVarLengthArray<ID3D11Buffer *, D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT> nullbufs(count);
         for (int i = 0; i < count; ++i)
             nullbufs[i] = nullptr;
@@ -2713,71 +3450,395 @@ void QRhiD3D11::resetShaderResources()
         QVarLengthArray<UINT, D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT> nulloffsets(count);
         for (int i = 0; i < count; ++i)
             nulloffsets[i] = 0;
-        context->IASetVertexBuffers(0, UINT(count), nullbufs.constData(), nullstrides.constData(), nulloffsets.constData());
-        contextState.vsHighestActiveVertexBufferBinding = -1;
+        rs->context->IASetVertexBuffers(0, UINT(count), nullbufs.constData(), nullstrides.constData(), nulloffsets.constData());
+        rs->contextState->vsHighestActiveVertexBufferBinding = -1;
     }
 
-    int nullsrvCount = qMax(contextState.vsHighestActiveSrvBinding, contextState.fsHighestActiveSrvBinding);
-    nullsrvCount = qMax(nullsrvCount, contextState.hsHighestActiveSrvBinding);
-    nullsrvCount = qMax(nullsrvCount, contextState.dsHighestActiveSrvBinding);
-    nullsrvCount = qMax(nullsrvCount, contextState.gsHighestActiveSrvBinding);
-    nullsrvCount = qMax(nullsrvCount, contextState.csHighestActiveSrvBinding);
+    int nullsrvCount = qMax(rs->contextState->vsHighestActiveSrvBinding, rs->contextState->fsHighestActiveSrvBinding);
+    nullsrvCount = qMax(nullsrvCount, rs->contextState->hsHighestActiveSrvBinding);
+    nullsrvCount = qMax(nullsrvCount, rs->contextState->dsHighestActiveSrvBinding);
+    nullsrvCount = qMax(nullsrvCount, rs->contextState->gsHighestActiveSrvBinding);
+    nullsrvCount = qMax(nullsrvCount, rs->contextState->csHighestActiveSrvBinding);
     nullsrvCount += 1;
     if (nullsrvCount > 0) {
         QVarLengthArray<ID3D11ShaderResourceView *,
                 D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT> nullsrvs(nullsrvCount);
         for (int i = 0; i < nullsrvs.count(); ++i)
             nullsrvs[i] = nullptr;
-        if (contextState.vsHighestActiveSrvBinding >= 0) {
-            context->VSSetShaderResources(0, UINT(contextState.vsHighestActiveSrvBinding + 1), nullsrvs.constData());
-            contextState.vsHighestActiveSrvBinding = -1;
+        if (rs->contextState->vsHighestActiveSrvBinding >= 0) {
+            rs->context->VSSetShaderResources(0, UINT(rs->contextState->vsHighestActiveSrvBinding + 1), nullsrvs.constData());
+            rs->contextState->vsHighestActiveSrvBinding = -1;
         }
-        if (contextState.hsHighestActiveSrvBinding >= 0) {
-            context->HSSetShaderResources(0, UINT(contextState.hsHighestActiveSrvBinding + 1), nullsrvs.constData());
-            contextState.hsHighestActiveSrvBinding = -1;
+        if (rs->contextState->hsHighestActiveSrvBinding >= 0) {
+            rs->context->HSSetShaderResources(0, UINT(rs->contextState->hsHighestActiveSrvBinding + 1), nullsrvs.constData());
+            rs->contextState->hsHighestActiveSrvBinding = -1;
         }
-        if (contextState.dsHighestActiveSrvBinding >= 0) {
-            context->DSSetShaderResources(0, UINT(contextState.dsHighestActiveSrvBinding + 1), nullsrvs.constData());
-            contextState.dsHighestActiveSrvBinding = -1;
+        if (rs->contextState->dsHighestActiveSrvBinding >= 0) {
+            rs->context->DSSetShaderResources(0, UINT(rs->contextState->dsHighestActiveSrvBinding + 1), nullsrvs.constData());
+            rs->contextState->dsHighestActiveSrvBinding = -1;
         }
-        if (contextState.gsHighestActiveSrvBinding >= 0) {
-            context->GSSetShaderResources(0, UINT(contextState.gsHighestActiveSrvBinding + 1), nullsrvs.constData());
-            contextState.gsHighestActiveSrvBinding = -1;
+        if (rs->contextState->gsHighestActiveSrvBinding >= 0) {
+            rs->context->GSSetShaderResources(0, UINT(rs->contextState->gsHighestActiveSrvBinding + 1), nullsrvs.constData());
+            rs->contextState->gsHighestActiveSrvBinding = -1;
         }
-        if (contextState.fsHighestActiveSrvBinding >= 0) {
-            context->PSSetShaderResources(0, UINT(contextState.fsHighestActiveSrvBinding + 1), nullsrvs.constData());
-            contextState.fsHighestActiveSrvBinding = -1;
+        if (rs->contextState->fsHighestActiveSrvBinding >= 0) {
+            rs->context->PSSetShaderResources(0, UINT(rs->contextState->fsHighestActiveSrvBinding + 1), nullsrvs.constData());
+            rs->contextState->fsHighestActiveSrvBinding = -1;
         }
-        if (contextState.csHighestActiveSrvBinding >= 0) {
-            context->CSSetShaderResources(0, UINT(contextState.csHighestActiveSrvBinding + 1), nullsrvs.constData());
-            contextState.csHighestActiveSrvBinding = -1;
+        if (rs->contextState->csHighestActiveSrvBinding >= 0) {
+            rs->context->CSSetShaderResources(0, UINT(rs->contextState->csHighestActiveSrvBinding + 1), nullsrvs.constData());
+            rs->contextState->csHighestActiveSrvBinding = -1;
         }
     }
 
-    if (contextState.csHighestActiveUavBinding >= 0) {
-        const int nulluavCount = contextState.csHighestActiveUavBinding + 1;
+    if (rs->contextState->csHighestActiveUavBinding >= 0) {
+        const int nulluavCount = rs->contextState->csHighestActiveUavBinding + 1;
         QVarLengthArray<ID3D11UnorderedAccessView *,
                 D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT> nulluavs(nulluavCount);
         for (int i = 0; i < nulluavCount; ++i)
             nulluavs[i] = nullptr;
-        context->CSSetUnorderedAccessViews(0, UINT(nulluavCount), nulluavs.constData(), nullptr);
-        contextState.csHighestActiveUavBinding = -1;
+        rs->context->CSSetUnorderedAccessViews(0, UINT(nulluavCount), nulluavs.constData(), nullptr);
+        rs->contextState->csHighestActiveUavBinding = -1;
     }
 }
 
 #define SETSHADER(StageL, StageU) \
     if (psD->StageL.shader) { \
-        context->StageU##SetShader(psD->StageL.shader, nullptr, 0); \
-        currentShaderMask |= StageU##MaskBit; \
-    } else if (currentShaderMask & StageU##MaskBit) { \
-        context->StageU##SetShader(nullptr, nullptr, 0); \
-        currentShaderMask &= ~StageU##MaskBit; \
+        rs->context->StageU##SetShader(psD->StageL.shader, nullptr, 0); \
+        rs->currentShaderMask |= StageU##MaskBit; \
+    } else if (rs->currentShaderMask & StageU##MaskBit) { \
+        rs->context->StageU##SetShader(nullptr, nullptr, 0); \
+        rs->currentShaderMask &= ~StageU##MaskBit; \
     }
 
 void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
 {
-    quint32 stencilRef = 0;
-    float blendConstants[] = { 1, 1, 1, 1 };
+    // timings are only comparable when everything is replayed on this thread
+    if (!parallelReplay || replayTiming || !executeCommandBufferParallel(cbD)) {
+        ReplayState rs;
+        rs.context = context;
+        rs.annotations = annotations;
+        rs.contextState = &contextState;
+        rs.timing = replayTiming ? &currentFrameReplayTiming : nullptr;
+        replayCommands(&rs, cbD->commands.cbegin(), cbD->commands.cend());
+        currentFrameRedundantStateCalls.add(rs.filtered);
+    }
+
+    // The copies from these are on the context now. Mapping one again waits
+    // for (or, with DO_NOT_WAIT, reports) the GPU still using it.
+    for (ID3D11Texture2D *tex : std::as_const(pendingUploadStagingTextures))
+        recycleStagingTexture(tex);
+    pendingUploadStagingTextures.clear();
+}
+
+// With QT_D3D11_PARALLEL_REPLAY set (and driver command list support), the
+// commands between pass boundaries are replayed onto deferred contexts from
+// worker threads, one command list per pass, and the command lists are
+// executed in order on the immediate context. Every pass starts with a
+// ResetShaderResources and (re)binds everything it needs, so the only state
+// carried over from earlier passes is viewport, scissor, stencil reference and
+// blend constants, which get seeded explicitly. Debug markers, timing queries
+// and parallel recorders between passes stay on the immediate context and are
+// replayed in between the command lists. Markers inside a pass go to the
+// deferred context together with the rest of the pass.
+bool QRhiD3D11::executeCommandBufferParallel(QD3D11CommandBuffer *cbD)
+{
+    using Command = QD3D11CommandBuffer::Command;
+    const Command *begin = cbD->commands.cbegin();
+    const Command *end = cbD->commands.cend();
+
+    // The frame timestamp queries stay on the immediate context.
+    const Command *first = begin;
+    const Command *last = end;
+    if (first != last && first->cmd == Command::BeginFrame)
+        ++first;
+    if (first != last && (last - 1)->cmd == Command::EndFrame)
+        --last;
+
+    const auto isImmediateOnly = [](const Command &c) {
+        return c.cmd == Command::DebugMarkBegin || c.cmd == Command::DebugMarkEnd
+                || c.cmd == Command::DebugMarkMsg || c.cmd == Command::TimingQuery
+                || c.cmd == Command::ExecuteParallel;
+    };
+    while (first != last && isImmediateOnly(*first))
+        ++first;
+
+    // [begin, end) goes to a deferred context, [end, immediateEnd) is replayed
+    // on the immediate context afterwards.
+    struct Segment {
+        const Command *begin;
+        const Command *end;
+        const Command *immediateEnd;
+        const Command *viewport;
+        const Command *scissor;
+        quint32 stencilRef;
+        float blendConstants[4];
+    };
+    QVarLengthArray<Segment, 16> segments;
+    Segment seg = { first, first, first, nullptr, nullptr, 0, { 1, 1, 1, 1 } };
+    Segment current = seg; // dynamic state as of the command being scanned
+    const auto closeSegment = [&segments, &seg, &isImmediateOnly](const Command *c) {
+        seg.end = c;
+        while (seg.end != seg.begin && isImmediateOnly(*(seg.end - 1)))
+            --seg.end;
+        seg.immediateEnd = c;
+        segments.append(seg);
+    };
+    for (const Command *c = first; c != last; ++c) {
+        switch (c->cmd) {
+        case Command::ResetShaderResources:
+            if (c != seg.begin) {
+                closeSegment(c);
+                seg = current;
+                seg.begin = c;
+            }
+            break;
+        case Command::ExecuteParallel:
+            // needs the immediate context, always ends a segment
+            closeSegment(c + 1);
+            seg = current;
+            seg.begin = c + 1;
+            break;
+        case Command::Viewport:
+            current.viewport = c;
+            break;
+        case Command::Scissor:
+            current.scissor = c;
+            break;
+        case Command::StencilRef:
+            current.stencilRef = c->args.stencilRef.ref;
+            break;
+        case Command::BlendConstants:
+            memcpy(current.blendConstants, c->args.blendConstants.c, 4 * sizeof(float));
+            break;
+        default:
+            break;
+        }
+    }
+    if (seg.begin != last)
+        closeSegment(last);
+    if (segments.count() < 2)
+        return false;
+
+    // Split the segments into contiguous groups of roughly equal command count.
+    const int groupCount = qMin(qMin(MAX_REPLAY_CONTEXTS, QThread::idealThreadCount()), int(segments.count()));
+    if (groupCount < 2)
+        return false;
+    int groupFirstSegment[MAX_REPLAY_CONTEXTS + 1] = {};
+    {
+        const qsizetype commandsPerGroup = (last - first + groupCount - 1) / groupCount;
+        int g = 1;
+        for (int i = 1; i < segments.count() && g < groupCount; ++i) {
+            const qsizetype groupSize = segments[i].begin - segments[groupFirstSegment[g - 1]].begin;
+            const int segmentsLeft = int(segments.count()) - i;
+            if (groupSize >= commandsPerGroup || segmentsLeft == groupCount - g)
+                groupFirstSegment[g++] = i;
+        }
+        groupFirstSegment[g] = int(segments.count());
+        Q_ASSERT(g == groupCount);
+    }
+
+    if (!ensureDeferredContexts(groupCount)) {
+        qWarning("Falling back to serial replay");
+        parallelReplay = false;
+        return false;
+    }
+
+    const auto seedState = [this](ReplayState *rs, const Segment &s) {
+        if (s.viewport)
+            replayCommands(rs, s.viewport, s.viewport + 1);
+        if (s.scissor)
+            replayCommands(rs, s.scissor, s.scissor + 1);
+        rs->stencilRef = s.stencilRef;
+        memcpy(rs->blendConstants, s.blendConstants, 4 * sizeof(float));
+    };
+
+    QVarLengthArray<ID3D11CommandList *, 16> commandLists(segments.count(), nullptr);
+    QVarLengthArray<RedundantStateCounters, 16> filtered(segments.count());
+    for (int g = 0; g < groupCount; ++g) {
+        replayThreadPool->start([this, g, &segments, &groupFirstSegment, &commandLists, &filtered, &seedState] {
+            for (int i = groupFirstSegment[g]; i < groupFirstSegment[g + 1]; ++i) {
+                const Segment &s(segments[i]);
+                if (s.begin == s.end)
+                    continue;
+                // FinishCommandList() leaves the context in its default state
+                ContextState state;
+                ReplayState rs;
+                rs.context = deferredContexts[g];
+                rs.annotations = deferredAnnotations[g];
+                rs.contextState = &state;
+                seedState(&rs, s);
+                replayCommands(&rs, s.begin, s.end);
+                filtered[i] = rs.filtered;
+                const HRESULT hr = rs.context->FinishCommandList(FALSE, &commandLists[i]);
+                if (FAILED(hr)) {
+                    qWarning("Failed to finish command list: %s",
+                             qPrintable(QSystemError::windowsComString(hr)));
+                    commandLists[i] = nullptr;
+                }
+            }
+        });
+    }
+    replayThreadPool->waitForDone();
+
+    ReplayState rs;
+    rs.context = context;
+    rs.annotations = annotations;
+    rs.contextState = &contextState;
+    replayCommands(&rs, begin, first);
+    for (int i = 0; i < segments.count(); ++i) {
+        const Segment &s(segments[i]);
+        if (commandLists[i]) {
+            currentFrameRedundantStateCalls.add(filtered[i]);
+            context->ExecuteCommandList(commandLists[i], FALSE);
+            commandLists[i]->Release();
+            // Executing a command list leaves the immediate context in its
+            // default state, so forget what resetShaderResources() would unbind.
+            QD3D11SwapChain *currentSwapChain = contextState.currentSwapChain;
+            contextState = {};
+            contextState.currentSwapChain = currentSwapChain;
+        } else if (s.begin != s.end) {
+            // should not happen, but do not lose the commands if it does
+            ReplayState fallback;
+            fallback.context = context;
+            fallback.annotations = annotations;
+            fallback.contextState = &contextState;
+            seedState(&fallback, s);
+            replayCommands(&fallback, s.begin, s.end);
+            currentFrameRedundantStateCalls.add(fallback.filtered);
+        }
+        replayCommands(&rs, s.end, s.immediateEnd);
+    }
+    replayCommands(&rs, last, end);
+
+    return true;
+}
+
+bool QRhiD3D11::ensureDeferredContexts(int count)
+{
+    for (int i = 0; i < count; ++i) {
+        if (deferredContexts[i])
+            continue;
+        ID3D11DeviceContext *ctx = nullptr;
+        HRESULT hr = dev->CreateDeferredContext(0, &ctx);
+        if (SUCCEEDED(hr)) {
+            hr = ctx->QueryInterface(__uuidof(ID3D11DeviceContext1), reinterpret_cast<void **>(&deferredContexts[i]));
+            ctx->Release();
+        }
+        if (FAILED(hr)) {
+            qWarning("Failed to create deferred context: %s",
+                     qPrintable(QSystemError::windowsComString(hr)));
+            deferredContexts[i] = nullptr;
+            return false;
+        }
+        if (annotations) {
+            if (FAILED(deferredContexts[i]->QueryInterface(__uuidof(ID3DUserDefinedAnnotation),
+                                                           reinterpret_cast<void **>(&deferredAnnotations[i]))))
+            {
+                deferredAnnotations[i] = nullptr;
+            }
+        }
+    }
+
+    if (!replayThreadPool) {
+        replayThreadPool = new QThreadPool;
+        replayThreadPool->setMaxThreadCount(MAX_REPLAY_CONTEXTS);
+    }
+    return true;
+}
+
+// The recorders of one qt_rhi_d3d11_record_parallel() call. Each deferred
+// context takes every n-th recorder, in order, and produces one command list
+// per recorder, so the lists can be executed in the order the recorders were
+// given in.
+void QRhiD3D11::executeParallelRecorders(ReplayState *rs, const QList<QRhiD3D11ParallelRecorder> &recorders)
+{
+    const int count = int(recorders.count());
+    const int contextCount = qMin(qMin(MAX_REPLAY_CONTEXTS, QThread::idealThreadCount()), count);
+    if (contextCount >= 2 && ensureDeferredContexts(contextCount)) {
+        QVarLengthArray<ID3D11CommandList *, 16> commandLists(count, nullptr);
+        for (int g = 0; g < contextCount; ++g) {
+            replayThreadPool->start([this, g, count, contextCount, &recorders, &commandLists] {
+                for (int i = g; i < count; i += contextCount) {
+                    recorders[i](deferredContexts[g]);
+                    const HRESULT hr = deferredContexts[g]->FinishCommandList(FALSE, &commandLists[i]);
+                    if (FAILED(hr)) {
+                        qWarning("Failed to finish command list: %s",
+                                 qPrintable(QSystemError::windowsComString(hr)));
+                        commandLists[i] = nullptr;
+                    }
+                }
+            });
+        }
+        replayThreadPool->waitForDone();
+        for (ID3D11CommandList *commandList : std::as_const(commandLists)) {
+            if (commandList) {
+                rs->context->ExecuteCommandList(commandList, FALSE);
+                commandList->Release();
+            }
+        }
+    } else {
+        // nothing to gain from deferred contexts
+        for (const QRhiD3D11ParallelRecorder &recorder : recorders)
+            recorder(rs->context);
+    }
+
+    // Nothing is known about the context's state anymore.
+    QD3D11SwapChain *currentSwapChain = rs->contextState->currentSwapChain;
+    *rs->contextState = {};
+    rs->contextState->currentSwapChain = currentSwapChain;
+    rs->shadow = {};
+    rs->currentShaderMask = 0xFF;
+}
+
+// Makes the readback into result, enqueued later on while recording cb, swap
+// the red and blue channels and/or premultiply the pixels while copying them
+// out of the staging texture. RGBA8 and BGRA8 only. With SwapRedBlue the
+// result reports the other format.
+void qt_rhi_d3d11_set_readback_conversion(QRhiCommandBuffer *cb,
+                                          const QRhiReadbackResult *result,
+                                          QRhiD3D::PixelConversion conversion)
+{
+    QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
+    if (conversion)
+        cbD->readbackConversions.insert(result, conversion);
+    else
+        cbD->readbackConversions.remove(result);
+}
+
+// Records native commands into cb, to be made on worker threads when cb is
+// submitted, each recorder getting a deferred context. The resulting command
+// lists are executed in order on the immediate context, at this point of the
+// command stream. Must be called outside of passes; the state of the immediate
+// context is reset afterwards, like with beginExternal() and endExternal().
+void qt_rhi_d3d11_record_parallel(QRhiCommandBuffer *cb, const QList<QRhiD3D11ParallelRecorder> &recorders)
+{
+    QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
+    if (cbD->recordingPass != QD3D11CommandBuffer::NoPass) {
+        qWarning("qt_rhi_d3d11_record_parallel() cannot be called inside a pass");
+        return;
+    }
+    if (recorders.isEmpty())
+        return;
+
+    QD3D11CommandBuffer::Command &cmd(cbD->commands.get());
+    cmd.cmd = QD3D11CommandBuffer::Command::ExecuteParallel;
+    cmd.args.executeParallel.recorders = &cbD->recorderRetainPool.append(recorders);
+}
+
+// Returns the GPU timing scopes (QT_D3D11_GPU_TIMING_SCOPES) of the most
+// recently resolved frame as a compact JSON array of {"name", "ms",
+// "children"} objects, or an empty QByteArray if no frame has been resolved yet.
+QByteArray qt_rhi_d3d11_last_timing_scopes(QRhiCommandBuffer *cb)
+{
+    QD3D11CommandBuffer *cbD = QRHI_RES(QD3D11CommandBuffer, cb);
+    return static_cast<QRhiD3D11 *>(cbD->m_rhi)->lastTimingScopesJson;
+}
+
+void QRhiD3D11::replayCommands(ReplayState *rs,
+                               const QD3D11CommandBuffer::Command *begin,
+                               const QD3D11CommandBuffer::Command *end)
+{
     enum ActiveShaderMask {
         VSMaskBit = 0x01,
         HSMaskBit = 0x02,
@@ -2785,14 +3846,18 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
         GSMaskBit = 0x08,
         PSMaskBit = 0x10
     };
-    int currentShaderMask = 0xFF;
 
-    for (auto it = cbD->commands.cbegin(), end = cbD->commands.cend(); it != end; ++it) {
+    QElapsedTimer timer;
+    if (rs->timing)
+        timer.start();
+
+    for (auto it = begin; it != end; ++it) {
         const QD3D11CommandBuffer::Command &cmd(*it);
+        const qint64 commandStart = rs->timing ? timer.nsecsElapsed() : 0;
         switch (cmd.cmd) {
         case QD3D11CommandBuffer::Command::BeginFrame:
             if (cmd.args.beginFrame.tsDisjointQuery)
-                context->Begin(cmd.args.beginFrame.tsDisjointQuery);
+                rs->context->Begin(cmd.args.beginFrame.tsDisjointQuery);
             if (cmd.args.beginFrame.tsQuery) {
                 if (cmd.args.beginFrame.swapchainData) {
                     // The timestamps seem to include vsync time with Present(1), except
@@ -2800,24 +3865,28 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
                     // it around by issuing a semi-fake OMSetRenderTargets early and
                     // writing the first timestamp only afterwards.
                     QD3D11RenderTargetData *rtD = cmd.args.beginFrame.swapchainData;
-                    context->OMSetRenderTargets(UINT(rtD->colorAttCount), rtD->colorAttCount ? rtD->rtv : nullptr, rtD->dsv);
+                    rs->context->OMSetRenderTargets(UINT(rtD->colorAttCount), rtD->colorAttCount ? rtD->rtv : nullptr, rtD->dsv);
                 }
-                context->End(cmd.args.beginFrame.tsQuery); // no Begin() for D3D11_QUERY_TIMESTAMP
+                rs->context->End(cmd.args.beginFrame.tsQuery); // no Begin() for D3D11_QUERY_TIMESTAMP
             }
             break;
         case QD3D11CommandBuffer::Command::EndFrame:
             if (cmd.args.endFrame.tsQuery)
-                context->End(cmd.args.endFrame.tsQuery);
+                rs->context->End(cmd.args.endFrame.tsQuery);
             if (cmd.args.endFrame.tsDisjointQuery)
-                context->End(cmd.args.endFrame.tsDisjointQuery);
+                rs->context->End(cmd.args.endFrame.tsDisjointQuery);
             break;
         case QD3D11CommandBuffer::Command::ResetShaderResources:
-            resetShaderResources();
+            resetShaderResources(rs);
+            rs->shadow.indexBuffer = nullptr;
+            rs->shadow.srb = nullptr;
             break;
         case QD3D11CommandBuffer::Command::SetRenderTarget:
         {
+            // binding outputs may implicitly unbind conflicting inputs
+            rs->shadow.srb = nullptr;
             QD3D11RenderTargetData *rtD = rtData(cmd.args.setRenderTarget.rt);
-            context->OMSetRenderTargets(UINT(rtD->colorAttCount), rtD->colorAttCount ? rtD->rtv : nullptr, rtD->dsv);
+            rs->context->OMSetRenderTargets(UINT(rtD->colorAttCount), rtD->colorAttCount ? rtD->rtv : nullptr, rtD->dsv);
         }
             break;
         case QD3D11CommandBuffer::Command::Clear:
@@ -2825,7 +3894,7 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
             QD3D11RenderTargetData *rtD = rtData(cmd.args.clear.rt);
             if (cmd.args.clear.mask & QD3D11CommandBuffer::Command::Color) {
                 for (int i = 0; i < rtD->colorAttCount; ++i)
-                    context->ClearRenderTargetView(rtD->rtv[i], cmd.args.clear.c);
+                    rs->context->ClearRenderTargetView(rtD->rtv[i], cmd.args.clear.c);
             }
             uint ds = 0;
             if (cmd.args.clear.mask & QD3D11CommandBuffer::Command::Depth)
@@ -2833,7 +3902,7 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
             if (cmd.args.clear.mask & QD3D11CommandBuffer::Command::Stencil)
                 ds |= D3D11_CLEAR_STENCIL;
             if (ds)
-                context->ClearDepthStencilView(rtD->dsv, ds, cmd.args.clear.d, UINT8(cmd.args.clear.s));
+                rs->context->ClearDepthStencilView(rtD->dsv, ds, cmd.args.clear.d, UINT8(cmd.args.clear.s));
         }
             break;
         case QD3D11CommandBuffer::Command::Viewport:
@@ -2845,7 +3914,13 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
             v.Height = cmd.args.viewport.h;
             v.MinDepth = cmd.args.viewport.d0;
             v.MaxDepth = cmd.args.viewport.d1;
-            context->RSSetViewports(1, &v);
+            if (rs->shadow.viewportValid && !memcmp(&v, &rs->shadow.viewport, sizeof(v))) {
+                rs->filtered.viewport += 1;
+                break;
+            }
+            rs->shadow.viewport = v;
+            rs->shadow.viewportValid = true;
+            rs->context->RSSetViewports(1, &v);
         }
             break;
         case QD3D11CommandBuffer::Command::Scissor:
@@ -2856,22 +3931,38 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
             // right and bottom are exclusive
             r.right = cmd.args.scissor.x + cmd.args.scissor.w;
             r.bottom = cmd.args.scissor.y + cmd.args.scissor.h;
-            context->RSSetScissorRects(1, &r);
+            if (rs->shadow.scissorValid && !memcmp(&r, &rs->shadow.scissor, sizeof(r))) {
+                rs->filtered.scissor += 1;
+                break;
+            }
+            rs->shadow.scissor = r;
+            rs->shadow.scissorValid = true;
+            rs->context->RSSetScissorRects(1, &r);
         }
             break;
         case QD3D11CommandBuffer::Command::BindVertexBuffers:
-            contextState.vsHighestActiveVertexBufferBinding = qMax<int>(
-                        contextState.vsHighestActiveVertexBufferBinding,
+            rs->contextState->vsHighestActiveVertexBufferBinding = qMax<int>(
+                        rs->contextState->vsHighestActiveVertexBufferBinding,
                         cmd.args.bindVertexBuffers.startSlot + cmd.args.bindVertexBuffers.slotCount - 1);
-            context->IASetVertexBuffers(UINT(cmd.args.bindVertexBuffers.startSlot),
+            rs->context->IASetVertexBuffers(UINT(cmd.args.bindVertexBuffers.startSlot),
                                         UINT(cmd.args.bindVertexBuffers.slotCount),
                                         cmd.args.bindVertexBuffers.buffers,
                                         cmd.args.bindVertexBuffers.strides,
                                         cmd.args.bindVertexBuffers.offsets);
             break;
         case QD3D11CommandBuffer::Command::BindIndexBuffer:
-            contextState.vsHasIndexBufferBound = true;
-            context->IASetIndexBuffer(cmd.args.bindIndexBuffer.buffer,
+            if (rs->shadow.indexBuffer == cmd.args.bindIndexBuffer.buffer
+                    && rs->shadow.indexFormat == cmd.args.bindIndexBuffer.format
+                    && rs->shadow.indexOffset == cmd.args.bindIndexBuffer.offset)
+            {
+                rs->filtered.indexBuffer += 1;
+                break;
+            }
+            rs->shadow.indexBuffer = cmd.args.bindIndexBuffer.buffer;
+            rs->shadow.indexFormat = cmd.args.bindIndexBuffer.format;
+            rs->shadow.indexOffset = cmd.args.bindIndexBuffer.offset;
+            rs->contextState->vsHasIndexBufferBound = true;
+            rs->context->IASetIndexBuffer(cmd.args.bindIndexBuffer.buffer,
                                       cmd.args.bindIndexBuffer.format,
                                       cmd.args.bindIndexBuffer.offset);
             break;
@@ -2883,33 +3974,62 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
             SETSHADER(ds, DS)
             SETSHADER(gs, GS)
             SETSHADER(fs, PS)
-            context->IASetPrimitiveTopology(psD->d3dTopology);
-            context->IASetInputLayout(psD->inputLayout); // may be null, that's ok
-            context->OMSetDepthStencilState(psD->dsState, stencilRef);
-            context->OMSetBlendState(psD->blendState, blendConstants, 0xffffffff);
-            context->RSSetState(psD->rastState);
+            rs->context->IASetPrimitiveTopology(psD->d3dTopology);
+            rs->context->IASetInputLayout(psD->inputLayout); // may be null, that's ok
+            rs->context->OMSetDepthStencilState(psD->dsState, rs->stencilRef);
+            rs->context->OMSetBlendState(psD->blendState, rs->blendConstants, 0xffffffff);
+            rs->context->RSSetState(psD->rastState);
+            rs->shadow.dsState = psD->dsState;
+            rs->shadow.stencilRef = rs->stencilRef;
+            rs->shadow.blendState = psD->blendState;
+            memcpy(rs->shadow.blendConstants, rs->blendConstants, 4 * sizeof(float));
         }
             break;
         case QD3D11CommandBuffer::Command::BindShaderResources:
-            bindShaderResources(cmd.args.bindShaderResources.srb,
+            if (rs->shadow.srb == cmd.args.bindShaderResources.srb
+                    && rs->shadow.dynamicOffsetCount == cmd.args.bindShaderResources.dynamicOffsetCount
+                    && !memcmp(rs->shadow.dynamicOffsetPairs, cmd.args.bindShaderResources.dynamicOffsetPairs,
+                               2 * rs->shadow.dynamicOffsetCount * sizeof(uint)))
+            {
+                rs->filtered.shaderResources += 1;
+                break;
+            }
+            rs->shadow.srb = cmd.args.bindShaderResources.srb;
+            rs->shadow.dynamicOffsetPairs = cmd.args.bindShaderResources.dynamicOffsetPairs;
+            rs->shadow.dynamicOffsetCount = cmd.args.bindShaderResources.dynamicOffsetCount;
+            bindShaderResources(rs, cmd.args.bindShaderResources.srb,
                                 cmd.args.bindShaderResources.dynamicOffsetPairs,
                                 cmd.args.bindShaderResources.dynamicOffsetCount,
                                 cmd.args.bindShaderResources.offsetOnlyChange);
             break;
         case QD3D11CommandBuffer::Command::StencilRef:
-            stencilRef = cmd.args.stencilRef.ref;
-            context->OMSetDepthStencilState(cmd.args.stencilRef.ps->dsState, stencilRef);
+            rs->stencilRef = cmd.args.stencilRef.ref;
+            if (rs->shadow.dsState == cmd.args.stencilRef.ps->dsState && rs->shadow.stencilRef == rs->stencilRef) {
+                rs->filtered.stencilRef += 1;
+                break;
+            }
+            rs->shadow.dsState = cmd.args.stencilRef.ps->dsState;
+            rs->shadow.stencilRef = rs->stencilRef;
+            rs->context->OMSetDepthStencilState(cmd.args.stencilRef.ps->dsState, rs->stencilRef);
             break;
         case QD3D11CommandBuffer::Command::BlendConstants:
-            memcpy(blendConstants, cmd.args.blendConstants.c, 4 * sizeof(float));
-            context->OMSetBlendState(cmd.args.blendConstants.ps->blendState, blendConstants, 0xffffffff);
+            memcpy(rs->blendConstants, cmd.args.blendConstants.c, 4 * sizeof(float));
+            if (rs->shadow.blendState == cmd.args.blendConstants.ps->blendState
+                    && !memcmp(rs->shadow.blendConstants, rs->blendConstants, 4 * sizeof(float)))
+            {
+                rs->filtered.blendConstants += 1;
+                break;
+            }
+            rs->shadow.blendState = cmd.args.blendConstants.ps->blendState;
+            memcpy(rs->shadow.blendConstants, rs->blendConstants, 4 * sizeof(float));
+            rs->context->OMSetBlendState(cmd.args.blendConstants.ps->blendState, rs->blendConstants, 0xffffffff);
             break;
         case QD3D11CommandBuffer::Command::Draw:
             if (cmd.args.draw.ps) {
                 if (cmd.args.draw.instanceCount == 1 && cmd.args.draw.firstInstance == 0)
-                    context->Draw(cmd.args.draw.vertexCount, cmd.args.draw.firstVertex);
+                    rs->context->Draw(cmd.args.draw.vertexCount, cmd.args.draw.firstVertex);
                 else
-                    context->DrawInstanced(cmd.args.draw.vertexCount, cmd.args.draw.instanceCount,
+                    rs->context->DrawInstanced(cmd.args.draw.vertexCount, cmd.args.draw.instanceCount,
                                            cmd.args.draw.firstVertex, cmd.args.draw.firstInstance);
             } else {
                 qWarning("No graphics pipeline active for draw; ignored");
@@ -2918,10 +4038,10 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
         case QD3D11CommandBuffer::Command::DrawIndexed:
             if (cmd.args.drawIndexed.ps) {
                 if (cmd.args.drawIndexed.instanceCount == 1 && cmd.args.drawIndexed.firstInstance == 0)
-                    context->DrawIndexed(cmd.args.drawIndexed.indexCount, cmd.args.drawIndexed.firstIndex,
+                    rs->context->DrawIndexed(cmd.args.drawIndexed.indexCount, cmd.args.drawIndexed.firstIndex,
                                          cmd.args.drawIndexed.vertexOffset);
                 else
-                    context->DrawIndexedInstanced(cmd.args.drawIndexed.indexCount, cmd.args.drawIndexed.instanceCount,
+                    rs->context->DrawIndexedInstanced(cmd.args.drawIndexed.indexCount, cmd.args.drawIndexed.instanceCount,
                                                   cmd.args.drawIndexed.firstIndex, cmd.args.drawIndexed.vertexOffset,
                                                   cmd.args.drawIndexed.firstInstance);
             } else {
@@ -2929,42 +4049,60 @@ void QRhiD3D11::executeCommandBuffer(QD3D11CommandBuffer *cbD)
             }
             break;
         case QD3D11CommandBuffer::Command::UpdateSubRes:
-            context->UpdateSubresource(cmd.args.updateSubRes.dst, cmd.args.updateSubRes.dstSubRes,
+            rs->context->UpdateSubresource(cmd.args.updateSubRes.dst, cmd.args.updateSubRes.dstSubRes,
                                        cmd.args.updateSubRes.hasDstBox ? &cmd.args.updateSubRes.dstBox : nullptr,
                                        cmd.args.updateSubRes.src, cmd.args.updateSubRes.srcRowPitch, 0);
             break;
         case QD3D11CommandBuffer::Command::CopySubRes:
-            context->CopySubresourceRegion(cmd.args.copySubRes.dst, cmd.args.copySubRes.dstSubRes,
+            rs->context->CopySubresourceRegion(cmd.args.copySubRes.dst, cmd.args.copySubRes.dstSubRes,
                                            cmd.args.copySubRes.dstX, cmd.args.copySubRes.dstY, cmd.args.copySubRes.dstZ,
                                            cmd.args.copySubRes.src, cmd.args.copySubRes.srcSubRes,
                                            cmd.args.copySubRes.hasSrcBox ? &cmd.args.copySubRes.srcBox : nullptr);
             break;
         case QD3D11CommandBuffer::Command::ResolveSubRes:
-            context->ResolveSubresource(cmd.args.resolveSubRes.dst, cmd.args.resolveSubRes.dstSubRes,
+            rs->context->ResolveSubresource(cmd.args.resolveSubRes.dst, cmd.args.resolveSubRes.dstSubRes,
                                         cmd.args.resolveSubRes.src, cmd.args.resolveSubRes.srcSubRes,
                                         cmd.args.resolveSubRes.format);
             break;
         case QD3D11CommandBuffer::Command::GenMip:
-            context->GenerateMips(cmd.args.genMip.srv);
+            rs->context->GenerateMips(cmd.args.genMip.srv);
             break;
         case QD3D11CommandBuffer::Command::DebugMarkBegin:
-            annotations->BeginEvent(reinterpret_cast<LPCWSTR>(QString::fromLatin1(cmd.args.debugMark.s).utf16()));
+            if (rs->annotations)
+                rs->annotations->BeginEvent(reinterpret_cast<LPCWSTR>(QString::fromLatin1(cmd.args.debugMark.s).utf16()));
             break;
         case QD3D11CommandBuffer::Command::DebugMarkEnd:
-            annotations->EndEvent();
+            if (rs->annotations)
+                rs->annotations->EndEvent();
             break;
         case QD3D11CommandBuffer::Command::DebugMarkMsg:
-            annotations->SetMarker(reinterpret_cast<LPCWSTR>(QString::fromLatin1(cmd.args.debugMark.s).utf16()));
+            if (rs->annotations)
+                rs->annotations->SetMarker(reinterpret_cast<LPCWSTR>(QString::fromLatin1(cmd.args.debugMark.s).utf16()));
             break;
         case QD3D11CommandBuffer::Command::BindComputePipeline:
-            context->CSSetShader(cmd.args.bindComputePipeline.ps->cs.shader, nullptr, 0);
+            rs->context->CSSetShader(cmd.args.bindComputePipeline.ps->cs.shader, nullptr, 0);
             break;
         case QD3D11CommandBuffer::Command::Dispatch:
-            context->Dispatch(cmd.args.dispatch.x, cmd.args.dispatch.y, cmd.args.dispatch.z);
+            rs->context->Dispatch(cmd.args.dispatch.x, cmd.args.dispatch.y, cmd.args.dispatch.z);
+            break;
+        case QD3D11CommandBuffer::Command::TimingQuery:
+            if (cmd.args.timingQuery.begin)
+                rs->context->Begin(cmd.args.timingQuery.query);
+            else
+                rs->context->End(cmd.args.timingQuery.query);
+            break;
+        case QD3D11CommandBuffer::Command::ExecuteParallel:
+            // never put on a deferred context, see executeCommandBufferParallel()
+            Q_ASSERT(rs->context == context);
+            executeParallelRecorders(rs, *cmd.args.executeParallel.recorders);
             break;
         default:
             break;
         }
+        if (rs->timing) {
+            rs->timing->count[cmd.cmd] += 1;
+            rs->timing->nsecs[cmd.cmd] += timer.nsecsElapsed() - commandStart;
+        }
     }
 }
 
@@ -2988,6 +4126,7 @@ void QD3D11Buffer::destroy()
 
     delete[] dynBuf;
     dynBuf = nullptr;
+    dirtyRanges.clear();
 
     for (auto it = uavs.begin(), end = uavs.end(); it != end; ++it)
         it.value()->Release();
@@ -2998,6 +4137,8 @@ void QD3D11Buffer::destroy()
         rhiD->unregisterResource(this);
 }
 
+static const quint32 MIN_PARTIAL_UPLOAD_DYNAMIC_BUFFER_SIZE = 64 * 1024;
+
 static inline uint toD3DBufferUsage(QRhiBuffer::UsageFlags usage)
 {
     int u = 0;
@@ -3030,14 +4171,26 @@ bool QD3D11Buffer::create()
     const quint32 nonZeroSize = m_size <= 0 ? 256 : m_size;
     const quint32 roundedSize = aligned(nonZeroSize, m_usage.testFlag(QRhiBuffer::UniformBuffer) ? 256u : 4u);
 
+    QRHI_RES_RHI(QRhiD3D11);
+
+    // Large dynamic vertex/index buffers often get only a small part changed
+    // per frame, mapping with WRITE_DISCARD would mean copying all of it.
+    // Opt-in since the buffer is then no longer USAGE_DYNAMIC, which is
+    // visible to anyone using nativeBuffer(). Constant buffers stay
+    // USAGE_DYNAMIC since partial updates for those need D3D 11.1 and 16 byte
+    // aligned ranges.
+    dynamicWithDefaultUsage = rhiD->partialDynamicUploads
+            && m_type == Dynamic
+            && !m_usage.testFlag(QRhiBuffer::UniformBuffer)
+            && nonZeroSize >= MIN_PARTIAL_UPLOAD_DYNAMIC_BUFFER_SIZE;
+
     D3D11_BUFFER_DESC desc = {};
     desc.ByteWidth = roundedSize;
-    desc.Usage = m_type == Dynamic ? D3D11_USAGE_DYNAMIC : D3D11_USAGE_DEFAULT;
+    desc.Usage = m_type == Dynamic && !dynamicWithDefaultUsage ? D3D11_USAGE_DYNAMIC : D3D11_USAGE_DEFAULT;
     desc.BindFlags = toD3DBufferUsage(m_usage);
-    desc.CPUAccessFlags = m_type == Dynamic ? D3D11_CPU_ACCESS_WRITE : 0;
+    desc.CPUAccessFlags = m_type == Dynamic && !dynamicWithDefaultUsage ? D3D11_CPU_ACCESS_WRITE : 0;
     desc.MiscFlags = m_usage.testFlag(QRhiBuffer::StorageBuffer) ? D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS : 0;
 
-    QRHI_RES_RHI(QRhiD3D11);
     HRESULT hr = rhiD->dev->CreateBuffer(&desc, nullptr, &buffer);
     if (FAILED(hr)) {
         qWarning("Failed to create buffer: %s",
@@ -3058,6 +4211,9 @@ bool QD3D11Buffer::create()
     return true;
 }
 
+// With QT_D3D11_PARTIAL_DYNAMIC_UPLOADS set, a large Dynamic buffer that is not
+// a uniform buffer is USAGE_DEFAULT with no CPU access, so it cannot be mapped
+// by the caller.
 QRhiBuffer::NativeBuffer QD3D11Buffer::nativeBuffer()
 {
     if (m_type == Dynamic) {
@@ -3076,6 +4232,11 @@ char *QD3D11Buffer::beginFullDynamicBufferUpdateForCurrentFrame()
     // fast path for dynamic buffers that have all their content changed in
     // every frame.
     Q_ASSERT(m_type == Dynamic);
+    // Not mappable, write to the copy instead, which then gets uploaded as a
+    // whole. This also keeps dynBuf in sync for this kind of buffers.
+    if (dynamicWithDefaultUsage)
+        return dynBuf;
+
     D3D11_MAPPED_SUBRESOURCE mp;
     QRHI_RES_RHI(QRhiD3D11);
     HRESULT hr = rhiD->context->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mp);
@@ -3089,6 +4250,13 @@ char *QD3D11Buffer::beginFullDynamicBufferUpdateForCurrentFrame()
 
 void QD3D11Buffer::endFullDynamicBufferUpdateForCurrentFrame()
 {
+    if (dynamicWithDefaultUsage) {
+        hasPendingDynamicUpdates = true;
+        dirtyRanges.clear();
+        dirtyRanges.append({ 0, m_size });
+        return;
+    }
+
     QRHI_RES_RHI(QRhiD3D11);
     rhiD->context->Unmap(buffer, 0);
 }
@@ -3751,12 +4919,8 @@ bool QD3D11Sampler::create()
     desc.MaxLOD = m_mipmapMode == None ? 0.0f : 1000.0f;
 
     QRHI_RES_RHI(QRhiD3D11);
-    HRESULT hr = rhiD->dev->CreateSamplerState(&desc, &samplerState);
-    if (FAILED(hr)) {
-        qWarning("Failed to create sampler state: %s",
-            qPrintable(QSystemError::windowsComString(hr)));
+    if (!rhiD->cachedStateObject(desc, &samplerState))
         return false;
-    }
 
     generation += 1;
     rhiD->registerResource(this);
@@ -4416,14 +5580,6 @@ static inline D3D11_BLEND_OP toD3DBlendOp(QRhiGraphicsPipeline::BlendOp op)
     }
 }
 
-static inline QByteArray sourceHash(const QByteArray &source)
-{
-    // taken from the GL backend, use the same mechanism to get a key
-    QCryptographicHash keyBuilder(QCryptographicHash::Sha1);
-    keyBuilder.addData(source);
-    return keyBuilder.result().toHex();
-}
-
 QByteArray QRhiD3D11::compileHlslShaderSource(const QShader &shader, QShader::Variant shaderVariant, uint flags,
                                               QString *error, QShaderKey *usedShaderKey)
 {
@@ -4470,16 +5626,23 @@ QByteArray QRhiD3D11::compileHlslShaderSource(const QShader &shader, QShader::Va
         return QByteArray();
     }
 
+    QRhiD3D::BytecodeStore *store = QRhiD3D::BytecodeStore::instance();
     BytecodeCacheKey cacheKey;
+    cacheKey.sourceHash = store->sourceHash(hlslSource.shader());
+    cacheKey.target = target;
+    cacheKey.entryPoint = hlslSource.entryPoint();
+    cacheKey.compileFlags = flags;
     if (rhiFlags.testFlag(QRhi::EnablePipelineCacheDataSave)) {
-        cacheKey.sourceHash = sourceHash(hlslSource.shader());
-        cacheKey.target = target;
-        cacheKey.entryPoint = hlslSource.entryPoint();
-        cacheKey.compileFlags = flags;
         auto cacheIt = m_bytecodeCache.constFind(cacheKey);
         if (cacheIt != m_bytecodeCache.constEnd())
             return cacheIt.value();
     }
+    const QByteArray storedBytecode = store->lookup(cacheKey);
+    if (!storedBytecode.isEmpty()) {
+        if (rhiFlags.testFlag(QRhi::EnablePipelineCacheDataSave))
+            m_bytecodeCache.insert(cacheKey, storedBytecode);
+        return storedBytecode;
+    }
 
     static const pD3DCompile d3dCompile = QRhiD3D::resolveD3DCompile();
     if (d3dCompile == nullptr) {
@@ -4507,6 +5670,7 @@ QByteArray QRhiD3D11::compileHlslShaderSource(const QShader &shader, QShader::Va
     memcpy(result.data(), bytecode->GetBufferPointer(), size_t(result.size()));
     bytecode->Release();
 
+    store->insert(cacheKey, result);
     if (rhiFlags.testFlag(QRhi::EnablePipelineCacheDataSave))
         m_bytecodeCache.insert(cacheKey, result);
 
@@ -4532,12 +5696,8 @@ bool QD3D11GraphicsPipeline::create()
     rastDesc.DepthClipEnable = true;
     rastDesc.ScissorEnable = m_flags.testFlag(UsesScissor);
     rastDesc.MultisampleEnable = rhiD->effectiveSampleDesc(m_sampleCount).Count > 1;
-    HRESULT hr = rhiD->dev->CreateRasterizerState(&rastDesc, &rastState);
-    if (FAILED(hr)) {
-        qWarning("Failed to create rasterizer state: %s",
-            qPrintable(QSystemError::windowsComString(hr)));
+    if (!rhiD->cachedStateObject(rastDesc, &rastState))
         return false;
-    }
 
     D3D11_DEPTH_STENCIL_DESC dsDesc = {};
     dsDesc.DepthEnable = m_depthTest;
@@ -4556,12 +5716,8 @@ bool QD3D11GraphicsPipeline::create()
         dsDesc.BackFace.StencilPassOp = toD3DStencilOp(m_stencilBack.passOp);
         dsDesc.BackFace.StencilFunc = toD3DCompareOp(m_stencilBack.compareOp);
     }
-    hr = rhiD->dev->CreateDepthStencilState(&dsDesc, &dsState);
-    if (FAILED(hr)) {
-        qWarning("Failed to create depth-stencil state: %s",
-            qPrintable(QSystemError::windowsComString(hr)));
+    if (!rhiD->cachedStateObject(dsDesc, &dsState))
         return false;
-    }
 
     D3D11_BLEND_DESC blendDesc = {};
     blendDesc.IndependentBlendEnable = m_targetBlends.count() > 1;
@@ -4583,13 +5739,10 @@ bool QD3D11GraphicsPipeline::create()
         blend.RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
         blendDesc.RenderTarget[0] = blend;
     }
-    hr = rhiD->dev->CreateBlendState(&blendDesc, &blendState);
-    if (FAILED(hr)) {
-        qWarning("Failed to create blend state: %s",
-            qPrintable(QSystemError::windowsComString(hr)));
+    if (!rhiD->cachedStateObject(blendDesc, &blendState))
         return false;
-    }
 
+    HRESULT hr = S_OK;
     QByteArray vsByteCode;
     for (const QRhiShaderStage &shaderStage : std::as_const(m_shaderStages)) {
         auto cacheIt = rhiD->m_shaderCache.constFind(shaderStage);
@@ -4744,13 +5897,8 @@ bool QD3D11GraphicsPipeline::create()
             inputDescs.append(desc);
         }
         if (!inputDescs.isEmpty()) {
-            hr = rhiD->dev->CreateInputLayout(inputDescs.constData(), UINT(inputDescs.count()),
-                                              vsByteCode, SIZE_T(vsByteCode.size()), &inputLayout);
-            if (FAILED(hr)) {
-                qWarning("Failed to create input layout: %s",
-                    qPrintable(QSystemError::windowsComString(hr)));
+            if (!rhiD->cachedInputLayout(inputDescs.constData(), int(inputDescs.count()), vsByteCode, &inputLayout))
                 return false;
-            }
         } // else leave inputLayout set to nullptr; that's valid and it avoids a debug layer warning about an input layout with 0 elements
     }
 
@@ -4842,6 +5990,30 @@ QD3D11CommandBuffer::QD3D11CommandBuffer(QRhiImplementation *rhi)
 QD3D11CommandBuffer::~QD3D11CommandBuffer()
 {
     destroy();
+
+    for (PayloadChunk &chunk : payloadChunks)
+        free(chunk.data);
+}
+
+void *QD3D11CommandBuffer::allocPayload(qsizetype size)
+{
+    size = aligned(size, qsizetype(sizeof(void *)));
+    while (currentPayloadChunk < payloadChunks.count()) {
+        PayloadChunk &chunk(payloadChunks[currentPayloadChunk]);
+        if (currentPayloadOffset + size <= chunk.size) {
+            void *p = chunk.data + currentPayloadOffset;
+            currentPayloadOffset += size;
+            return p;
+        }
+        ++currentPayloadChunk;
+        currentPayloadOffset = 0;
+    }
+    const qsizetype chunkSize = qMax(size, PAYLOAD_CHUNK_SIZE);
+    payloadChunks.append({ static_cast<char *>(malloc(size_t(chunkSize))), chunkSize });
+    Q_CHECK_PTR(payloadChunks.last().data);
+    currentPayloadChunk = int(payloadChunks.count()) - 1;
+    currentPayloadOffset = size;
+    return payloadChunks.last().data;
 }
 
 void QD3D11CommandBuffer::destroy()
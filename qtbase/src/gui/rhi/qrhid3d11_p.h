@@ -16,6 +16,10 @@
 //
 
 #include "qrhi_p.h"
+#include "qrhid3dalgorithms_p.h"
+#include "qrhid3dbytecodestore_p.h"
+#include "qrhid3dpitchedcopy_p.h"
+#include "qrhid3dtimingscopes_p.h"
 #include <rhi/qshaderdescription.h>
 #include <QWindow>
 
@@ -23,9 +27,16 @@
 #include <dxgi1_6.h>
 #include <dcomp.h>
 
+#include <functional>
+
 QT_BEGIN_NAMESPACE
 
 class QRhiD3D11;
+class QThreadPool;
+
+// Records native commands on the given (deferred) context, see
+// qt_rhi_d3d11_record_parallel().
+typedef std::function<void(ID3D11DeviceContext *context)> QRhiD3D11ParallelRecorder;
 
 struct QD3D11Buffer : public QRhiBuffer
 {
@@ -42,6 +53,8 @@ struct QD3D11Buffer : public QRhiBuffer
     ID3D11Buffer *buffer = nullptr;
     char *dynBuf = nullptr;
     bool hasPendingDynamicUpdates = false;
+    bool dynamicWithDefaultUsage = false;
+    QVarLengthArray<QPair<quint32, quint32>, 4> dirtyRanges; // [start, end)
     QHash<quint32, ID3D11UnorderedAccessView *> uavs;
     uint generation = 0;
     friend class QRhiD3D11;
@@ -228,20 +241,19 @@ struct QD3D11ShaderResourceBindings : public QRhiShaderResourceBindings
     struct StageUniformBufferBatches {
         bool present = false;
         QRhiBatchedBindings<ID3D11Buffer *> ubufs;
-        QRhiBatchedBindings<UINT> ubuforigbindings;
         QRhiBatchedBindings<UINT> ubufoffsets;
         QRhiBatchedBindings<UINT> ubufsizes;
+        int flatOffsetBase = 0; // index of the first offset in flatUbufOffsets
         void finish() {
             present = ubufs.finish();
-            ubuforigbindings.finish();
             ubufoffsets.finish();
             ubufsizes.finish();
         }
         void clear() {
             ubufs.clear();
-            ubuforigbindings.clear();
             ubufoffsets.clear();
             ubufsizes.clear();
+            flatOffsetBase = 0;
         }
     };
 
@@ -286,6 +298,17 @@ struct QD3D11ShaderResourceBindings : public QRhiShaderResourceBindings
 
     StageUavBatches csUavBatches;
 
+    // The static uniform buffer offsets of all stages, in batch order, and
+    // for each QRhi binding the places in there where its offset goes, so
+    // that dynamic offsets can be patched in without searching.
+    struct DynamicOffsetTarget {
+        uint binding;
+        int flatIndex;
+    };
+    QVarLengthArray<UINT, 16> flatUbufOffsets;
+    QVarLengthArray<DynamicOffsetTarget, 16> dynamicOffsetTargets; // sorted by binding
+    QVarLengthArray<int, 16> dynamicOffsetTargetIndex; // binding -> first in dynamicOffsetTargets, or -1
+
     friend class QRhiD3D11;
 };
 
@@ -344,16 +367,48 @@ struct QD3D11ComputePipeline : public QRhiComputePipeline
 
 struct QD3D11SwapChain;
 
+// Keeps (implicitly shared) data alive until the commands referencing it have
+// been executed. Elements live in fixed size chunks which are never moved and
+// are reused after clear(), so appending neither reallocates nor copies the
+// already retained elements.
+template<typename T>
+struct QD3D11RetainPool
+{
+    static const int CHUNK_SIZE = 64;
+
+    QD3D11RetainPool() = default;
+    ~QD3D11RetainPool() {
+        clear();
+        for (T *chunk : std::as_const(chunks))
+            ::operator delete(chunk);
+    }
+    Q_DISABLE_COPY(QD3D11RetainPool)
+
+    const T &append(const T &value) {
+        const int chunkIndex = count / CHUNK_SIZE;
+        if (chunkIndex == chunks.count())
+            chunks.append(static_cast<T *>(::operator new(CHUNK_SIZE * sizeof(T))));
+        T *p = chunks[chunkIndex] + count % CHUNK_SIZE;
+        new (p) T(value);
+        ++count;
+        return *p;
+    }
+    void clear() {
+        for (int i = 0; i < count; ++i)
+            (chunks[i / CHUNK_SIZE] + i % CHUNK_SIZE)->~T();
+        count = 0;
+    }
+
+    QVarLengthArray<T *, 4> chunks;
+    int count = 0;
+};
+
 struct QD3D11CommandBuffer : public QRhiCommandBuffer
 {
     QD3D11CommandBuffer(QRhiImplementation *rhi);
     ~QD3D11CommandBuffer();
     void destroy() override;
 
-    // these must be kept at a reasonably low value otherwise sizeof Command explodes
-    static const int MAX_DYNAMIC_OFFSET_COUNT = 8;
-    static const int MAX_VERTEX_BUFFER_BINDING_COUNT = 8;
-
     struct Command {
         enum Cmd {
             BeginFrame,
@@ -379,13 +434,16 @@ struct QD3D11CommandBuffer : public QRhiCommandBuffer
             DebugMarkEnd,
             DebugMarkMsg,
             BindComputePipeline,
-            Dispatch
+            Dispatch,
+            TimingQuery,
+            ExecuteParallel
         };
         enum ClearFlag { Color = 1, Depth = 2, Stencil = 4 };
         Cmd cmd;
 
         // QRhi*/QD3D11* references should be kept at minimum (so no
-        // QRhiTexture/Buffer/etc. pointers).
+        // QRhiTexture/Buffer/etc. pointers). Variable-length data lives in the
+        // payload arena (allocPayload()), keeping sizeof(Command) small.
         union Args {
             struct {
                 ID3D11Query *tsQuery;
@@ -416,9 +474,9 @@ struct QD3D11CommandBuffer : public QRhiCommandBuffer
             struct {
                 int startSlot;
                 int slotCount;
-                ID3D11Buffer *buffers[MAX_VERTEX_BUFFER_BINDING_COUNT];
-                UINT offsets[MAX_VERTEX_BUFFER_BINDING_COUNT];
-                UINT strides[MAX_VERTEX_BUFFER_BINDING_COUNT];
+                ID3D11Buffer **buffers; // slotCount elements each, from allocPayload()
+                UINT *offsets;
+                UINT *strides;
             } bindVertexBuffers;
             struct {
                 ID3D11Buffer *buffer;
@@ -432,7 +490,7 @@ struct QD3D11CommandBuffer : public QRhiCommandBuffer
                 QD3D11ShaderResourceBindings *srb;
                 bool offsetOnlyChange;
                 int dynamicOffsetCount;
-                uint dynamicOffsetPairs[MAX_DYNAMIC_OFFSET_COUNT * 2]; // binding, offsetInConstants
+                const uint *dynamicOffsetPairs; // binding, offsetInConstants; from allocPayload()
             } bindShaderResources;
             struct {
                 QD3D11GraphicsPipeline *ps;
@@ -487,7 +545,7 @@ struct QD3D11CommandBuffer : public QRhiCommandBuffer
                 ID3D11ShaderResourceView *srv;
             } genMip;
             struct {
-                char s[64];
+                const char *s; // from allocPayload()
             } debugMark;
             struct {
                 QD3D11ComputePipeline *ps;
@@ -497,6 +555,13 @@ struct QD3D11CommandBuffer : public QRhiCommandBuffer
                 UINT y;
                 UINT z;
             } dispatch;
+            struct {
+                ID3D11Query *query;
+                bool begin;
+            } timingQuery;
+            struct {
+                const QList<QRhiD3D11ParallelRecorder> *recorders; // from recorderRetainPool
+            } executeParallel;
         } args;
     };
 
@@ -522,31 +587,58 @@ struct QD3D11CommandBuffer : public QRhiCommandBuffer
     ID3D11Buffer *currentVertexBuffers[D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT];
     quint32 currentVertexOffsets[D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT];
 
-    QVarLengthArray<QByteArray, 4> dataRetainPool;
-    QVarLengthArray<QRhiBufferData, 4> bufferDataRetainPool;
-    QVarLengthArray<QImage, 4> imageRetainPool;
+    // Bump allocator for command payloads. Chunks are kept (and reused) until
+    // the command buffer is destroyed, so pointers stay valid until resetCommands().
+    static const qsizetype PAYLOAD_CHUNK_SIZE = 16384;
+    struct PayloadChunk {
+        char *data;
+        qsizetype size;
+    };
+    QVarLengthArray<PayloadChunk, 4> payloadChunks;
+    int currentPayloadChunk = 0;
+    qsizetype currentPayloadOffset = 0;
+    void *allocPayload(qsizetype size);
+    template<typename T>
+    T *allocPayload(int count) {
+        return static_cast<T *>(allocPayload(count * qsizetype(sizeof(T))));
+    }
+    const char *copyString(const QByteArray &str) {
+        char *p = allocPayload<char>(str.size() + 1);
+        memcpy(p, str.constData(), str.size());
+        p[str.size()] = '\0';
+        return p;
+    }
+
+    QD3D11RetainPool<QByteArray> dataRetainPool;
+    QD3D11RetainPool<QRhiBufferData> bufferDataRetainPool;
+    QD3D11RetainPool<QImage> imageRetainPool;
+    QD3D11RetainPool<QList<QRhiD3D11ParallelRecorder>> recorderRetainPool;
+
+    // see qt_rhi_d3d11_set_readback_conversion()
+    QHash<const QRhiReadbackResult *, QRhiD3D::PixelConversion> readbackConversions;
 
     // relies heavily on implicit sharing (no copies of the actual data will be made)
     const uchar *retainData(const QByteArray &data) {
-        dataRetainPool.append(data);
-        return reinterpret_cast<const uchar *>(dataRetainPool.last().constData());
+        return reinterpret_cast<const uchar *>(dataRetainPool.append(data).constData());
     }
     const uchar *retainBufferData(const QRhiBufferData &data) {
-        bufferDataRetainPool.append(data);
-        return reinterpret_cast<const uchar *>(bufferDataRetainPool.last().constData());
+        return reinterpret_cast<const uchar *>(bufferDataRetainPool.append(data).constData());
     }
     const uchar *retainImage(const QImage &image) {
-        imageRetainPool.append(image);
-        return imageRetainPool.last().constBits();
+        return imageRetainPool.append(image).constBits();
     }
     void resetCommands() {
         commands.reset();
+        currentPayloadChunk = 0;
+        currentPayloadOffset = 0;
         dataRetainPool.clear();
         bufferDataRetainPool.clear();
         imageRetainPool.clear();
+        recorderRetainPool.clear();
     }
     void resetState() {
         recordingPass = NoPass;
+        readbackConversions.clear();
         // do not zero lastGpuTime
         currentTarget = nullptr;
         resetCommands();
@@ -630,6 +722,34 @@ struct QD3D11SwapChain : public QRhiSwapChain
     int lastFrameLatencyWaitSlot = -1;
 };
 
+// Staging resources kept around for reuse, looked up by (format, size, CPU
+// access). Buffers use DXGI_FORMAT_UNKNOWN and their byte size as the width.
+// When full, the least recently used entry is released.
+struct QD3D11StagingPool
+{
+    static const int MAX_ENTRIES = 8;
+
+    struct Key {
+        DXGI_FORMAT format;
+        UINT width;
+        UINT height;
+        UINT cpuAccessFlags;
+    };
+    struct Entry {
+        Key key;
+        ID3D11Resource *resource;
+        quint64 lastUsedFrame;
+    };
+
+    ID3D11Resource *take(const Key &key);
+    ID3D11Resource *takeOldest(const Key &key);
+    void recycle(const Key &key, ID3D11Resource *resource, quint64 frame);
+    void trim(quint64 unusedSinceFrame);
+    void releaseAll();
+
+    QVarLengthArray<Entry, MAX_ENTRIES> entries;
+};
+
 class QRhiD3D11 : public QRhiImplementation
 {
 public:
@@ -744,19 +864,40 @@ public:
 
     void enqueueSubresUpload(QD3D11Texture *texD, QD3D11CommandBuffer *cbD,
                              int layer, int level, const QRhiTextureSubresourceUploadDescription &subresDesc);
+    bool enqueueBatchedSubresUploads(QD3D11Texture *texD, QD3D11CommandBuffer *cbD,
+                                     const QRhiResourceUpdateBatchPrivate::TextureOp &u);
     void enqueueResourceUpdates(QRhiCommandBuffer *cb, QRhiResourceUpdateBatch *resourceUpdates);
     void updateShaderResourceBindings(QD3D11ShaderResourceBindings *srbD,
                                       const QShader::NativeResourceBindingMap *nativeResourceBindingMaps[]);
     void executeBufferHostWrites(QD3D11Buffer *bufD);
-    void bindShaderResources(QD3D11ShaderResourceBindings *srbD,
+    struct ReplayState;
+    void bindShaderResources(ReplayState *rs, QD3D11ShaderResourceBindings *srbD,
                              const uint *dynOfsPairs, int dynOfsPairCount,
                              bool offsetOnlyChange);
-    void resetShaderResources();
+    void resetShaderResources(ReplayState *rs);
+    void replayCommands(ReplayState *rs,
+                        const QD3D11CommandBuffer::Command *begin,
+                        const QD3D11CommandBuffer::Command *end);
     void executeCommandBuffer(QD3D11CommandBuffer *cbD);
+    bool executeCommandBufferParallel(QD3D11CommandBuffer *cbD);
     DXGI_SAMPLE_DESC effectiveSampleDesc(int sampleCount) const;
-    void finishActiveReadbacks();
+    void finishActiveReadbacks(bool forced = true);
+    ID3D11Texture2D *acquireStagingTexture(const D3D11_TEXTURE2D_DESC &desc);
+    ID3D11Texture2D *acquireMappedUploadStagingTexture(const D3D11_TEXTURE2D_DESC &desc,
+                                                       D3D11_MAPPED_SUBRESOURCE *mp);
+    ID3D11Buffer *acquireReadbackStagingBuffer(UINT byteSize);
+    void recycleStagingTexture(ID3D11Texture2D *tex);
+    void recycleReadbackStagingBuffer(ID3D11Buffer *buf);
     void reportLiveObjects(ID3D11Device *device);
     void clearShaderCache();
+    bool cachedStateObject(const D3D11_RASTERIZER_DESC &desc, ID3D11RasterizerState **state);
+    bool cachedStateObject(const D3D11_DEPTH_STENCIL_DESC &desc, ID3D11DepthStencilState **state);
+    bool cachedStateObject(const D3D11_BLEND_DESC &desc, ID3D11BlendState **state);
+    bool cachedStateObject(const D3D11_SAMPLER_DESC &desc, ID3D11SamplerState **state);
+    void clearStateObjectCache();
+    bool cachedInputLayout(const D3D11_INPUT_ELEMENT_DESC *inputDescs, int inputDescCount,
+                           const QByteArray &vsByteCode, ID3D11InputLayout **inputLayout);
+    void clearInputLayoutCache();
     QByteArray compileHlslShaderSource(const QShader &shader, QShader::Variant shaderVariant, uint flags,
                                        QString *error, QShaderKey *usedShaderKey);
     bool ensureDirectCompositionDevice();
@@ -779,7 +920,9 @@ public:
     QRhiD3D11NativeHandles nativeHandlesStruct;
     QRhiDriverInfo driverInfoStruct;
 
-    struct {
+    bool partialDynamicUploads = false;
+
+    struct ContextState {
         int vsHighestActiveVertexBufferBinding = -1;
         bool vsHasIndexBufferBound = false;
         int vsHighestActiveSrvBinding = -1;
@@ -792,6 +935,106 @@ public:
         QD3D11SwapChain *currentSwapChain = nullptr;
     } contextState;
 
+    struct RedundantStateCounters {
+        quint32 viewport = 0;
+        quint32 scissor = 0;
+        quint32 indexBuffer = 0;
+        quint32 stencilRef = 0;
+        quint32 blendConstants = 0;
+        quint32 shaderResources = 0;
+        void add(const RedundantStateCounters &other) {
+            viewport += other.viewport;
+            scissor += other.scissor;
+            indexBuffer += other.indexBuffer;
+            stencilRef += other.stencilRef;
+            blendConstants += other.blendConstants;
+            shaderResources += other.shaderResources;
+        }
+    };
+
+    // QT_D3D11_REPLAY_TIMING: CPU time spent in replaying each command type,
+    // reported in backendStatistics()
+    static const int COMMAND_TYPE_COUNT = int(QD3D11CommandBuffer::Command::ExecuteParallel) + 1;
+    struct ReplayTimingCounters {
+        quint64 count[COMMAND_TYPE_COUNT] = {};
+        qint64 nsecs[COMMAND_TYPE_COUNT] = {};
+    };
+    bool replayTiming = false;
+
+    // Counters not representable in QRhiStats.
+    struct Statistics {
+        quint64 dynamicBufferBytesCopied = 0;
+        quint64 batchedSubresUploads = 0;
+        quint64 batchedSubresUploadBytes = 0;
+        quint64 stateObjectCacheHits = 0;
+        quint64 stateObjectCacheMisses = 0;
+        RedundantStateCounters redundantStateCalls; // last frame
+        ReplayTimingCounters replayTiming; // last frame, indexed by Command::Cmd
+    };
+    Statistics stats;
+    RedundantStateCounters currentFrameRedundantStateCalls;
+    ReplayTimingCounters currentFrameReplayTiming;
+    const Statistics &backendStatistics() const { return stats; }
+
+    struct ReplayState {
+        ID3D11DeviceContext1 *context = nullptr;
+        ID3DUserDefinedAnnotation *annotations = nullptr;
+        ContextState *contextState = nullptr;
+        quint32 stencilRef = 0;
+        float blendConstants[4] = { 1, 1, 1, 1 };
+        int currentShaderMask = 0xFF;
+        // What was last set on the context during this replay, used to drop
+        // redundant calls. Nothing is assumed about the state before.
+        struct {
+            bool viewportValid = false;
+            D3D11_VIEWPORT viewport;
+            bool scissorValid = false;
+            D3D11_RECT scissor;
+            ID3D11Buffer *indexBuffer = nullptr;
+            DXGI_FORMAT indexFormat = DXGI_FORMAT_UNKNOWN;
+            quint32 indexOffset = 0;
+            ID3D11DepthStencilState *dsState = nullptr;
+            quint32 stencilRef = 0;
+            ID3D11BlendState *blendState = nullptr;
+            float blendConstants[4] = {};
+            QD3D11ShaderResourceBindings *srb = nullptr;
+            const uint *dynamicOffsetPairs = nullptr;
+            int dynamicOffsetCount = 0;
+        } shadow;
+        RedundantStateCounters filtered;
+        ReplayTimingCounters *timing = nullptr;
+    };
+
+    static const int MAX_REPLAY_CONTEXTS = 4;
+    bool parallelReplay = false;
+    ID3D11DeviceContext1 *deferredContexts[MAX_REPLAY_CONTEXTS] = {};
+    ID3DUserDefinedAnnotation *deferredAnnotations[MAX_REPLAY_CONTEXTS] = {};
+    QThreadPool *replayThreadPool = nullptr;
+    bool ensureDeferredContexts(int count);
+    void executeParallelRecorders(ReplayState *rs, const QList<QRhiD3D11ParallelRecorder> &recorders);
+
+    // Nested GPU timing scopes (QT_D3D11_GPU_TIMING_SCOPES) opened and closed
+    // by debugMarkBegin() and debugMarkEnd(). The queries are resolved without
+    // waiting, usually a frame or two later, into lastTimingScopesJson, see
+    // qt_rhi_d3d11_last_timing_scopes().
+    static const int MAX_PENDING_TIMING_FRAMES = 4;
+    using TimingFrame = QRhiD3D::TimingFrame<ID3D11Query *>;
+    bool timingScopes = false;
+    bool timingFrameActive = false;
+    TimingFrame currentTimingFrame;
+    QList<TimingFrame> pendingTimingFrames;
+    QRhiD3D::TimingQueryFreeList<ID3D11Query *> freeTimingQueries;
+    QByteArray lastTimingScopesJson;
+
+    ID3D11Query *acquireTimingQuery(D3D11_QUERY type);
+    void recordTimingQuery(QD3D11CommandBuffer *cbD, ID3D11Query *query, bool begin);
+    void beginTimingFrame(QD3D11CommandBuffer *cbD);
+    void endTimingFrame(QD3D11CommandBuffer *cbD);
+    void beginTimingScope(QD3D11CommandBuffer *cbD, const QByteArray &name);
+    void endTimingScope(QD3D11CommandBuffer *cbD);
+    void resolveTimingFrames();
+    void releaseTimingQueries();
+
     struct OffscreenFrame {
         OffscreenFrame(QRhiImplementation *rhi) : cbWrapper(rhi) { }
         bool active = false;
@@ -800,6 +1043,13 @@ public:
         ID3D11Query *tsDisjointQuery = nullptr;
     } ofr;
 
+    // Readbacks in swapchain frames are completed without blocking when the
+    // GPU is done with the copy, but no later than this many frames after the
+    // submission. Offscreen frames and finish() still wait.
+    static const int READBACK_MAX_FRAME_LATENCY = 3;
+    static const int STAGING_POOL_MAX_IDLE_FRAMES = 60;
+    quint64 readbackFrameCounter = 0;
+
     struct TextureReadback {
         QRhiReadbackDescription desc;
         QRhiReadbackResult *result;
@@ -808,14 +1058,26 @@ public:
         quint32 bpl;
         QSize pixelSize;
         QRhiTexture::Format format;
+        QRhiD3D::PixelConversion conversion;
+        quint64 frame;
     };
     QVarLengthArray<TextureReadback, 2> activeTextureReadbacks;
     struct BufferReadback {
         QRhiReadbackResult *result;
         quint32 byteSize;
         ID3D11Buffer *stagingBuf;
+        quint64 frame;
     };
     QVarLengthArray<BufferReadback, 2> activeBufferReadbacks;
+    QD3D11StagingPool stagingPool;
+
+    // Many small texture uploads are packed into a staging texture, then
+    // copied to their destinations. The staging textures go back to the pool
+    // once the command buffer referencing them has been executed.
+    static const int MIN_BATCHED_SUBRES_UPLOADS = 4;
+    static const int MAX_BATCHED_SUBRES_UPLOAD_SIZE = 128;
+    static const int MAX_UPLOAD_STAGING_TEXTURE_SIZE = 1024;
+    QVarLengthArray<ID3D11Texture2D *, 4> pendingUploadStagingTextures;
 
     struct Shader {
         Shader() = default;
@@ -827,6 +1089,18 @@ public:
     };
     QHash<QRhiShaderStage, Shader> m_shaderCache;
 
+    // Rasterizer, depth-stencil, blend and sampler states keyed by a type tag
+    // followed by the bytes of the description. The cache holds a reference to
+    // each object, the pipelines and samplers using it hold their own.
+    static const int MAX_STATE_OBJECT_CACHE_ENTRIES = 1024;
+    QHash<QByteArray, ID3D11DeviceChild *> m_stateObjectCache;
+
+    // Input layouts keyed by the input element descriptions and the input
+    // signature of the vertex shader, the only part of the bytecode that
+    // matters for CreateInputLayout.
+    static const int MAX_INPUT_LAYOUT_CACHE_ENTRIES = 512;
+    QHash<QByteArray, ID3D11InputLayout *> m_inputLayoutCache;
+
     // This is what gets exposed as the "pipeline cache", not that that concept
     // applies anyway. Here we are just storing the DX bytecode for a shader so
     // we can skip the HLSL->DXBC compilation when the QShader has HLSL source
@@ -834,36 +1108,22 @@ public:
     // m_shaderCache seemingly does the same, but this here does not care about
     // the ID3D11*Shader, this is just about the bytecode and about allowing
     // the data to be serialized to persistent storage and then reloaded in
-    // future runs of the app, or when creating another QRhi, etc.
-    struct BytecodeCacheKey {
-        QByteArray sourceHash;
-        QByteArray target;
-        QByteArray entryPoint;
-        uint compileFlags;
-    };
+    // future runs of the app, or when creating another QRhi, etc. Compiling
+    // goes through the process-wide QRhiD3D::BytecodeStore in any case, this
+    // is the subset that gets serialized.
+    using BytecodeCacheKey = QRhiD3D::BytecodeStoreKey;
     QHash<BytecodeCacheKey, QByteArray> m_bytecodeCache;
 };
 
 Q_DECLARE_TYPEINFO(QRhiD3D11::TextureReadback, Q_RELOCATABLE_TYPE);
 Q_DECLARE_TYPEINFO(QRhiD3D11::BufferReadback, Q_RELOCATABLE_TYPE);
 
-inline bool operator==(const QRhiD3D11::BytecodeCacheKey &a, const QRhiD3D11::BytecodeCacheKey &b) noexcept
-{
-    return a.sourceHash == b.sourceHash
-            && a.target == b.target
-            && a.entryPoint == b.entryPoint
-            && a.compileFlags == b.compileFlags;
-}
-
-inline bool operator!=(const QRhiD3D11::BytecodeCacheKey &a, const QRhiD3D11::BytecodeCacheKey &b) noexcept
-{
-    return !(a == b);
-}
-
-inline size_t qHash(const QRhiD3D11::BytecodeCacheKey &k, size_t seed = 0) noexcept
-{
-    return qHash(k.sourceHash, seed) ^ qHash(k.target) ^ qHash(k.entryPoint) ^ k.compileFlags;
-}
+Q_GUI_EXPORT void qt_rhi_d3d11_set_readback_conversion(QRhiCommandBuffer *cb,
+                                                      const QRhiReadbackResult *result,
+                                                      QRhiD3D::PixelConversion conversion);
+Q_GUI_EXPORT void qt_rhi_d3d11_record_parallel(QRhiCommandBuffer *cb,
+                                               const QList<QRhiD3D11ParallelRecorder> &recorders);
+Q_GUI_EXPORT QByteArray qt_rhi_d3d11_last_timing_scopes(QRhiCommandBuffer *cb);
 
 QT_END_NAMESPACE
 
@@ -3,9 +3,16 @@
 
 #include "qrhid3d12_p.h"
 #include <qmath.h>
+#include <QtCore/qdatastream.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qset.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qthreadpool.h>
 #include <QtCore/private/qsystemerror_p.h>
 #include <comdef.h>
 #include "qrhid3dhelpers_p.h"
+#include "qrhid3dbytecodestore_p.h"
+#include "qrhid3dpitchedcopy_p.h"
 #include "cs_mipmap_p.h"
 
 #if __has_include(<pix.h>)
@@ -201,8 +208,559 @@ static inline QD3D12RenderTargetData *rtData(QRhiRenderTarget *rt)
     Q_UNREACHABLE_RETURN(nullptr);
 }
 
+static inline D3D12_RESOURCE_BARRIER transitionBarrier(ID3D12Resource *resource,
+                                                       UINT subresource,
+                                                       D3D12_RESOURCE_STATES stateBefore,
+                                                       D3D12_RESOURCE_STATES stateAfter)
+{
+    D3D12_RESOURCE_BARRIER barrier = {};
+    barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+    barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
+    barrier.Transition.pResource = resource;
+    barrier.Transition.Subresource = subresource;
+    barrier.Transition.StateBefore = stateBefore;
+    barrier.Transition.StateAfter = stateAfter;
+    return barrier;
+}
+
+static inline D3D12_RESOURCE_BARRIER uavBarrier(ID3D12Resource *resource)
+{
+    D3D12_RESOURCE_BARRIER barrier = {};
+    barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+    barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
+    barrier.UAV.pResource = resource;
+    return barrier;
+}
+
+// The per-frame small staging areas grow on demand up to this size. Anything
+// that does not fit even then gets a dedicated, deferred-released staging
+// buffer, like before.
+static const quint32 MAX_SMALL_STAGING_AREA_BYTES_PER_FRAME = 32 * 1024 * 1024;
+
+static bool recreateSmallStagingArea(QRhiD3D12 *rhiD, int frameSlot, quint32 capacity)
+{
+    QD3D12StagingArea newArea;
+    if (!newArea.create(rhiD, capacity, D3D12_HEAP_TYPE_UPLOAD))
+        return false;
+
+    // The old buffer may still be referenced by commands recorded in this
+    // frame, or by frames in flight for this slot. The release queue keeps it
+    // alive until the fence for the slot signals.
+    QD3D12StagingArea &area(rhiD->smallStagingAreas[frameSlot]);
+    area.destroyWithDeferredRelease(&rhiD->releaseQueue);
+    area = newArea;
+
+    QString decoratedName = QLatin1String("Small staging area buffer/");
+    decoratedName += QString::number(frameSlot);
+    area.mem.buffer->SetName(reinterpret_cast<LPCWSTR>(decoratedName.utf16()));
+    return true;
+}
+
+// Makes sure allocSize bytes can be taken from the current frame slot's small
+// staging area. Returns false if the request is oversized, in which case the
+// caller is expected to fall back to a dedicated staging area.
+static bool ensureSmallStagingAreaCapacity(QRhiD3D12 *rhiD, quint32 allocSize)
+{
+    const int frameSlot = rhiD->currentFrameSlot;
+    QD3D12StagingArea &area(rhiD->smallStagingAreas[frameSlot]);
+    if (area.remainingCapacity() >= allocSize)
+        return true;
+    if (allocSize > MAX_SMALL_STAGING_AREA_BYTES_PER_FRAME)
+        return false;
+
+    // Size the new buffer for everything this frame needed so far, so that
+    // the next frame using this slot can be served from a single buffer.
+    const quint32 peakUsage = area.head + allocSize;
+    quint32 newCapacity = qMax(area.capacity, quint32(QRhiD3D12::SMALL_STAGING_AREA_BYTES_PER_FRAME));
+    while (newCapacity < peakUsage && newCapacity < MAX_SMALL_STAGING_AREA_BYTES_PER_FRAME)
+        newCapacity *= 2;
+    newCapacity = aligned(qMin(newCapacity, MAX_SMALL_STAGING_AREA_BYTES_PER_FRAME), QD3D12StagingArea::ALIGNMENT);
+
+    if (!recreateSmallStagingArea(rhiD, frameSlot, newCapacity))
+        return false;
+
+    qCDebug(QRHI_LOG_INFO, "Grew small staging area for frame slot %d to %u bytes (peak usage %u bytes)",
+            frameSlot, newCapacity, peakUsage);
+    return true;
+}
+
+static const int MAX_ROOT_SIGNATURE_CACHE_ENTRIES = 256;
+
+// Returns a new reference, or null.
+static ID3D12RootSignature *lookupRootSignature(QRhiD3D12 *rhiD, const QByteArray &serialized)
+{
+    QD3D12RootSignatureCache &cache(rhiD->rootSignatureCache);
+    QMutexLocker lock(&cache.mutex);
+    ID3D12RootSignature *rootSig = cache.rootSigs.value(serialized);
+    if (rootSig) {
+        rootSig->AddRef();
+        cache.hits += 1;
+    } else {
+        cache.misses += 1;
+    }
+    return rootSig;
+}
+
+static void clearRootSignatureCache(QD3D12RootSignatureCache *cache)
+{
+    for (ID3D12RootSignature *rootSig : std::as_const(cache->rootSigs))
+        rootSig->Release();
+    cache->rootSigs.clear();
+    cache->serializedForms.clear();
+}
+
+// Takes over the caller's reference to rootSig and returns a reference to the
+// cached object, which is a different one when another thread has inserted
+// the same root signature in the meantime.
+static ID3D12RootSignature *insertRootSignature(QRhiD3D12 *rhiD, const QByteArray &serialized,
+                                                ID3D12RootSignature *rootSig)
+{
+    QD3D12RootSignatureCache &cache(rhiD->rootSignatureCache);
+    QMutexLocker lock(&cache.mutex);
+    if (ID3D12RootSignature *cached = cache.rootSigs.value(serialized)) {
+        rootSig->Release();
+        cached->AddRef();
+        return cached;
+    }
+    if (cache.rootSigs.count() >= MAX_ROOT_SIGNATURE_CACHE_ENTRIES)
+        clearRootSignatureCache(&cache);
+    rootSig->AddRef();
+    cache.rootSigs.insert(serialized, rootSig);
+    cache.serializedForms.insert(rootSig, serialized);
+    return rootSig;
+}
+
+// Empty when rootSig is not (or no longer) in the cache.
+static QByteArray serializedRootSignature(QRhiD3D12 *rhiD, const ID3D12RootSignature *rootSig)
+{
+    QD3D12RootSignatureCache &cache(rhiD->rootSignatureCache);
+    QMutexLocker lock(&cache.mutex);
+    return cache.serializedForms.value(rootSig);
+}
+
+// Root signatures in use by pipelines stay alive, only the cache's own
+// references are dropped.
+static void releaseRootSignatureCache(QRhiD3D12 *rhiD)
+{
+    QD3D12RootSignatureCache &cache(rhiD->rootSignatureCache);
+    QMutexLocker lock(&cache.mutex);
+    clearRootSignatureCache(&cache);
+}
+
+// The pipeline state stream used for graphics pipelines, both by create() and
+// by the warm-up of pipelines recorded in a previous run.
+struct QD3D12GraphicsPipelineStateStream
+{
+    QD3D12PipelineStateSubObject<ID3D12RootSignature *, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_ROOT_SIGNATURE> rootSig;
+    QD3D12PipelineStateSubObject<D3D12_INPUT_LAYOUT_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_INPUT_LAYOUT> inputLayout;
+    QD3D12PipelineStateSubObject<D3D12_PRIMITIVE_TOPOLOGY_TYPE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_PRIMITIVE_TOPOLOGY> primitiveTopology;
+    QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_VS> VS;
+    QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_HS> HS;
+    QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_DS> DS;
+    QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_GS> GS;
+    QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_PS> PS;
+    QD3D12PipelineStateSubObject<D3D12_RASTERIZER_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_RASTERIZER> rasterizerState;
+    QD3D12PipelineStateSubObject<D3D12_DEPTH_STENCIL_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_DEPTH_STENCIL> depthStencilState;
+    QD3D12PipelineStateSubObject<D3D12_BLEND_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_BLEND> blendState;
+    QD3D12PipelineStateSubObject<D3D12_RT_FORMAT_ARRAY, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_RENDER_TARGET_FORMATS> rtFormats;
+    QD3D12PipelineStateSubObject<DXGI_FORMAT, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_DEPTH_STENCIL_FORMAT> dsFormat;
+    QD3D12PipelineStateSubObject<DXGI_SAMPLE_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_SAMPLE_DESC> sampleDesc;
+    QD3D12PipelineStateSubObject<UINT, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_SAMPLE_MASK> sampleMask;
+    QD3D12PipelineStateSubObject<D3D12_VIEW_INSTANCING_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_VIEW_INSTANCING> viewInstancingDesc;
+};
+
+template<typename T>
+static inline void writePod(QDataStream &ds, const T &v)
+{
+    ds.writeRawData(reinterpret_cast<const char *>(&v), int(sizeof(T)));
+}
+
+template<typename T>
+static inline bool readPod(QDataStream &ds, T *v)
+{
+    return ds.readRawData(reinterpret_cast<char *>(v), int(sizeof(T))) == int(sizeof(T));
+}
+
+// A graphics pipeline is recorded in a form that allows recreating its
+// pipeline state object without any of the QRhi objects. The record doubles
+// as the key when looking for a pipeline warmed up from an earlier run's
+// records. create() zero-fills the state structs, so the raw bytes written
+// here do not depend on uninitialized padding.
+static QByteArray graphicsPipelineRecord(const QByteArray &serializedRootSig,
+                                         const QByteArray *shaderBytecode,
+                                         const QD3D12GraphicsPipelineStateStream &stream)
+{
+    QByteArray record;
+    QDataStream ds(&record, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_6_0);
+    ds << serializedRootSig;
+    for (int i = 0; i < 5; ++i)
+        ds << shaderBytecode[i];
+    const D3D12_INPUT_LAYOUT_DESC &inputLayout(stream.inputLayout.object);
+    ds << quint32(inputLayout.NumElements);
+    for (UINT i = 0; i < inputLayout.NumElements; ++i) {
+        const D3D12_INPUT_ELEMENT_DESC &desc(inputLayout.pInputElementDescs[i]);
+        ds << QByteArray(desc.SemanticName) << quint32(desc.SemanticIndex) << quint32(desc.Format)
+           << quint32(desc.InputSlot) << quint32(desc.AlignedByteOffset)
+           << quint32(desc.InputSlotClass) << quint32(desc.InstanceDataStepRate);
+    }
+    ds << quint32(stream.primitiveTopology.object);
+    writePod(ds, stream.rasterizerState.object);
+    writePod(ds, stream.depthStencilState.object);
+    writePod(ds, stream.blendState.object);
+    writePod(ds, stream.rtFormats.object);
+    ds << quint32(stream.dsFormat.object);
+    writePod(ds, stream.sampleDesc.object);
+    ds << quint32(stream.sampleMask.object);
+    ds << quint32(stream.viewInstancingDesc.object.ViewInstanceCount);
+    return record;
+}
+
+namespace {
+struct QD3D12GraphicsPipelineRecord
+{
+    QByteArray serializedRootSig;
+    QByteArray shaderBytecode[5];
+    QByteArrayList semanticNames;
+    QVarLengthArray<D3D12_INPUT_ELEMENT_DESC, 4> inputDescs;
+    QVarLengthArray<D3D12_VIEW_INSTANCE_LOCATION, 4> viewInstanceLocations;
+    QD3D12GraphicsPipelineStateStream stream;
+};
+}
+
+// Everything but the root signature is set up in dst->stream.
+static bool readGraphicsPipelineRecord(const QByteArray &record, QD3D12GraphicsPipelineRecord *dst)
+{
+    QDataStream ds(record);
+    ds.setVersion(QDataStream::Qt_6_0);
+    ds >> dst->serializedRootSig;
+    for (int i = 0; i < 5; ++i)
+        ds >> dst->shaderBytecode[i];
+    quint32 inputCount = 0;
+    ds >> inputCount;
+    if (ds.status() != QDataStream::Ok || inputCount > D3D12_IA_VERTEX_INPUT_STRUCTURE_ELEMENT_COUNT)
+        return false;
+    for (quint32 i = 0; i < inputCount; ++i) {
+        QByteArray semanticName;
+        quint32 semanticIndex, format, inputSlot, offset, slotClass, stepRate;
+        ds >> semanticName >> semanticIndex >> format >> inputSlot >> offset >> slotClass >> stepRate;
+        dst->semanticNames.append(semanticName);
+        D3D12_INPUT_ELEMENT_DESC desc = {};
+        desc.SemanticIndex = semanticIndex;
+        desc.Format = DXGI_FORMAT(format);
+        desc.InputSlot = inputSlot;
+        desc.AlignedByteOffset = offset;
+        desc.InputSlotClass = D3D12_INPUT_CLASSIFICATION(slotClass);
+        desc.InstanceDataStepRate = stepRate;
+        dst->inputDescs.append(desc);
+    }
+    quint32 topology = 0, dsFormat = 0, sampleMask = 0, viewInstanceCount = 0;
+    ds >> topology;
+    bool ok = readPod(ds, &dst->stream.rasterizerState.object)
+            && readPod(ds, &dst->stream.depthStencilState.object)
+            && readPod(ds, &dst->stream.blendState.object)
+            && readPod(ds, &dst->stream.rtFormats.object);
+    ds >> dsFormat;
+    ok = ok && readPod(ds, &dst->stream.sampleDesc.object);
+    ds >> sampleMask >> viewInstanceCount;
+    if (!ok || ds.status() != QDataStream::Ok || viewInstanceCount > D3D12_MAX_VIEW_INSTANCE_COUNT)
+        return false;
+
+    QD3D12GraphicsPipelineStateStream &stream(dst->stream);
+    for (quint32 i = 0; i < inputCount; ++i)
+        dst->inputDescs[i].SemanticName = dst->semanticNames[i].constData();
+    stream.inputLayout.object.NumElements = inputCount;
+    stream.inputLayout.object.pInputElementDescs = dst->inputDescs.isEmpty() ? nullptr : dst->inputDescs.constData();
+    stream.primitiveTopology.object = D3D12_PRIMITIVE_TOPOLOGY_TYPE(topology);
+    D3D12_SHADER_BYTECODE *stages[5] = { &stream.VS.object, &stream.HS.object, &stream.DS.object,
+                                         &stream.GS.object, &stream.PS.object };
+    for (int i = 0; i < 5; ++i) {
+        if (!dst->shaderBytecode[i].isEmpty()) {
+            stages[i]->pShaderBytecode = dst->shaderBytecode[i].constData();
+            stages[i]->BytecodeLength = dst->shaderBytecode[i].size();
+        }
+    }
+    stream.dsFormat.object = DXGI_FORMAT(dsFormat);
+    stream.sampleMask.object = sampleMask;
+    stream.viewInstancingDesc.object.ViewInstanceCount = viewInstanceCount;
+    if (viewInstanceCount >= 2) {
+        for (quint32 i = 0; i < viewInstanceCount; ++i)
+            dst->viewInstanceLocations.append({ 0, UINT(i) });
+        stream.viewInstancingDesc.object.pViewInstanceLocations = dst->viewInstanceLocations.constData();
+    }
+    return true;
+}
+
+static const quint32 PIPELINE_CACHE_DATA_MAGIC = 0x50443344; // 'D3DP'
+static const quint32 PIPELINE_CACHE_DATA_VERSION = 1;
+static const int MAX_RECORDED_PIPELINES = 512;
+
+static void recordGraphicsPipeline(QRhiD3D12 *rhiD, const QByteArray &record)
+{
+    QD3D12PipelineWarmup &warmup(rhiD->pipelineWarmup);
+    QMutexLocker lock(&warmup.mutex);
+    if (warmup.records.count() < MAX_RECORDED_PIPELINES && !warmup.recordSet.contains(record)) {
+        warmup.records.append(record);
+        warmup.recordSet.insert(record);
+    }
+}
+
+// Whether a pipeline created now may get a warmed-up one, in which case its
+// record is needed as the key even when not saving pipeline cache data.
+static bool hasWarmedGraphicsPipelines(QRhiD3D12 *rhiD)
+{
+    QD3D12PipelineWarmup &warmup(rhiD->pipelineWarmup);
+    QMutexLocker lock(&warmup.mutex);
+    return !warmup.tasks.isEmpty() || !warmup.warmedPipelines.isEmpty();
+}
+
+// Returns null when there is nothing usable, the caller then creates the
+// pipeline state object itself.
+static ID3D12PipelineState *takeWarmedGraphicsPipeline(QRhiD3D12 *rhiD, const QByteArray &record,
+                                                       ID3D12RootSignature *rootSig)
+{
+    QD3D12PipelineWarmup &warmup(rhiD->pipelineWarmup);
+    QMutexLocker lock(&warmup.mutex);
+    const auto task = warmup.tasks.constFind(record);
+    if (task != warmup.tasks.cend()) {
+        if (*task == QD3D12PipelineWarmup::Queued) {
+            // not started yet; the caller creates it now and the worker skips it
+            warmup.tasks.erase(task);
+            return nullptr;
+        }
+        // being created on a worker thread, waiting is cheaper than doing it again
+        while (warmup.tasks.contains(record))
+            warmup.taskDone.wait(&warmup.mutex);
+    }
+    QD3D12PipelineWarmup::WarmedPipeline warmed = warmup.warmedPipelines.take(record);
+    if (!warmed.pso)
+        return nullptr;
+    // the root signature cache may have been released in the meantime
+    if (warmed.rootSig != rootSig) {
+        warmed.pso->Release();
+        warmed.rootSig->Release();
+        return nullptr;
+    }
+    warmed.rootSig->Release(); // the pipeline's root signature handle keeps it alive
+    warmup.warmedPipelinesUsed += 1;
+    return warmed.pso;
+}
+
+static QD3D12PipelineWarmup::WarmedPipeline createWarmedGraphicsPipeline(QRhiD3D12 *rhiD, const QByteArray &record)
+{
+    QD3D12GraphicsPipelineRecord r;
+    if (!readGraphicsPipelineRecord(record, &r))
+        return {};
+
+    ID3D12RootSignature *rootSig = lookupRootSignature(rhiD, r.serializedRootSig);
+    if (!rootSig) {
+        HRESULT hr = rhiD->dev->CreateRootSignature(0,
+                                                    r.serializedRootSig.constData(),
+                                                    SIZE_T(r.serializedRootSig.size()),
+                                                    __uuidof(ID3D12RootSignature),
+                                                    reinterpret_cast<void **>(&rootSig));
+        if (FAILED(hr))
+            return {};
+        rootSig = insertRootSignature(rhiD, r.serializedRootSig, rootSig);
+    }
+    r.stream.rootSig.object = rootSig;
+
+    const D3D12_PIPELINE_STATE_STREAM_DESC streamDesc = { sizeof(r.stream), &r.stream };
+    ID3D12PipelineState *pso = nullptr;
+    HRESULT hr = rhiD->dev->CreatePipelineState(&streamDesc, __uuidof(ID3D12PipelineState), reinterpret_cast<void **>(&pso));
+    if (FAILED(hr)) {
+        rootSig->Release();
+        return {};
+    }
+    return { pso, rootSig };
+}
+
+static void runGraphicsPipelineWarmup(QRhiD3D12 *rhiD, const QByteArray &record)
+{
+    QD3D12PipelineWarmup &warmup(rhiD->pipelineWarmup);
+    {
+        QMutexLocker lock(&warmup.mutex);
+        const auto task = warmup.tasks.find(record);
+        // claimed by QD3D12GraphicsPipeline::create() in the meantime
+        if (task == warmup.tasks.end() || *task != QD3D12PipelineWarmup::Queued)
+            return;
+        *task = QD3D12PipelineWarmup::Running;
+    }
+
+    const QD3D12PipelineWarmup::WarmedPipeline warmed = createWarmedGraphicsPipeline(rhiD, record);
+
+    QMutexLocker lock(&warmup.mutex);
+    warmup.tasks.remove(record);
+    if (warmed.pso)
+        warmup.warmedPipelines.insert(record, warmed);
+    warmup.taskDone.wakeAll();
+}
+
+// Pipelines warmed up but not (yet) asked for are dropped. Pipelines already
+// handed over are owned by their QD3D12GraphicsPipeline.
+static void releaseWarmedPipelines(QRhiD3D12 *rhiD)
+{
+    QD3D12PipelineWarmup &warmup(rhiD->pipelineWarmup);
+    QMutexLocker lock(&warmup.mutex);
+    for (const QD3D12PipelineWarmup::WarmedPipeline &warmed : std::as_const(warmup.warmedPipelines)) {
+        warmed.pso->Release();
+        warmed.rootSig->Release();
+    }
+    warmup.warmedPipelines.clear();
+}
+
+static void destroyPipelineWarmup(QRhiD3D12 *rhiD)
+{
+    QD3D12PipelineWarmup &warmup(rhiD->pipelineWarmup);
+    QThreadPool *threadPool = nullptr;
+    {
+        QMutexLocker lock(&warmup.mutex);
+        threadPool = warmup.threadPool;
+        warmup.threadPool = nullptr;
+    }
+    // not under the lock, the tasks need it
+    if (threadPool) {
+        threadPool->clear();
+        threadPool->waitForDone();
+        delete threadPool;
+    }
+
+    releaseWarmedPipelines(rhiD);
+    QMutexLocker lock(&warmup.mutex);
+    warmup.records.clear();
+    warmup.recordSet.clear();
+    warmup.tasks.clear();
+}
+
+namespace {
+// The callbacks registered with qt_rhi_d3d12_set_memory_budget_callback().
+// Keyed by QRhi since that is all the hook gets; only looked at when the
+// pressure level changes.
+struct QD3D12MemoryBudgetCallbacks
+{
+    struct Callback {
+        QRhiD3D12MemoryBudgetCallback callback = nullptr;
+        void *userData = nullptr;
+    };
+    QMutex mutex;
+    QHash<QRhi *, Callback> callbacks;
+};
+}
+
+Q_GLOBAL_STATIC(QD3D12MemoryBudgetCallbacks, memoryBudgetCallbacks)
+
+// Not public API. Registers a function that is called at the end of a frame
+// whenever the memory pressure level (0 - normal, 1 - elevated, 2 - critical)
+// of rhi changes, with the usage and budget in bytes of the memory segment
+// closest to its budget. The callback may release resources and call
+// releaseCachedResources(), but must not start a frame. Passing null
+// unregisters. Has no effect for QRhi instances with another backend.
+void qt_rhi_d3d12_set_memory_budget_callback(QRhi *rhi, QRhiD3D12MemoryBudgetCallback callback, void *userData)
+{
+    if (!rhi || rhi->backend() != QRhi::D3D12)
+        return;
+    QMutexLocker lock(&memoryBudgetCallbacks->mutex);
+    if (callback)
+        memoryBudgetCallbacks->callbacks.insert(rhi, { callback, userData });
+    else
+        memoryBudgetCallbacks->callbacks.remove(rhi);
+}
+
+static void destroyMemoryBudgetMonitor(QRhiD3D12 *rhiD)
+{
+    rhiD->memoryBudgetMonitor = {};
+    QMutexLocker lock(&memoryBudgetCallbacks->mutex);
+    memoryBudgetCallbacks->callbacks.remove(rhiD->q);
+}
+
+// To be called outside of a frame. Nothing here is in use by commands being
+// recorded; what may still be in use by frames in flight goes through the
+// release queue. The budget is about GPU memory, so the pools that grew on
+// demand give it back first; the CPU side caches of this QRhi only go at the
+// critical level.
+static void trimForMemoryPressure(QRhiD3D12 *rhiD, QD3D12MemoryBudgetPolicy::Level level)
+{
+    const quint32 smallStagingSize = aligned(QRhiD3D12::SMALL_STAGING_AREA_BYTES_PER_FRAME, QD3D12StagingArea::ALIGNMENT);
+    for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i) {
+        if (rhiD->smallStagingAreas[i].capacity > smallStagingSize)
+            recreateSmallStagingArea(rhiD, i, smallStagingSize);
+    }
+
+    // The heap grows on demand, go back to the initial size. The next
+    // beginFrame() binds the new one, and the descriptor table cache notices
+    // the change.
+    QD3D12ShaderVisibleDescriptorHeap &cbvSrvUavHeap(rhiD->shaderVisibleCbvSrvUavHeap);
+    if (cbvSrvUavHeap.perFrameHeapSlice[0].capacity > QRhiD3D12::SHADER_VISIBLE_CBV_SRV_UAV_HEAP_PER_FRAME_START_SIZE) {
+        QD3D12ShaderVisibleDescriptorHeap newHeap;
+        if (newHeap.create(rhiD->dev, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV,
+                           QRhiD3D12::SHADER_VISIBLE_CBV_SRV_UAV_HEAP_PER_FRAME_START_SIZE))
+        {
+            cbvSrvUavHeap.destroyWithDeferredRelease(&rhiD->releaseQueue);
+            cbvSrvUavHeap = newHeap;
+        }
+    }
+
+    // pipeline state objects nobody asked for yet
+    releaseWarmedPipelines(rhiD);
+
+    if (level < QD3D12MemoryBudgetPolicy::Critical)
+        return;
+
+    rhiD->shaderBytecodeCache.data.clear();
+    releaseRootSignatureCache(rhiD);
+}
+
+// Samples the budgets, to be called at the end of every frame.
+static void updateMemoryBudget(QRhiD3D12 *rhiD)
+{
+    // for testing the trimming without actually running out of memory
+    static const quint64 simulatedBudget = quint64(qMax(0, qEnvironmentVariableIntValue("QT_D3D12_MEMORY_BUDGET_MB"))) * 1024 * 1024;
+
+    D3D12MA::Budget budgets[2];
+    rhiD->vma.getBudget(&budgets[0], &budgets[1]);
+    if (simulatedBudget)
+        budgets[0].BudgetBytes = simulatedBudget;
+
+    QD3D12MemoryBudgetMonitor &monitor(rhiD->memoryBudgetMonitor);
+    monitor.localUsage = budgets[0].UsageBytes;
+    monitor.localBudget = budgets[0].BudgetBytes;
+    monitor.nonLocalUsage = budgets[1].UsageBytes;
+    monitor.nonLocalBudget = budgets[1].BudgetBytes;
+
+    // the segment closest to its budget decides (non-local has none with UMA)
+    int segment = 0;
+    if (budgets[1].BudgetBytes && (!budgets[0].BudgetBytes
+            || double(budgets[1].UsageBytes) / double(budgets[1].BudgetBytes)
+               > double(budgets[0].UsageBytes) / double(budgets[0].BudgetBytes)))
+    {
+        segment = 1;
+    }
+    const QD3D12MemoryBudgetPolicy::Level oldLevel = monitor.policy.level;
+    if (!monitor.policy.update(budgets[segment].UsageBytes, budgets[segment].BudgetBytes))
+        return;
+
+    const QD3D12MemoryBudgetPolicy::Level level = monitor.policy.level;
+    if (level > oldLevel)
+        monitor.trimCount += 1;
+
+    qCDebug(QRHI_LOG_INFO, "Memory pressure level %d, %llu of %llu bytes used in %s memory",
+            int(level), budgets[segment].UsageBytes, budgets[segment].BudgetBytes,
+            segment == 0 ? "local" : "non-local");
+
+    if (level > oldLevel)
+        trimForMemoryPressure(rhiD, level);
+
+    QMutexLocker lock(&memoryBudgetCallbacks->mutex);
+    const QD3D12MemoryBudgetCallbacks::Callback c = memoryBudgetCallbacks->callbacks.value(rhiD->q);
+    lock.unlock();
+    if (c.callback)
+        c.callback(rhiD->q, int(level), budgets[segment].UsageBytes, budgets[segment].BudgetBytes, c.userData);
+}
+
 bool QRhiD3D12::create(QRhi::Flags flags)
 {
+    QRhiD3D::BytecodeStore::instance()->ref(); // dropped in destroy(), which runs even when this fails
+
     typedef HRESULT(WINAPI* CreateDXGIFactory2Func) (UINT flags, REFIID riid, void** factory);
     typedef HRESULT(WINAPI* D3D12CreateDeviceFunc) (IUnknown *, D3D_FEATURE_LEVEL, REFIID, void **);
     typedef HRESULT(WINAPI* D3D12GetDebugInterfaceFunc) (REFIID, void **);
@@ -534,6 +1092,10 @@ void QRhiD3D12::destroy()
     if (!deviceLost && fullFence && fullFenceEvent)
         waitGpu();
 
+    destroyPipelineWarmup(this);
+    destroyMemoryBudgetMonitor(this);
+    QRhiD3D::BytecodeStore::instance()->deref();
+
     releaseQueue.releaseAll();
 
     for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i) {
@@ -549,6 +1111,7 @@ void QRhiD3D12::destroy()
     timestampReadbackArea.destroy();
 
     shaderVisibleCbvSrvUavHeap.destroy();
+    descriptorTableCache.setHeap(nullptr);
 
     for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i)
         smallStagingAreas[i].destroy();
@@ -557,6 +1120,7 @@ void QRhiD3D12::destroy()
     samplerMgr.destroy();
     resourcePool.destroy();
     pipelinePool.destroy();
+    releaseRootSignatureCache(this);
     rootSignaturePool.destroy();
     rtvPool.destroy();
     dsvPool.destroy();
@@ -834,6 +1398,31 @@ QRhiStats QRhiD3D12::statistics()
     return result;
 }
 
+QRhiD3D12::Statistics QRhiD3D12::backendStatistics()
+{
+    Statistics result;
+    {
+        QMutexLocker lock(&rootSignatureCache.mutex);
+        result.rootSignatureCacheEntries = int(rootSignatureCache.rootSigs.count());
+        result.rootSignatureCacheHits = rootSignatureCache.hits;
+        result.rootSignatureCacheMisses = rootSignatureCache.misses;
+    }
+    {
+        QMutexLocker lock(&pipelineWarmup.mutex);
+        result.warmupRecords = int(pipelineWarmup.records.count());
+        result.warmedPipelinesUnused = int(pipelineWarmup.warmedPipelines.count());
+        result.warmedPipelinesUsed = pipelineWarmup.warmedPipelinesUsed;
+    }
+    result.recycledSamplerDescriptors = samplerMgr.recycledCount;
+    result.localMemoryUsage = memoryBudgetMonitor.localUsage;
+    result.localMemoryBudget = memoryBudgetMonitor.localBudget;
+    result.nonLocalMemoryUsage = memoryBudgetMonitor.nonLocalUsage;
+    result.nonLocalMemoryBudget = memoryBudgetMonitor.nonLocalBudget;
+    result.memoryPressureLevel = memoryBudgetMonitor.policy.level;
+    result.memoryTrimCount = memoryBudgetMonitor.trimCount;
+    return result;
+}
+
 bool QRhiD3D12::makeThreadLocalNativeContextCurrent()
 {
     // not applicable
@@ -843,6 +1432,18 @@ bool QRhiD3D12::makeThreadLocalNativeContextCurrent()
 void QRhiD3D12::releaseCachedResources()
 {
     shaderBytecodeCache.data.clear();
+    releaseRootSignatureCache(this);
+
+    // Give back the memory of small staging areas that grew due to a peak in
+    // upload traffic. Not while recording a frame, the current slot's area
+    // may be handed out again before the frame ends.
+    if (!inFrame) {
+        const quint32 smallStagingSize = aligned(SMALL_STAGING_AREA_BYTES_PER_FRAME, QD3D12StagingArea::ALIGNMENT);
+        for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i) {
+            if (smallStagingAreas[i].capacity > smallStagingSize)
+                recreateSmallStagingArea(this, i, smallStagingSize);
+        }
+    }
 }
 
 bool QRhiD3D12::isDeviceLost() const
@@ -852,12 +1453,84 @@ bool QRhiD3D12::isDeviceLost() const
 
 QByteArray QRhiD3D12::pipelineCacheData()
 {
-    return {};
+    // There is no driver-level blob, instead the graphics pipelines created
+    // so far are recorded. Passing this to setPipelineCacheData() in a later
+    // run creates them up front on worker threads.
+    QMutexLocker lock(&pipelineWarmup.mutex);
+    const QList<QByteArray> records = pipelineWarmup.records;
+    lock.unlock();
+    if (records.isEmpty())
+        return {};
+
+    QByteArray data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_6_0);
+    ds << PIPELINE_CACHE_DATA_MAGIC << PIPELINE_CACHE_DATA_VERSION << quint32(records.count());
+    for (const QByteArray &record : records)
+        ds << record;
+    return data;
 }
 
 void QRhiD3D12::setPipelineCacheData(const QByteArray &data)
 {
-    Q_UNUSED(data);
+    if (data.isEmpty())
+        return;
+
+    QDataStream ds(data);
+    ds.setVersion(QDataStream::Qt_6_0);
+    quint32 magic = 0, version = 0, count = 0;
+    ds >> magic >> version >> count;
+    if (ds.status() != QDataStream::Ok || magic != PIPELINE_CACHE_DATA_MAGIC) {
+        qCDebug(QRHI_LOG_INFO, "Pipeline cache data is not from the D3D12 backend, ignoring");
+        return;
+    }
+    if (version != PIPELINE_CACHE_DATA_VERSION) {
+        qCDebug(QRHI_LOG_INFO, "Pipeline cache data version mismatch (%u, expected %u), ignoring",
+                version, PIPELINE_CACHE_DATA_VERSION);
+        return;
+    }
+
+    QList<QByteArray> records;
+    for (quint32 i = 0; i < count && i < quint32(MAX_RECORDED_PIPELINES); ++i) {
+        QByteArray record;
+        ds >> record;
+        if (ds.status() != QDataStream::Ok) {
+            qWarning("Pipeline cache data is truncated");
+            break;
+        }
+        records.append(record);
+    }
+
+    QD3D12PipelineWarmup &warmup(pipelineWarmup);
+    QMutexLocker lock(&warmup.mutex);
+    if (!warmup.threadPool) {
+        warmup.threadPool = new QThreadPool;
+        // leave a core for the thread that goes on with initializing
+        warmup.threadPool->setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+    }
+    int scheduled = 0;
+    for (const QByteArray &record : std::as_const(records)) {
+        if (warmup.recordSet.contains(record) || warmup.tasks.contains(record)
+                || warmup.warmedPipelines.contains(record))
+        {
+            continue;
+        }
+        // keep the records for the next pipelineCacheData(), even for
+        // pipelines that end up not being created in this run
+        if (rhiFlags.testFlag(QRhi::EnablePipelineCacheDataSave)
+                && warmup.records.count() < MAX_RECORDED_PIPELINES)
+        {
+            warmup.records.append(record);
+            warmup.recordSet.insert(record);
+        }
+        QRhiD3D12 *rhiD = this;
+        warmup.tasks.insert(record, QD3D12PipelineWarmup::Queued);
+        warmup.threadPool->start([rhiD, record] {
+            runGraphicsPipelineWarmup(rhiD, record);
+        });
+        scheduled += 1;
+    }
+    qCDebug(QRHI_LOG_INFO, "Warming up %d graphics pipelines from pipeline cache data", scheduled);
 }
 
 QRhiRenderBuffer *QRhiD3D12::createRenderBuffer(QRhiRenderBuffer::Type type, const QSize &pixelSize,
@@ -1032,6 +1705,12 @@ void QRhiD3D12::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
 
     QD3D12ShaderResourceBindings *srbD = QRHI_RES(QD3D12ShaderResourceBindings, srb);
 
+    // Transitions are buffered for all the bindings and UAV barriers are
+    // collected, so that there are at most two ResourceBarrier calls instead
+    // of one or more per binding. The transitions go first, like when they
+    // were issued binding by binding.
+    QVarLengthArray<D3D12_RESOURCE_BARRIER, 8> uavBarriers;
+
     for (int i = 0, ie = srbD->m_bindings.size(); i != ie; ++i) {
         const QRhiShaderResourceBinding::Data *b = shaderResourceBindingData(srbD->m_bindings[i]);
         switch (b->type) {
@@ -1065,7 +1744,6 @@ void QRhiD3D12::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
                         state = D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE;
                     }
                     barrierGen.addTransitionBarrier(texD->handle, D3D12_RESOURCE_STATES(state));
-                    barrierGen.enqueueBufferedTransitionBarriers(cbD);
                 }
             }
         }
@@ -1079,13 +1757,13 @@ void QRhiD3D12::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
                 if (res->uavUsage) {
                     if (res->uavUsage & QD3D12Resource::UavUsageWrite) {
                         // RaW or WaW
-                        barrierGen.enqueueUavBarrier(cbD, texD->handle);
+                        uavBarriers.append(uavBarrier(res->resource));
                     } else {
                         if (b->type == QRhiShaderResourceBinding::ImageStore
                                 || b->type == QRhiShaderResourceBinding::ImageLoadStore)
                         {
                             // WaR or WaW
-                            barrierGen.enqueueUavBarrier(cbD, texD->handle);
+                            uavBarriers.append(uavBarrier(res->resource));
                         }
                     }
                 }
@@ -1095,7 +1773,6 @@ void QRhiD3D12::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
                 if (b->type == QRhiShaderResourceBinding::ImageStore || b->type == QRhiShaderResourceBinding::ImageLoadStore)
                     res->uavUsage |= QD3D12Resource::UavUsageWrite;
                 barrierGen.addTransitionBarrier(texD->handle, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-                barrierGen.enqueueBufferedTransitionBarriers(cbD);
             }
         }
             break;
@@ -1110,13 +1787,13 @@ void QRhiD3D12::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
                 if (res->uavUsage) {
                     if (res->uavUsage & QD3D12Resource::UavUsageWrite) {
                         // RaW or WaW
-                        barrierGen.enqueueUavBarrier(cbD, bufD->handles[0]);
+                        uavBarriers.append(uavBarrier(res->resource));
                     } else {
                         if (b->type == QRhiShaderResourceBinding::BufferStore
                                 || b->type == QRhiShaderResourceBinding::BufferLoadStore)
                         {
                             // WaR or WaW
-                            barrierGen.enqueueUavBarrier(cbD, bufD->handles[0]);
+                            uavBarriers.append(uavBarrier(res->resource));
                         }
                     }
                 }
@@ -1126,13 +1803,16 @@ void QRhiD3D12::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
                 if (b->type == QRhiShaderResourceBinding::BufferStore || b->type == QRhiShaderResourceBinding::BufferLoadStore)
                     res->uavUsage |= QD3D12Resource::UavUsageWrite;
                 barrierGen.addTransitionBarrier(bufD->handles[0], D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-                barrierGen.enqueueBufferedTransitionBarriers(cbD);
             }
         }
             break;
         }
     }
 
+    barrierGen.enqueueBufferedTransitionBarriers(cbD);
+    if (!uavBarriers.isEmpty())
+        cbD->cmdList->ResourceBarrier(uavBarriers.count(), uavBarriers.constData());
+
     const bool srbChanged = gfxPsD ? (cbD->currentGraphicsSrb != srb) : (cbD->currentComputeSrb != srb);
     const bool srbRebuilt = cbD->currentSrbGeneration != srbD->generation;
 
@@ -1181,6 +1861,9 @@ void QRhiD3D12::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
             bindShaderVisibleHeaps(cbD);
         }
 
+        QD3D12DescriptorTableCache *tableCache = &descriptorTableCache;
+        tableCache->setHeap(shaderVisibleCbvSrvUavHeap.heap.heap);
+
         int rootParamIndex = 0;
         for (int s = 0; s < 6; ++s) {
             if (!visitorData.cbufs[s].isEmpty()) {
@@ -1200,12 +1883,21 @@ void QRhiD3D12::setShaderResources(QRhiCommandBuffer *cb, QRhiShaderResourceBind
         }
         for (int s = 0; s < 6; ++s) {
             if (!visitorData.srvs[s].isEmpty()) {
-                QD3D12DescriptorHeap &gpuSrvHeap(shaderVisibleCbvSrvUavHeap.perFrameHeapSlice[currentFrameSlot]);
-                QD3D12Descriptor startDesc = gpuSrvHeap.get(visitorData.srvs[s].count());
-                for (int i = 0, count = visitorData.srvs[s].count(); i < count; ++i) {
-                    const auto &srv(visitorData.srvs[s][i]);
-                    dev->CopyDescriptorsSimple(1, gpuSrvHeap.incremented(startDesc, i).cpuHandle, srv.cpuHandle,
-                                               D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+                QD3D12DescriptorTableCache::SourceHandles srcHandles;
+                for (const QD3D12Descriptor &srv : std::as_const(visitorData.srvs[s]))
+                    srcHandles.append(srv.cpuHandle.ptr);
+                const size_t tableKey = QD3D12DescriptorTableCache::key(srcHandles);
+                QD3D12Descriptor startDesc = tableCache->lookup(currentFrameSlot, tableKey, srcHandles);
+                if (!startDesc.isValid()) {
+                    QD3D12DescriptorHeap &gpuSrvHeap(shaderVisibleCbvSrvUavHeap.perFrameHeapSlice[currentFrameSlot]);
+                    startDesc = gpuSrvHeap.get(visitorData.srvs[s].count());
+                    for (int i = 0, count = visitorData.srvs[s].count(); i < count; ++i) {
+                        const auto &srv(visitorData.srvs[s][i]);
+                        dev->CopyDescriptorsSimple(1, gpuSrvHeap.incremented(startDesc, i).cpuHandle, srv.cpuHandle,
+                                                   D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+                    }
+                    if (startDesc.isValid())
+                        tableCache->insert(currentFrameSlot, tableKey, srcHandles, startDesc);
                 }
 
                 if (cbD->currentGraphicsPipeline)
@@ -1600,6 +2292,7 @@ QRhi::FrameOpResult QRhiD3D12::beginFrame(QRhiSwapChain *swapChain, QRhi::BeginF
 
     // Move the head back to zero for the per-frame shader-visible descriptor heap work areas.
     shaderVisibleCbvSrvUavHeap.perFrameHeapSlice[currentFrameSlot].head = 0;
+    descriptorTableCache.reset(currentFrameSlot);
     // Same for the small staging area.
     smallStagingAreas[currentFrameSlot].head = 0;
 
@@ -1712,6 +2405,9 @@ QRhi::FrameOpResult QRhiD3D12::endFrame(QRhiSwapChain *swapChain, QRhi::EndFrame
     }
 
     currentSwapChain = nullptr;
+
+    updateMemoryBudget(this);
+
     return QRhi::FrameOpSuccess;
 }
 
@@ -1742,6 +2438,7 @@ QRhi::FrameOpResult QRhiD3D12::beginOffscreenFrame(QRhiCommandBuffer **cb, QRhi:
     releaseQueue.executeDeferredReleases(currentFrameSlot);
     cbD->resetState();
     shaderVisibleCbvSrvUavHeap.perFrameHeapSlice[currentFrameSlot].head = 0;
+    descriptorTableCache.reset(currentFrameSlot);
     smallStagingAreas[currentFrameSlot].head = 0;
 
     bindShaderVisibleHeaps(cbD);
@@ -1806,6 +2503,8 @@ QRhi::FrameOpResult QRhiD3D12::endOffscreenFrame(QRhi::EndFrameFlags flags)
                          timestampTicksPerSecond);
     }
 
+    updateMemoryBudget(this);
+
     return QRhi::FrameOpSuccess;
 }
 
@@ -1856,6 +2555,7 @@ QRhi::FrameOpResult QRhiD3D12::finish()
     cbD->resetState();
 
     shaderVisibleCbvSrvUavHeap.perFrameHeapSlice[currentFrameSlot].head = 0;
+    descriptorTableCache.reset(currentFrameSlot);
     smallStagingAreas[currentFrameSlot].head = 0;
 
     bindShaderVisibleHeaps(cbD);
@@ -2392,7 +3092,7 @@ void QD3D12ReleaseQueue::deferredReleaseResource(const QD3D12ObjectHandle &handl
 {
     DeferredReleaseEntry e;
     e.handle = handle;
-    queue.append(e);
+    pending.append(e);
 }
 
 void QD3D12ReleaseQueue::deferredReleaseResourceWithViews(const QD3D12ObjectHandle &handle,
@@ -2406,7 +3106,7 @@ void QD3D12ReleaseQueue::deferredReleaseResourceWithViews(const QD3D12ObjectHand
     e.poolForViews = pool;
     e.viewsStart = viewsStart;
     e.viewCount = viewCount;
-    queue.append(e);
+    pending.append(e);
 }
 
 void QD3D12ReleaseQueue::deferredReleasePipeline(const QD3D12ObjectHandle &handle)
@@ -2414,7 +3114,7 @@ void QD3D12ReleaseQueue::deferredReleasePipeline(const QD3D12ObjectHandle &handl
     DeferredReleaseEntry e;
     e.type = DeferredReleaseEntry::Pipeline;
     e.handle = handle;
-    queue.append(e);
+    pending.append(e);
 }
 
 void QD3D12ReleaseQueue::deferredReleaseRootSignature(const QD3D12ObjectHandle &handle)
@@ -2422,7 +3122,7 @@ void QD3D12ReleaseQueue::deferredReleaseRootSignature(const QD3D12ObjectHandle &
     DeferredReleaseEntry e;
     e.type = DeferredReleaseEntry::RootSignature;
     e.handle = handle;
-    queue.append(e);
+    pending.append(e);
 }
 
 void QD3D12ReleaseQueue::deferredReleaseCallback(std::function<void(void*)> callback, void *userData)
@@ -2431,7 +3131,7 @@ void QD3D12ReleaseQueue::deferredReleaseCallback(std::function<void(void*)> call
     e.type = DeferredReleaseEntry::Callback;
     e.callback = callback;
     e.callbackUserData = userData;
-    queue.append(e);
+    pending.append(e);
 }
 
 void QD3D12ReleaseQueue::deferredReleaseResourceAndAllocation(ID3D12Resource *resource,
@@ -2440,7 +3140,7 @@ void QD3D12ReleaseQueue::deferredReleaseResourceAndAllocation(ID3D12Resource *re
     DeferredReleaseEntry e;
     e.type = DeferredReleaseEntry::ResourceAndAllocation;
     e.resourceAndAllocation = { resource, allocation };
-    queue.append(e);
+    pending.append(e);
 }
 
 void QD3D12ReleaseQueue::deferredReleaseDescriptorHeap(ID3D12DescriptorHeap *heap)
@@ -2448,7 +3148,7 @@ void QD3D12ReleaseQueue::deferredReleaseDescriptorHeap(ID3D12DescriptorHeap *hea
     DeferredReleaseEntry e;
     e.type = DeferredReleaseEntry::DescriptorHeap;
     e.descriptorHeap = heap;
-    queue.append(e);
+    pending.append(e);
 }
 
 void QD3D12ReleaseQueue::deferredReleaseViews(QD3D12CpuDescriptorPool *pool,
@@ -2460,54 +3160,78 @@ void QD3D12ReleaseQueue::deferredReleaseViews(QD3D12CpuDescriptorPool *pool,
     e.poolForViews = pool;
     e.viewsStart = viewsStart;
     e.viewCount = viewCount;
-    queue.append(e);
+    pending.append(e);
 }
 
 void QD3D12ReleaseQueue::activatePendingDeferredReleaseRequests(int frameSlot)
 {
-    for (DeferredReleaseEntry &e : queue) {
-        if (!e.frameSlotToBeReleasedIn.has_value())
-            e.frameSlotToBeReleasedIn = frameSlot;
-    }
+    QVector<DeferredReleaseEntry> &slotQueue(slotQueues[frameSlot]);
+    if (slotQueue.isEmpty())
+        slotQueue.swap(pending);
+    else
+        slotQueue.append(std::move(pending));
+    pending.clear();
 }
 
 void QD3D12ReleaseQueue::executeDeferredReleases(int frameSlot, bool forced)
 {
-    for (int i = queue.count() - 1; i >= 0; --i) {
-        const DeferredReleaseEntry &e(queue[i]);
-        if (forced || (e.frameSlotToBeReleasedIn.has_value() && e.frameSlotToBeReleasedIn.value() == frameSlot)) {
-            switch (e.type) {
-            case DeferredReleaseEntry::Resource:
-                resourcePool->remove(e.handle);
-                if (e.poolForViews && e.viewsStart.isValid() && e.viewCount > 0)
-                    e.poolForViews->release(e.viewsStart, e.viewCount);
-                break;
-            case DeferredReleaseEntry::Pipeline:
-                pipelinePool->remove(e.handle);
-                break;
-            case DeferredReleaseEntry::RootSignature:
-                rootSignaturePool->remove(e.handle);
-                break;
-            case DeferredReleaseEntry::Callback:
-                e.callback(e.callbackUserData);
-                break;
-            case DeferredReleaseEntry::ResourceAndAllocation:
-                // order matters: resource first, then the allocation (which
-                // may be null)
-                e.resourceAndAllocation.first->Release();
-                if (e.resourceAndAllocation.second)
-                    e.resourceAndAllocation.second->Release();
-                break;
-            case DeferredReleaseEntry::DescriptorHeap:
-                e.descriptorHeap->Release();
-                break;
-            case DeferredReleaseEntry::Views:
+    if (forced) {
+        for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i)
+            activatePendingDeferredReleaseRequests(i);
+        for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i)
+            releaseEntries(&slotQueues[i]);
+        return;
+    }
+
+    releaseEntries(&slotQueues[frameSlot]);
+}
+
+void QD3D12ReleaseQueue::releaseEntries(QVector<DeferredReleaseEntry> *entries)
+{
+    if (entries->isEmpty())
+        return;
+
+    // Callbacks may enqueue new requests, those go to pending and are left
+    // alone here. Taking the list also keeps it stable while iterating.
+    QVector<DeferredReleaseEntry> due;
+    due.swap(*entries);
+    for (qsizetype i = due.count() - 1; i >= 0; --i) {
+        const DeferredReleaseEntry &e(due[i]);
+        switch (e.type) {
+        case DeferredReleaseEntry::Resource:
+            resourcePool->remove(e.handle);
+            if (e.poolForViews && e.viewsStart.isValid() && e.viewCount > 0)
                 e.poolForViews->release(e.viewsStart, e.viewCount);
-                break;
-            }
-            queue.removeAt(i);
+            break;
+        case DeferredReleaseEntry::Pipeline:
+            pipelinePool->remove(e.handle);
+            break;
+        case DeferredReleaseEntry::RootSignature:
+            rootSignaturePool->remove(e.handle);
+            break;
+        case DeferredReleaseEntry::Callback:
+            e.callback(e.callbackUserData);
+            break;
+        case DeferredReleaseEntry::ResourceAndAllocation:
+            // order matters: resource first, then the allocation (which
+            // may be null)
+            e.resourceAndAllocation.first->Release();
+            if (e.resourceAndAllocation.second)
+                e.resourceAndAllocation.second->Release();
+            break;
+        case DeferredReleaseEntry::DescriptorHeap:
+            e.descriptorHeap->Release();
+            break;
+        case DeferredReleaseEntry::Views:
+            e.poolForViews->release(e.viewsStart, e.viewCount);
+            break;
         }
     }
+
+    // keep the allocation around for the next frame using this slot
+    due.clear();
+    if (entries->isEmpty())
+        entries->swap(due);
 }
 
 void QD3D12ReleaseQueue::releaseAll()
@@ -2520,6 +3244,21 @@ void QD3D12ResourceBarrierGenerator::addTransitionBarrier(const QD3D12ObjectHand
 {
     if (QD3D12Resource *res = resourcePool->lookupRef(resourceHandle)) {
         if (stateAfter != res->state) {
+            // Fold into an already buffered transition for the same resource,
+            // so that A -> B -> C becomes A -> C, and A -> B -> A disappears.
+            for (qsizetype i = 0, count = transitionResourceBarriers.count(); i < count; ++i) {
+                TransitionResourceBarrier &trb(transitionResourceBarriers[i]);
+                if (trb.resourceHandle.index == resourceHandle.index
+                        && trb.resourceHandle.generation == resourceHandle.generation)
+                {
+                    if (trb.stateBefore == stateAfter)
+                        transitionResourceBarriers.remove(i);
+                    else
+                        trb.stateAfter = stateAfter;
+                    res->state = stateAfter;
+                    return;
+                }
+            }
             transitionResourceBarriers.append({ resourceHandle, res->state, stateAfter });
             res->state = stateAfter;
         }
@@ -2531,14 +3270,8 @@ void QD3D12ResourceBarrierGenerator::enqueueBufferedTransitionBarriers(QD3D12Com
     QVarLengthArray<D3D12_RESOURCE_BARRIER, PREALLOC> barriers;
     for (const TransitionResourceBarrier &trb : transitionResourceBarriers) {
         if (QD3D12Resource *res = resourcePool->lookupRef(trb.resourceHandle)) {
-            D3D12_RESOURCE_BARRIER barrier = {};
-            barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
-            barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
-            barrier.Transition.pResource = res->resource;
-            barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
-            barrier.Transition.StateBefore = trb.stateBefore;
-            barrier.Transition.StateAfter = trb.stateAfter;
-            barriers.append(barrier);
+            barriers.append(transitionBarrier(res->resource, D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES,
+                                              trb.stateBefore, trb.stateAfter));
         }
     }
     transitionResourceBarriers.clear();
@@ -2553,13 +3286,7 @@ void QD3D12ResourceBarrierGenerator::enqueueSubresourceTransitionBarrier(QD3D12C
                                                                          D3D12_RESOURCE_STATES stateAfter)
 {
     if (QD3D12Resource *res = resourcePool->lookupRef(resourceHandle)) {
-        D3D12_RESOURCE_BARRIER barrier = {};
-        barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
-        barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
-        barrier.Transition.pResource = res->resource;
-        barrier.Transition.Subresource = subresource;
-        barrier.Transition.StateBefore = stateBefore;
-        barrier.Transition.StateAfter = stateAfter;
+        const D3D12_RESOURCE_BARRIER barrier = transitionBarrier(res->resource, subresource, stateBefore, stateAfter);
         cbD->cmdList->ResourceBarrier(1, &barrier);
     }
 }
@@ -2568,10 +3295,7 @@ void QD3D12ResourceBarrierGenerator::enqueueUavBarrier(QD3D12CommandBuffer *cbD,
                                                        const QD3D12ObjectHandle &resourceHandle)
 {
     if (QD3D12Resource *res = resourcePool->lookupRef(resourceHandle)) {
-        D3D12_RESOURCE_BARRIER barrier = {};
-        barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
-        barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
-        barrier.UAV.pResource = res->resource;
+        const D3D12_RESOURCE_BARRIER barrier = uavBarrier(res->resource);
         cbD->cmdList->ResourceBarrier(1, &barrier);
     }
 }
@@ -2759,6 +3483,9 @@ bool QD3D12SamplerManager::create(ID3D12Device *device)
 void QD3D12SamplerManager::destroy()
 {
     if (device) {
+        gpuMap.clear();
+        slots.clear();
+        freeList.clear();
         shaderVisibleSamplerHeap.destroy();
         device = nullptr;
     }
@@ -2767,22 +3494,63 @@ void QD3D12SamplerManager::destroy()
 QD3D12Descriptor QD3D12SamplerManager::getShaderVisibleDescriptor(const D3D12_SAMPLER_DESC &desc)
 {
     auto it = gpuMap.constFind({desc});
-    if (it != gpuMap.cend())
+    if (it != gpuMap.cend()) {
+        slots[it->cpuHandle.ptr].refCount += 1;
         return *it;
+    }
+
+    QD3D12Descriptor descriptor;
+    if (!freeList.isEmpty()) {
+        descriptor = freeList.takeLast();
+        recycledCount += 1;
+    } else if (shaderVisibleSamplerHeap.heap.head < shaderVisibleSamplerHeap.heap.capacity) {
+        descriptor = shaderVisibleSamplerHeap.heap.get(1);
+    }
 
-    QD3D12Descriptor descriptor = shaderVisibleSamplerHeap.heap.get(1);
     if (descriptor.isValid()) {
         device->CreateSampler(&desc, descriptor.cpuHandle);
         gpuMap.insert({desc}, descriptor);
+        slots.insert(descriptor.cpuHandle.ptr, { {desc}, 1, 0 });
     } else {
         qWarning("Out of shader-visible SAMPLER descriptor heap space,"
-                 " this should not happen, maximum number of unique samplers is %u",
-                 shaderVisibleSamplerHeap.heap.capacity);
+                 " maximum number of unique samplers alive at the same time is %u"
+                 " (%u slots recycled so far)",
+                 shaderVisibleSamplerHeap.heap.capacity, recycledCount);
     }
 
     return descriptor;
 }
 
+// Called when a QD3D12Sampler no longer uses its shader-visible descriptor.
+// The slot can only be reused once the frames in flight that may still
+// reference it have completed, hence going through the release queue.
+void QD3D12SamplerManager::releaseShaderVisibleDescriptor(const QD3D12Descriptor &descriptor,
+                                                          QD3D12ReleaseQueue *releaseQueue)
+{
+    auto it = slots.find(descriptor.cpuHandle.ptr);
+    if (it == slots.end() || --it->refCount > 0)
+        return;
+    const quint32 serial = ++releaseSerial;
+    it->releaseSerial = serial;
+    releaseQueue->deferredReleaseCallback([this, descriptor, serial](void *) {
+        recycleShaderVisibleDescriptor(descriptor, serial);
+    }, nullptr);
+}
+
+void QD3D12SamplerManager::recycleShaderVisibleDescriptor(const QD3D12Descriptor &descriptor,
+                                                          quint32 serial)
+{
+    // Skip if the descriptor got picked up again, or was released again later
+    // (then that release's callback will take care of it).
+    auto it = slots.find(descriptor.cpuHandle.ptr);
+    if (it == slots.end() || it->refCount > 0 || it->releaseSerial != serial)
+        return;
+
+    gpuMap.remove(it->key);
+    slots.erase(it);
+    freeList.append(descriptor);
+}
+
 typedef HRESULT(WINAPI* D3D12SerializeVersionedRootSignatureFunc) (const D3D12_VERSIONED_ROOT_SIGNATURE_DESC *, ID3DBlob **, ID3DBlob **);
 D3D12SerializeVersionedRootSignatureFunc myD3D12SerializeVersionedRootSignature = nullptr;
 
@@ -2888,45 +3656,81 @@ void QD3D12MipmapGenerator::destroy()
     rootSigHandle = {};
 }
 
-void QD3D12MipmapGenerator::generate(QD3D12CommandBuffer *cbD, const QD3D12ObjectHandle &textureHandle)
+// Generates the mip chains for several textures together. Every texture
+// layer is an independent job. The jobs advance in lockstep, so the n-th
+// dispatch of all of them runs between the same two barrier batches. This
+// gives one ResourceBarrier call per step instead of one per dispatch.
+static void generateMipmaps(QD3D12MipmapGenerator *gen, QD3D12CommandBuffer *cbD,
+                            const QD3D12ObjectHandle *textureHandles, int textureCount)
 {
-    QD3D12Pipeline *pipeline = rhiD->pipelinePool.lookupRef(pipelineHandle);
+    QRhiD3D12 *rhiD = gen->rhiD;
+    QD3D12Pipeline *pipeline = rhiD->pipelinePool.lookupRef(gen->pipelineHandle);
     if (!pipeline)
         return;
-    QD3D12RootSignature *rootSig = rhiD->rootSignaturePool.lookupRef(rootSigHandle);
+    QD3D12RootSignature *rootSig = rhiD->rootSignaturePool.lookupRef(gen->rootSigHandle);
     if (!rootSig)
         return;
-    QD3D12Resource *res = rhiD->resourcePool.lookupRef(textureHandle);
-    if (!res)
-        return;
 
-    const quint32 mipLevelCount = res->desc.MipLevels;
-    if (mipLevelCount < 2)
-        return;
-
-    if (res->desc.SampleDesc.Count > 1) {
-        qWarning("Cannot generate mipmaps for MSAA texture");
-        return;
-    }
+    // Pool lookups are not kept, creating a staging area below may add to
+    // the resource pool.
+    struct Job {
+        ID3D12Resource *resource;
+        D3D12_RESOURCE_DESC desc;
+        bool isCubeOrArray;
+        quint32 layer;
+        QVarLengthArray<QRhiD3D::MipmapDispatch, 8> dispatches;
+    };
+    QVarLengthArray<Job, 8> jobs;
+    QSet<QD3D12ObjectHandle> handles;
+    qsizetype dispatchCount = 0;
+    qsizetype stepCount = 0;
+    for (int i = 0; i < textureCount; ++i) {
+        const QD3D12ObjectHandle &textureHandle(textureHandles[i]);
+        // generating twice in a row is the same as once, and the same
+        // subresources must not be written by two jobs in the same step
+        if (handles.contains(textureHandle))
+            continue;
+        QD3D12Resource *res = rhiD->resourcePool.lookupRef(textureHandle);
+        if (!res)
+            continue;
+
+        const quint32 mipLevelCount = res->desc.MipLevels;
+        if (mipLevelCount < 2)
+            continue;
+
+        if (res->desc.SampleDesc.Count > 1) {
+            qWarning("Cannot generate mipmaps for MSAA texture");
+            continue;
+        }
 
-    const bool is1D = res->desc.Dimension == D3D12_RESOURCE_DIMENSION_TEXTURE1D;
-    if (is1D) {
-        qWarning("Cannot generate mipmaps for 1D texture");
-        return;
-    }
+        const bool is1D = res->desc.Dimension == D3D12_RESOURCE_DIMENSION_TEXTURE1D;
+        if (is1D) {
+            qWarning("Cannot generate mipmaps for 1D texture");
+            continue;
+        }
 
-    const bool is3D = res->desc.Dimension == D3D12_RESOURCE_DIMENSION_TEXTURE3D;
-    const bool isCubeOrArray = res->desc.Dimension == D3D12_RESOURCE_DIMENSION_TEXTURE2D
-            && res->desc.DepthOrArraySize > 1;
-    const quint32 layerCount = isCubeOrArray ? res->desc.DepthOrArraySize : 1;
+        const bool is3D = res->desc.Dimension == D3D12_RESOURCE_DIMENSION_TEXTURE3D;
+        if (is3D) {
+            // ### needs its own shader and maybe a different solution
+            qWarning("3D texture mipmapping is not implemented for D3D12 atm");
+            continue;
+        }
 
-    if (is3D) {
-        // ### needs its own shader and maybe a different solution
-        qWarning("3D texture mipmapping is not implemented for D3D12 atm");
+        const bool isCubeOrArray = res->desc.Dimension == D3D12_RESOURCE_DIMENSION_TEXTURE2D
+                && res->desc.DepthOrArraySize > 1;
+        const quint32 layerCount = isCubeOrArray ? res->desc.DepthOrArraySize : 1;
+        const QVarLengthArray<QRhiD3D::MipmapDispatch, 8> dispatches =
+                QRhiD3D::planMipmapDispatches(quint32(res->desc.Width), res->desc.Height, mipLevelCount);
+        for (quint32 layer = 0; layer < layerCount; ++layer)
+            jobs.append({ res->resource, res->desc, isCubeOrArray, layer, dispatches });
+        dispatchCount += dispatches.count() * layerCount;
+        stepCount = qMax(stepCount, dispatches.count());
+        handles.insert(textureHandle);
+        rhiD->barrierGen.addTransitionBarrier(textureHandle, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    }
+    if (jobs.isEmpty())
         return;
-    }
 
-    rhiD->barrierGen.addTransitionBarrier(textureHandle, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
     rhiD->barrierGen.enqueueBufferedTransitionBarriers(cbD);
 
     cbD->cmdList->SetPipelineState(pipeline->pso);
@@ -2941,9 +3745,9 @@ void QD3D12MipmapGenerator::generate(QD3D12CommandBuffer *cbD, const QD3D12Objec
         float texelHeight;
     };
 
-    const quint32 allocSize = QD3D12StagingArea::allocSizeForArray(sizeof(CBufData), mipLevelCount * layerCount);
+    const quint32 allocSize = QD3D12StagingArea::allocSizeForArray(sizeof(CBufData), int(dispatchCount));
     std::optional<QD3D12StagingArea> ownStagingArea;
-    if (rhiD->smallStagingAreas[rhiD->currentFrameSlot].remainingCapacity() < allocSize) {
+    if (!ensureSmallStagingAreaCapacity(rhiD, allocSize)) {
         ownStagingArea = QD3D12StagingArea();
         if (!ownStagingArea->create(rhiD, allocSize, D3D12_HEAP_TYPE_UPLOAD)) {
             qWarning("Could not create staging area for mipmap generation");
@@ -2958,7 +3762,7 @@ void QD3D12MipmapGenerator::generate(QD3D12CommandBuffer *cbD, const QD3D12Objec
     if (!rhiD->ensureShaderVisibleDescriptorHeapCapacity(&rhiD->shaderVisibleCbvSrvUavHeap,
                                                          D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV,
                                                          rhiD->currentFrameSlot,
-                                                         (1 + 4) * mipLevelCount * layerCount,
+                                                         (1 + 4) * quint32(dispatchCount),
                                                          &gotNewHeap))
     {
         qWarning("Could not ensure enough space in descriptor heap for mipmap generation");
@@ -2967,28 +3771,35 @@ void QD3D12MipmapGenerator::generate(QD3D12CommandBuffer *cbD, const QD3D12Objec
     if (gotNewHeap)
         rhiD->bindShaderVisibleHeaps(cbD);
 
-    for (quint32 layer = 0; layer < layerCount; ++layer) {
-        for (quint32 level = 0; level < mipLevelCount ;) {
-            UINT subresource = calcSubresource(level, layer, res->desc.MipLevels);
-            rhiD->barrierGen.enqueueSubresourceTransitionBarrier(cbD, textureHandle, subresource,
-                                                                 D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                                                                 D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
-
-            quint32 levelPlusOneMipWidth = res->desc.Width >> (level + 1);
-            quint32 levelPlusOneMipHeight = res->desc.Height >> (level + 1);
-            const quint32 dw = levelPlusOneMipWidth == 1 ? levelPlusOneMipHeight : levelPlusOneMipWidth;
-            const quint32 dh = levelPlusOneMipHeight == 1 ? levelPlusOneMipWidth : levelPlusOneMipHeight;
-            // number of times the size can be halved while still resulting in an even dimension
-            const quint32 additionalMips = qCountTrailingZeroBits(dw | dh);
-            const quint32 numGenMips = qMin(1u + qMin(3u, additionalMips), res->desc.MipLevels - level);
-            levelPlusOneMipWidth = qMax(1u, levelPlusOneMipWidth);
-            levelPlusOneMipHeight = qMax(1u, levelPlusOneMipHeight);
+    // The UAV barriers and the transitions back to UAV after a step are
+    // issued together with the transitions of the next step's source
+    // subresources, in a single ResourceBarrier call.
+    QVarLengthArray<D3D12_RESOURCE_BARRIER, 32> barriers;
+    QVarLengthArray<ID3D12Resource *, 8> uavBarrierResources;
+
+    for (qsizetype step = 0; step < stepCount; ++step) {
+        for (const Job &job : std::as_const(jobs)) {
+            if (step >= job.dispatches.count())
+                continue;
+            const UINT subresource = calcSubresource(job.dispatches[step].level, job.layer, job.desc.MipLevels);
+            barriers.append(transitionBarrier(job.resource, subresource,
+                                              D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                              D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
+        }
+        cbD->cmdList->ResourceBarrier(barriers.count(), barriers.constData());
+        barriers.clear();
+        uavBarrierResources.clear();
+
+        for (const Job &job : std::as_const(jobs)) {
+            if (step >= job.dispatches.count())
+                continue;
+            const QRhiD3D::MipmapDispatch &d(job.dispatches[step]);
 
             CBufData cbufData = {
-                level,
-                numGenMips,
-                1.0f / float(levelPlusOneMipWidth),
-                1.0f / float(levelPlusOneMipHeight)
+                d.level,
+                d.numGenMips,
+                1.0f / float(d.width),
+                1.0f / float(d.height)
             };
 
             QD3D12StagingArea::Allocation cbuf = workArea->get(sizeof(cbufData));
@@ -2997,67 +3808,69 @@ void QD3D12MipmapGenerator::generate(QD3D12CommandBuffer *cbD, const QD3D12Objec
 
             QD3D12Descriptor srv = rhiD->shaderVisibleCbvSrvUavHeap.perFrameHeapSlice[rhiD->currentFrameSlot].get(1);
             D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
-            srvDesc.Format = res->desc.Format;
+            srvDesc.Format = job.desc.Format;
             srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-            if (isCubeOrArray) {
+            if (job.isCubeOrArray) {
                 srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2DARRAY;
-                srvDesc.Texture2DArray.MostDetailedMip = level;
+                srvDesc.Texture2DArray.MostDetailedMip = d.level;
                 srvDesc.Texture2DArray.MipLevels = 1;
-                srvDesc.Texture2DArray.FirstArraySlice = layer;
+                srvDesc.Texture2DArray.FirstArraySlice = job.layer;
                 srvDesc.Texture2DArray.ArraySize = 1;
-            } else if (is3D) {
-                srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE3D;
-                srvDesc.Texture3D.MostDetailedMip = level;
-                srvDesc.Texture3D.MipLevels = 1;
             } else {
                 srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
-                srvDesc.Texture2D.MostDetailedMip = level;
+                srvDesc.Texture2D.MostDetailedMip = d.level;
                 srvDesc.Texture2D.MipLevels = 1;
             }
-            rhiD->dev->CreateShaderResourceView(res->resource, &srvDesc, srv.cpuHandle);
+            rhiD->dev->CreateShaderResourceView(job.resource, &srvDesc, srv.cpuHandle);
             cbD->cmdList->SetComputeRootDescriptorTable(1, srv.gpuHandle);
 
             QD3D12Descriptor uavStart = rhiD->shaderVisibleCbvSrvUavHeap.perFrameHeapSlice[rhiD->currentFrameSlot].get(4);
             D3D12_CPU_DESCRIPTOR_HANDLE uavCpuHandle = uavStart.cpuHandle;
             // if level is N, then need UAVs for levels N+1, ..., N+4
             for (quint32 uavIdx = 0; uavIdx < 4; ++uavIdx) {
-                const quint32 uavMipLevel = qMin(level + 1u + uavIdx, res->desc.MipLevels - 1u);
+                const quint32 uavMipLevel = qMin(d.level + 1u + uavIdx, job.desc.MipLevels - 1u);
                 D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
-                uavDesc.Format = res->desc.Format;
-                if (isCubeOrArray) {
+                uavDesc.Format = job.desc.Format;
+                if (job.isCubeOrArray) {
                     uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2DARRAY;
                     uavDesc.Texture2DArray.MipSlice = uavMipLevel;
-                    uavDesc.Texture2DArray.FirstArraySlice = layer;
+                    uavDesc.Texture2DArray.FirstArraySlice = job.layer;
                     uavDesc.Texture2DArray.ArraySize = 1;
-                } else if (is3D) {
-                    uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE3D;
-                    uavDesc.Texture3D.MipSlice = uavMipLevel;
-                    uavDesc.Texture3D.FirstWSlice = 0; // depth etc. not implemented yet
-                    uavDesc.Texture3D.WSize = 1;
                 } else {
                     uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
                     uavDesc.Texture2D.MipSlice = uavMipLevel;
                 }
-                rhiD->dev->CreateUnorderedAccessView(res->resource, nullptr, &uavDesc, uavCpuHandle);
+                rhiD->dev->CreateUnorderedAccessView(job.resource, nullptr, &uavDesc, uavCpuHandle);
                 uavCpuHandle.ptr += descriptorByteSize;
             }
             cbD->cmdList->SetComputeRootDescriptorTable(2, uavStart.gpuHandle);
 
-            cbD->cmdList->Dispatch(levelPlusOneMipWidth, levelPlusOneMipHeight, 1);
-
-            rhiD->barrierGen.enqueueUavBarrier(cbD, textureHandle);
-            rhiD->barrierGen.enqueueSubresourceTransitionBarrier(cbD, textureHandle, subresource,
-                                                                 D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE,
-                                                                 D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            cbD->cmdList->Dispatch(d.width, d.height, 1);
 
-            level += numGenMips;
+            // one UAV barrier per resource covers all of its layers
+            if (!uavBarrierResources.contains(job.resource)) {
+                uavBarrierResources.append(job.resource);
+                barriers.append(uavBarrier(job.resource));
+            }
+            const UINT subresource = calcSubresource(d.level, job.layer, job.desc.MipLevels);
+            barriers.append(transitionBarrier(job.resource, subresource,
+                                              D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE,
+                                              D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
         }
     }
 
+    if (!barriers.isEmpty())
+        cbD->cmdList->ResourceBarrier(barriers.count(), barriers.constData());
+
     if (ownStagingArea.has_value())
         ownStagingArea->destroyWithDeferredRelease(&rhiD->releaseQueue);
 }
 
+void QD3D12MipmapGenerator::generate(QD3D12CommandBuffer *cbD, const QD3D12ObjectHandle &textureHandle)
+{
+    generateMipmaps(this, cbD, &textureHandle, 1);
+}
+
 bool QD3D12MemoryAllocator::create(ID3D12Device *device, IDXGIAdapter1 *adapter)
 {
     this->device = device;
@@ -3236,11 +4049,10 @@ void QRhiD3D12::enqueueResourceUpdates(QD3D12CommandBuffer *cbD, QRhiResourceUpd
         if (u.type == QRhiResourceUpdateBatchPrivate::BufferOp::DynamicUpdate) {
             QD3D12Buffer *bufD = QRHI_RES(QD3D12Buffer, u.buf);
             Q_ASSERT(bufD->m_type == QRhiBuffer::Dynamic);
-            for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i) {
-                if (u.offset == 0 && u.data.size() == bufD->m_size)
-                    bufD->pendingHostWrites[i].clear();
-                bufD->pendingHostWrites[i].append({ u.offset, u.data });
-            }
+            // A slot's writes are only flushed when that slot is used again.
+            // Coalescing keeps data updated every frame from piling up.
+            for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i)
+                bufD->pendingHostWrites[i].add(u.offset, u.data.constData(), quint32(u.data.size()));
         } else if (u.type == QRhiResourceUpdateBatchPrivate::BufferOp::StaticUpload) {
             QD3D12Buffer *bufD = QRHI_RES(QD3D12Buffer, u.buf);
             Q_ASSERT(bufD->m_type != QRhiBuffer::Dynamic);
@@ -3248,13 +4060,14 @@ void QRhiD3D12::enqueueResourceUpdates(QD3D12CommandBuffer *cbD, QRhiResourceUpd
 
             // The general approach to staging upload data is to first try
             // using the per-frame "small" staging area, which is a very simple
-            // linear allocator; if that's not big enough then create a
-            // dedicated StagingArea and then deferred-release it to make sure
-            // if stays alive while the frame is possibly still in flight.
+            // linear allocator that grows (up to a limit) when a frame needs
+            // more; if that's still not big enough then create a dedicated
+            // StagingArea and then deferred-release it to make sure if stays
+            // alive while the frame is possibly still in flight.
 
             QD3D12StagingArea::Allocation stagingAlloc;
             const quint32 allocSize = QD3D12StagingArea::allocSizeForArray(bufD->m_size, 1);
-            if (smallStagingAreas[currentFrameSlot].remainingCapacity() >= allocSize)
+            if (ensureSmallStagingAreaCapacity(this, allocSize))
                 stagingAlloc = smallStagingAreas[currentFrameSlot].get(bufD->m_size);
 
             std::optional<QD3D12StagingArea> ownStagingArea;
@@ -3328,8 +4141,15 @@ void QRhiD3D12::enqueueResourceUpdates(QD3D12CommandBuffer *cbD, QRhiResourceUpd
         }
     }
 
+    // Consecutive mipmap generation requests are done together, but not
+    // across other texture operations that may depend on their results.
+    QVarLengthArray<QD3D12ObjectHandle, 8> pendingGenMips;
     for (int opIdx = 0; opIdx < ud->activeTextureOpCount; ++opIdx) {
         const QRhiResourceUpdateBatchPrivate::TextureOp &u(ud->textureOps[opIdx]);
+        if (u.type != QRhiResourceUpdateBatchPrivate::TextureOp::GenMips && !pendingGenMips.isEmpty()) {
+            generateMipmaps(&mipmapGen, cbD, pendingGenMips.constData(), pendingGenMips.count());
+            pendingGenMips.clear();
+        }
         if (u.type == QRhiResourceUpdateBatchPrivate::TextureOp::Upload) {
             QD3D12Texture *texD = QRHI_RES(QD3D12Texture, u.dst);
             const bool is3D = texD->m_flags.testFlag(QRhiTexture::ThreeDimensional);
@@ -3378,7 +4198,7 @@ void QRhiD3D12::enqueueResourceUpdates(QD3D12CommandBuffer *cbD, QRhiResourceUpd
 
                         const quint32 allocSize = QD3D12StagingArea::allocSizeForArray(totalBytes, 1);
                         QD3D12StagingArea::Allocation stagingAlloc;
-                        if (smallStagingAreas[currentFrameSlot].remainingCapacity() >= allocSize)
+                        if (ensureSmallStagingAreaCapacity(this, allocSize))
                             stagingAlloc = smallStagingAreas[currentFrameSlot].get(allocSize);
 
                         std::optional<QD3D12StagingArea> ownStagingArea;
@@ -3569,6 +4389,11 @@ void QRhiD3D12::enqueueResourceUpdates(QD3D12CommandBuffer *cbD, QRhiResourceUpd
                     continue;
                 srcHandle = currentSwapChain->colorBuffers[currentSwapChain->currentBackBufferIndex];
             }
+            readback.conversion = cbD->readbackConversions.take(u.result);
+            if (readback.conversion && !QRhiD3D::canConvertPixels(readback.format)) {
+                qWarning("Readback conversions need RGBA8 or BGRA8 data, ignoring");
+                readback.conversion = {};
+            }
 
             textureFormatInfo(readback.format,
                               readback.pixelSize,
@@ -3632,13 +4457,30 @@ void QRhiD3D12::enqueueResourceUpdates(QD3D12CommandBuffer *cbD, QRhiResourceUpd
         } else if (u.type == QRhiResourceUpdateBatchPrivate::TextureOp::GenMips) {
             QD3D12Texture *texD = QRHI_RES(QD3D12Texture, u.dst);
             Q_ASSERT(texD->flags().testFlag(QRhiTexture::UsedWithGenerateMips));
-            mipmapGen.generate(cbD, texD->handle);
+            pendingGenMips.append(texD->handle);
         }
     }
+    if (!pendingGenMips.isEmpty())
+        generateMipmaps(&mipmapGen, cbD, pendingGenMips.constData(), pendingGenMips.count());
 
     ud->free();
 }
 
+// Makes the readback into result, enqueued later on while recording cb, swap
+// the red and blue channels and/or premultiply the pixels while copying them
+// out of the staging area. RGBA8 and BGRA8 only. With SwapRedBlue the result
+// reports the other format.
+void qt_rhi_d3d12_set_readback_conversion(QRhiCommandBuffer *cb,
+                                          const QRhiReadbackResult *result,
+                                          QRhiD3D::PixelConversion conversion)
+{
+    QD3D12CommandBuffer *cbD = QRHI_RES(QD3D12CommandBuffer, cb);
+    if (conversion)
+        cbD->readbackConversions.insert(result, conversion);
+    else
+        cbD->readbackConversions.remove(result);
+}
+
 void QRhiD3D12::finishActiveReadbacks(bool forced)
 {
     QVarLengthArray<std::function<void()>, 4> completedCallbacks;
@@ -3646,16 +4488,16 @@ void QRhiD3D12::finishActiveReadbacks(bool forced)
     for (int i = activeReadbacks.size() - 1; i >= 0; --i) {
         QD3D12Readback &readback(activeReadbacks[i]);
         if (forced || currentFrameSlot == readback.frameSlot || readback.frameSlot < 0) {
-            readback.result->format = readback.format;
+            readback.result->format = QRhiD3D::convertedFormat(readback.format, readback.conversion);
             readback.result->pixelSize = readback.pixelSize;
             readback.result->data.resize(int(readback.byteSize));
 
             if (readback.format != QRhiTexture::UnknownFormat) {
-                quint8 *dstPtr = reinterpret_cast<quint8 *>(readback.result->data.data());
-                const quint8 *srcPtr = readback.staging.mem.p;
                 const quint32 lineSize = qMin(readback.bytesPerLine, readback.stagingRowPitch);
-                for (int y = 0, h = readback.pixelSize.height(); y < h; ++y)
-                    memcpy(dstPtr + y * readback.bytesPerLine, srcPtr + y * readback.stagingRowPitch, lineSize);
+                QRhiD3D::copyPitchedRows(readback.result->data.data(), readback.bytesPerLine,
+                                         readback.staging.mem.p, readback.stagingRowPitch,
+                                         lineSize, readback.pixelSize.height(),
+                                         readback.conversion);
             } else {
                 memcpy(readback.result->data.data(), readback.staging.mem.p, readback.byteSize);
             }
@@ -3684,9 +4526,12 @@ bool QRhiD3D12::ensureShaderVisibleDescriptorHeapCapacity(QD3D12ShaderVisibleDes
     // mean we can grow indefinitely, then again even using the same size would
     // work (because we what we are after here is a new heap for the rest of
     // the commands, not affecting what's already recorded).
+    // The new size accounts for everything the frame needed so far, so
+    // that the next frames are likely to fit in the new heap.
     if (h->perFrameHeapSlice[frameSlot].remainingCapacity() < neededDescriptorCount) {
+        const quint32 peakUsage = h->perFrameHeapSlice[frameSlot].head + neededDescriptorCount;
         const quint32 newPerFrameSize = qMax(h->perFrameHeapSlice[frameSlot].capacity * 2,
-                                             neededDescriptorCount);
+                                             peakUsage);
         QD3D12ShaderVisibleDescriptorHeap newHeap;
         if (!newHeap.create(dev, type, newPerFrameSize)) {
             qWarning("Could not create new shader-visible descriptor heap");
@@ -3892,8 +4737,9 @@ void QD3D12Buffer::executeHostWritesForFrameSlot(int frameSlot)
     QRHI_RES_RHI(QRhiD3D12);
     if (QD3D12Resource *res = rhiD->resourcePool.lookupRef(handles[frameSlot])) {
         Q_ASSERT(res->cpuMapPtr);
-        for (const QD3D12Buffer::HostWrite &u : std::as_const(pendingHostWrites[frameSlot]))
-            memcpy(static_cast<char *>(res->cpuMapPtr) + u.offset, u.data.constData(), u.data.size());
+        const HostWrites &writes(pendingHostWrites[frameSlot]);
+        for (const HostWrite &w : writes.ranges)
+            memcpy(static_cast<char *>(res->cpuMapPtr) + w.offset, writes.arena.constData() + w.arenaOffset, w.size);
     }
     pendingHostWrites[frameSlot].clear();
 }
@@ -4526,9 +5372,11 @@ QD3D12Sampler::~QD3D12Sampler()
 
 void QD3D12Sampler::destroy()
 {
+    QRHI_RES_RHI(QRhiD3D12);
+    if (rhiD && shaderVisibleDescriptor.isValid())
+        rhiD->samplerMgr.releaseShaderVisibleDescriptor(shaderVisibleDescriptor, &rhiD->releaseQueue);
     shaderVisibleDescriptor = {};
 
-    QRHI_RES_RHI(QRhiD3D12);
     if (rhiD)
         rhiD->unregisterResource(this);
 }
@@ -4601,6 +5449,13 @@ static inline D3D12_COMPARISON_FUNC toD3DTextureComparisonFunc(QRhiSampler::Comp
 
 bool QD3D12Sampler::create()
 {
+    QRHI_RES_RHI(QRhiD3D12);
+    // the parameters may have changed, the old descriptor is not valid anymore
+    if (shaderVisibleDescriptor.isValid()) {
+        rhiD->samplerMgr.releaseShaderVisibleDescriptor(shaderVisibleDescriptor, &rhiD->releaseQueue);
+        shaderVisibleDescriptor = {};
+    }
+
     desc = {};
     desc.Filter = toD3DFilter(m_minFilter, m_magFilter, m_mipmapMode);
     if (m_compareOp != Never)
@@ -4612,7 +5467,6 @@ bool QD3D12Sampler::create()
     desc.ComparisonFunc = toD3DTextureComparisonFunc(m_compareOp);
     desc.MaxLOD = m_mipmapMode == None ? 0.0f : 10000.0f;
 
-    QRHI_RES_RHI(QRhiD3D12);
     rhiD->registerResource(this, false);
     return true;
 }
@@ -5124,16 +5978,24 @@ QD3D12ObjectHandle QD3D12ShaderResourceBindings::createRootSignature(const QD3D1
         qWarning("Failed to serialize root signature: %s", qPrintable(QSystemError::windowsComString(hr)));
         return {};
     }
-    ID3D12RootSignature *rootSig = nullptr;
-    hr = rhiD->dev->CreateRootSignature(0,
-                                        signature->GetBufferPointer(),
-                                        signature->GetBufferSize(),
-                                        __uuidof(ID3D12RootSignature),
-                                        reinterpret_cast<void **>(&rootSig));
+    // The serialized blob is a canonical form of the description (no
+    // pointers), so it doubles as the cache key.
+    const QByteArray serialized(static_cast<const char *>(signature->GetBufferPointer()),
+                                qsizetype(signature->GetBufferSize()));
     signature->Release();
-    if (FAILED(hr)) {
-        qWarning("Failed to create root signature: %s", qPrintable(QSystemError::windowsComString(hr)));
-        return {};
+
+    ID3D12RootSignature *rootSig = lookupRootSignature(rhiD, serialized);
+    if (!rootSig) {
+        hr = rhiD->dev->CreateRootSignature(0,
+                                            serialized.constData(),
+                                            SIZE_T(serialized.size()),
+                                            __uuidof(ID3D12RootSignature),
+                                            reinterpret_cast<void **>(&rootSig));
+        if (FAILED(hr)) {
+            qWarning("Failed to create root signature: %s", qPrintable(QSystemError::windowsComString(hr)));
+            return {};
+        }
+        rootSig = insertRootSignature(rhiD, serialized, rootSig);
     }
 
     return QD3D12RootSignature::addToPool(&rhiD->rootSignaturePool, rootSig);
@@ -5350,17 +6212,34 @@ static QByteArray compileHlslShaderSource(const QShader &shader,
         break;
     }
 
+    // Shared with the D3D11 backend, hence the flags in D3DCompile terms.
+    QRhiD3D::BytecodeStore *store = QRhiD3D::BytecodeStore::instance();
+    QRhiD3D::BytecodeStoreKey storeKey;
+    storeKey.sourceHash = store->sourceHash(hlslSource.shader());
+    storeKey.target = target;
+    storeKey.entryPoint = hlslSource.entryPoint();
+    storeKey.compileFlags = (flags & int(HlslCompileFlag::WithDebugInfo)) ? D3DCOMPILE_DEBUG : 0;
+    QByteArray bytecode = store->lookup(storeKey);
+    if (!bytecode.isEmpty())
+        return bytecode;
+
     if (key.sourceVersion().version() >= 60) {
 #ifdef QRHI_D3D12_HAS_DXC
-        return dxcCompile(hlslSource, target, flags, error);
+        bytecode = dxcCompile(hlslSource, target, flags, error);
 #else
         qWarning("Attempted to runtime-compile HLSL source code for shader model >= 6.0 "
                  "but the Qt build has no support for DXC. "
                  "Rebuild Qt with a recent Windows SDK or switch to an MSVC build.");
+        bytecode = legacyCompile(hlslSource, target, flags, error);
 #endif
+    } else {
+        bytecode = legacyCompile(hlslSource, target, flags, error);
     }
 
-    return legacyCompile(hlslSource, target, flags, error);
+    if (!bytecode.isEmpty())
+        store->insert(storeKey, bytecode);
+
+    return bytecode;
 }
 
 static inline UINT8 toD3DColorWriteMask(QRhiGraphicsPipeline::ColorMask c)
@@ -5714,24 +6593,10 @@ bool QD3D12GraphicsPipeline::create()
     }
     const DXGI_SAMPLE_DESC sampleDesc = rhiD->effectiveSampleDesc(m_sampleCount, format);
 
-    struct {
-        QD3D12PipelineStateSubObject<ID3D12RootSignature *, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_ROOT_SIGNATURE> rootSig;
-        QD3D12PipelineStateSubObject<D3D12_INPUT_LAYOUT_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_INPUT_LAYOUT> inputLayout;
-        QD3D12PipelineStateSubObject<D3D12_PRIMITIVE_TOPOLOGY_TYPE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_PRIMITIVE_TOPOLOGY> primitiveTopology;
-        QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_VS> VS;
-        QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_HS> HS;
-        QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_DS> DS;
-        QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_GS> GS;
-        QD3D12PipelineStateSubObject<D3D12_SHADER_BYTECODE, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_PS> PS;
-        QD3D12PipelineStateSubObject<D3D12_RASTERIZER_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_RASTERIZER> rasterizerState;
-        QD3D12PipelineStateSubObject<D3D12_DEPTH_STENCIL_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_DEPTH_STENCIL> depthStencilState;
-        QD3D12PipelineStateSubObject<D3D12_BLEND_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_BLEND> blendState;
-        QD3D12PipelineStateSubObject<D3D12_RT_FORMAT_ARRAY, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_RENDER_TARGET_FORMATS> rtFormats;
-        QD3D12PipelineStateSubObject<DXGI_FORMAT, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_DEPTH_STENCIL_FORMAT> dsFormat;
-        QD3D12PipelineStateSubObject<DXGI_SAMPLE_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_SAMPLE_DESC> sampleDesc;
-        QD3D12PipelineStateSubObject<UINT, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_SAMPLE_MASK> sampleMask;
-        QD3D12PipelineStateSubObject<D3D12_VIEW_INSTANCING_DESC, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE_VIEW_INSTANCING> viewInstancingDesc;
-    } stream;
+    QD3D12GraphicsPipelineStateStream stream;
+    memset(&stream.rasterizerState.object, 0, sizeof(stream.rasterizerState.object));
+    memset(&stream.depthStencilState.object, 0, sizeof(stream.depthStencilState.object));
+    memset(&stream.blendState.object, 0, sizeof(stream.blendState.object));
 
     stream.rootSig.object = rootSig;
 
@@ -5835,7 +6700,7 @@ bool QD3D12GraphicsPipeline::create()
     stream.blendState.object.IndependentBlendEnable = m_targetBlends.count() > 1;
     for (int i = 0, ie = m_targetBlends.count(); i != ie; ++i) {
         const QRhiGraphicsPipeline::TargetBlend &b(m_targetBlends[i]);
-        D3D12_RENDER_TARGET_BLEND_DESC blend = {};
+        D3D12_RENDER_TARGET_BLEND_DESC &blend(stream.blendState.object.RenderTarget[i]);
         blend.BlendEnable = b.enable;
         blend.SrcBlend = toD3DBlendFactor(b.srcColor, true);
         blend.DestBlend = toD3DBlendFactor(b.dstColor, true);
@@ -5844,13 +6709,9 @@ bool QD3D12GraphicsPipeline::create()
         blend.DestBlendAlpha = toD3DBlendFactor(b.dstAlpha, false);
         blend.BlendOpAlpha = toD3DBlendOp(b.opAlpha);
         blend.RenderTargetWriteMask = toD3DColorWriteMask(b.colorWrite);
-        stream.blendState.object.RenderTarget[i] = blend;
-    }
-    if (m_targetBlends.isEmpty()) {
-        D3D12_RENDER_TARGET_BLEND_DESC blend = {};
-        blend.RenderTargetWriteMask = D3D12_COLOR_WRITE_ENABLE_ALL;
-        stream.blendState.object.RenderTarget[0] = blend;
     }
+    if (m_targetBlends.isEmpty())
+        stream.blendState.object.RenderTarget[0].RenderTargetWriteMask = D3D12_COLOR_WRITE_ENABLE_ALL;
 
     stream.rtFormats.object.NumRenderTargets = rpD->colorAttachmentCount;
     for (int i = 0; i < rpD->colorAttachmentCount; ++i)
@@ -5876,14 +6737,30 @@ bool QD3D12GraphicsPipeline::create()
 
     const D3D12_PIPELINE_STATE_STREAM_DESC streamDesc = { sizeof(stream), &stream };
 
-    ID3D12PipelineState *pso = nullptr;
-    HRESULT hr = rhiD->dev->CreatePipelineState(&streamDesc, __uuidof(ID3D12PipelineState), reinterpret_cast<void **>(&pso));
-    if (FAILED(hr)) {
-        qWarning("Failed to create graphics pipeline state: %s",
-                 qPrintable(QSystemError::windowsComString(hr)));
-        rhiD->rootSignaturePool.remove(rootSigHandle);
-        rootSigHandle = {};
-        return false;
+    // Recorded for pipelineCacheData(), unless the root signature somehow
+    // did not come from the cache. Serializing is not free, so only done
+    // when saving, or when the record may match a warmed-up pipeline.
+    QByteArray record;
+    const bool saveRecord = rhiD->rhiFlags.testFlag(QRhi::EnablePipelineCacheDataSave);
+    if (saveRecord || hasWarmedGraphicsPipelines(rhiD)) {
+        const QByteArray serializedRootSig = serializedRootSignature(rhiD, rootSig);
+        if (!serializedRootSig.isEmpty()) {
+            record = graphicsPipelineRecord(serializedRootSig, shaderBytecode, stream);
+            if (saveRecord)
+                recordGraphicsPipeline(rhiD, record);
+        }
+    }
+
+    ID3D12PipelineState *pso = record.isEmpty() ? nullptr : takeWarmedGraphicsPipeline(rhiD, record, rootSig);
+    if (!pso) {
+        HRESULT hr = rhiD->dev->CreatePipelineState(&streamDesc, __uuidof(ID3D12PipelineState), reinterpret_cast<void **>(&pso));
+        if (FAILED(hr)) {
+            qWarning("Failed to create graphics pipeline state: %s",
+                     qPrintable(QSystemError::windowsComString(hr)));
+            rhiD->rootSignaturePool.remove(rootSigHandle);
+            rootSigHandle = {};
+            return false;
+        }
     }
 
     handle = QD3D12Pipeline::addToPool(&rhiD->pipelinePool, QD3D12Pipeline::Graphics, pso);
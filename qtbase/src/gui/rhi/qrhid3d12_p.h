@@ -0,0 +1,1400 @@
+// Copyright (C) 2023 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QRHID3D12_P_H
+#define QRHID3D12_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qrhi_p.h"
+#include "qrhid3dalgorithms_p.h"
+#include "qrhid3dpitchedcopy_p.h"
+#include <rhi/qshaderdescription.h>
+#include <QWindow>
+#include <QBitArray>
+#include <QtCore/qmutex.h>
+#include <QtCore/qwaitcondition.h>
+
+#include <optional>
+#include <array>
+
+#include <d3d12.h>
+#include <d3d12sdklayers.h>
+#include <dxgi1_6.h>
+#include <dcomp.h>
+
+#include "D3D12MemAlloc.h"
+
+// ID3D12Device2 and ID3D12GraphicsCommandList1 and types and enums introduced
+// with those are hard requirements now. These should be declared in any
+// moderately recent d3d12.h, but if it is an SDK from before Windows 10
+// version 1703 then these types could be missing. In the absence of other
+// options, handle this by skipping all the code and making QRhi::create()
+// fail in such builds.
+#ifdef __ID3D12Device2_INTERFACE_DEFINED__
+
+QT_BEGIN_NAMESPACE
+
+class QThreadPool;
+
+// See qt_rhi_d3d12_set_memory_budget_callback().
+typedef void (*QRhiD3D12MemoryBudgetCallback)(QRhi *rhi, int pressureLevel,
+                                              quint64 usageBytes, quint64 budgetBytes,
+                                              void *userData);
+
+static const int QD3D12_FRAMES_IN_FLIGHT = 2;
+
+class QRhiD3D12;
+
+struct QD3D12Descriptor
+{
+    D3D12_CPU_DESCRIPTOR_HANDLE cpuHandle = {};
+    D3D12_GPU_DESCRIPTOR_HANDLE gpuHandle = {};
+
+    bool isValid() const { return cpuHandle.ptr != 0; }
+};
+
+struct QD3D12ReleaseQueue;
+
+struct QD3D12DescriptorHeap
+{
+    bool create(ID3D12Device *device,
+                quint32 descriptorCount,
+                D3D12_DESCRIPTOR_HEAP_TYPE heapType,
+                D3D12_DESCRIPTOR_HEAP_FLAGS heapFlags);
+    void createWithExisting(const QD3D12DescriptorHeap &other,
+                            quint32 offsetInDescriptors,
+                            quint32 descriptorCount);
+    void destroy();
+    void destroyWithDeferredRelease(QD3D12ReleaseQueue *releaseQueue);
+
+    QD3D12Descriptor get(quint32 count);
+    QD3D12Descriptor at(quint32 index) const;
+    quint32 remainingCapacity() const { return capacity - head; }
+
+    QD3D12Descriptor incremented(const QD3D12Descriptor &descriptor, quint32 offsetInDescriptors) const
+    {
+        D3D12_CPU_DESCRIPTOR_HANDLE cpuHandle = descriptor.cpuHandle;
+        cpuHandle.ptr += offsetInDescriptors * descriptorByteSize;
+        D3D12_GPU_DESCRIPTOR_HANDLE gpuHandle = descriptor.gpuHandle;
+        if (gpuHandle.ptr)
+            gpuHandle.ptr += offsetInDescriptors * descriptorByteSize;
+        return { cpuHandle, gpuHandle };
+    }
+
+    ID3D12DescriptorHeap *heap = nullptr;
+    quint32 head = 0;
+    quint32 capacity = 0;
+    QD3D12Descriptor heapStart;
+    D3D12_DESCRIPTOR_HEAP_TYPE heapType;
+    D3D12_DESCRIPTOR_HEAP_FLAGS heapFlags;
+    quint32 descriptorByteSize;
+};
+
+struct QD3D12CpuDescriptorPool
+{
+    bool create(ID3D12Device *device, D3D12_DESCRIPTOR_HEAP_TYPE heapType, const char *debugName = "");
+    void destroy();
+
+    QD3D12Descriptor allocate(quint32 count);
+    void release(const QD3D12Descriptor &descriptor, quint32 count);
+
+    static const int DESCRIPTORS_PER_HEAP = 256;
+
+    struct HeapWithMap {
+        QD3D12DescriptorHeap heap;
+        QBitArray map;
+        static HeapWithMap init(const QD3D12DescriptorHeap &heap, quint32 descriptorCount) {
+            HeapWithMap result;
+            result.heap = heap;
+            result.map.resize(descriptorCount);
+            return result;
+        }
+    };
+
+    ID3D12Device *device;
+    quint32 descriptorByteSize;
+    QVector<HeapWithMap> heaps;
+    const char *debugName;
+};
+
+struct QD3D12QueryHeap
+{
+    bool isValid() const { return heap && capacity; }
+    bool create(ID3D12Device *device,
+                quint32 queryCount,
+                D3D12_QUERY_HEAP_TYPE heapType);
+    void destroy();
+
+    ID3D12QueryHeap *heap = nullptr;
+    quint32 capacity = 0;
+};
+
+struct QD3D12StagingArea
+{
+    static const quint32 ALIGNMENT = D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT; // 256 so good enough both for cbuffers and vbuffers
+
+    struct Allocation
+    {
+        quint8 *p = nullptr;
+        D3D12_GPU_VIRTUAL_ADDRESS gpuAddr = 0;
+        ID3D12Resource *buffer;
+        quint32 bufferOffset;
+        bool isValid() const { return p != nullptr; }
+    };
+
+    bool create(QRhiD3D12 *rhi, quint32 capacity, D3D12_HEAP_TYPE heapType);
+    void destroy();
+    void destroyWithDeferredRelease(QD3D12ReleaseQueue *releaseQueue);
+
+    QD3D12StagingArea::Allocation get(quint32 byteSize);
+
+    quint32 remainingCapacity() const
+    {
+        return capacity - head;
+    }
+
+    static quint32 allocSizeForArray(quint32 size, int count = 1)
+    {
+        return count * ((size + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+    }
+
+    ID3D12Resource *resource = nullptr;
+    D3D12MA::Allocation *allocation = nullptr;
+    quint32 head;
+    quint32 capacity;
+    Allocation mem;
+};
+
+struct QD3D12ObjectHandle
+{
+    quint32 index = 0;
+    quint32 generation = 0;
+
+    // the default, null handle is guaranteed to give ObjectPool::isValid() == false
+    bool isNull() const { return index == 0 && generation == 0; }
+};
+
+inline bool operator==(const QD3D12ObjectHandle &a, const QD3D12ObjectHandle &b) noexcept
+{
+    return a.index == b.index && a.generation == b.generation;
+}
+
+inline bool operator!=(const QD3D12ObjectHandle &a, const QD3D12ObjectHandle &b) noexcept
+{
+    return !(a == b);
+}
+
+inline size_t qHash(const QD3D12ObjectHandle &h, size_t seed = 0) noexcept
+{
+    return qHashMulti(seed, h.index, h.generation);
+}
+
+template<typename T>
+struct QD3D12ObjectPool
+{
+    void create(const char *debugName = "")
+    {
+        this->debugName = debugName;
+        Q_ASSERT(data.isEmpty());
+        data.append(Data()); // index 0 is always invalid
+    }
+
+    void destroy() {
+        int leakCount = 0; // will nicely destroy everything here, but warn about it if enabled
+        for (Data &d : data) {
+            if (d.object.has_value()) {
+                ++leakCount;
+                d.object->releaseResources();
+            }
+        }
+        data.clear();
+#ifndef QT_NO_DEBUG
+        // debug builds: just do it always
+        static bool leakCheck = true;
+#else
+        // release builds: opt-in
+        static bool leakCheck = qEnvironmentVariableIntValue("QT_RHI_LEAK_CHECK");
+#endif
+        if (leakCheck) {
+            if (leakCount > 0) {
+                qWarning("QD3D12ObjectPool::destroy(): Pool %p '%s' had %d unreleased objects",
+                         this, debugName, leakCount);
+            }
+        }
+    }
+
+    bool isValid(const QD3D12ObjectHandle &handle) const
+    {
+        return handle.index > 0
+                && handle.index < quint32(data.count())
+                && handle.generation > 0
+                && handle.generation == data[handle.index].generation
+                && data[handle.index].object.has_value();
+    }
+
+    T lookup(const QD3D12ObjectHandle &handle) const
+    {
+        return isValid(handle) ? *data[handle.index].object : T();
+    }
+
+    const T *lookupRef(const QD3D12ObjectHandle &handle) const
+    {
+        return isValid(handle) ? &*data[handle.index].object : nullptr;
+    }
+
+    T *lookupRef(const QD3D12ObjectHandle &handle)
+    {
+        return isValid(handle) ? &*data[handle.index].object : nullptr;
+    }
+
+    QD3D12ObjectHandle add(const T &object)
+    {
+        Q_ASSERT(!data.isEmpty());
+        const quint32 count = quint32(data.count());
+        quint32 index = 1;
+        for (; index < count; ++index) {
+            if (!data[index].object.has_value())
+                break;
+        }
+        if (index < count) {
+            data[index].object = object;
+            quint32 &generation(data[index].generation);
+            ++generation;
+            return { index, generation };
+        } else {
+            data.append({ 1, object });
+            return { count, 1 };
+        }
+    }
+
+    void remove(const QD3D12ObjectHandle &handle)
+    {
+        if (T *object = lookupRef(handle)) {
+            object->releaseResources();
+            data[handle.index].object.reset();
+        }
+    }
+
+    const char *debugName;
+
+    struct Data {
+        quint32 generation = 0;
+        std::optional<T> object;
+    };
+    QVarLengthArray<Data, 256> data;
+};
+
+struct QD3D12Resource
+{
+    ID3D12Resource *resource;
+    D3D12_RESOURCE_STATES state;
+    D3D12_RESOURCE_DESC desc;
+    D3D12MA::Allocation *allocation;
+    void *cpuMapPtr;
+    enum { UavUsageRead = 0x01, UavUsageWrite = 0x02 };
+    int uavUsage;
+    bool owns;
+
+    // note that this assumes the ownership of res and allocation
+    static QD3D12ObjectHandle addToPool(QD3D12ObjectPool<QD3D12Resource> *pool,
+                                        ID3D12Resource *resource,
+                                        D3D12_RESOURCE_STATES state,
+                                        D3D12MA::Allocation *allocation = nullptr,
+                                        void *cpuMapPtr = nullptr)
+    {
+        Q_ASSERT(resource);
+        return pool->add({ resource, state, resource->GetDesc(), allocation, cpuMapPtr, 0, true });
+    }
+
+    // for wrapping textures coming from the outside
+    static QD3D12ObjectHandle addNonOwningToPool(QD3D12ObjectPool<QD3D12Resource> *pool,
+                                                 ID3D12Resource *resource,
+                                                 D3D12_RESOURCE_STATES state)
+    {
+        Q_ASSERT(resource);
+        return pool->add({ resource, state, resource->GetDesc(), nullptr, nullptr, 0, false });
+    }
+
+    void releaseResources()
+    {
+        if (owns) {
+            // order matters: resource first, then the allocation
+            resource->Release();
+            if (allocation)
+                allocation->Release();
+        }
+    }
+};
+
+struct QD3D12Pipeline
+{
+    enum Type {
+        Graphics,
+        Compute
+    };
+    Type type;
+    ID3D12PipelineState *pso;
+
+    static QD3D12ObjectHandle addToPool(QD3D12ObjectPool<QD3D12Pipeline> *pool,
+                                        Type type,
+                                        ID3D12PipelineState *pso)
+    {
+        return pool->add({ type, pso });
+    }
+
+    void releaseResources()
+    {
+        pso->Release();
+    }
+};
+
+struct QD3D12RootSignature
+{
+    ID3D12RootSignature *rootSig;
+
+    static QD3D12ObjectHandle addToPool(QD3D12ObjectPool<QD3D12RootSignature> *pool,
+                                        ID3D12RootSignature *rootSig)
+    {
+        return pool->add({ rootSig });
+    }
+
+    void releaseResources()
+    {
+        rootSig->Release();
+    }
+};
+
+struct QD3D12ReleaseQueue
+{
+    void create(QD3D12ObjectPool<QD3D12Resource> *resourcePool,
+                QD3D12ObjectPool<QD3D12Pipeline> *pipelinePool,
+                QD3D12ObjectPool<QD3D12RootSignature> *rootSignaturePool)
+    {
+        this->resourcePool = resourcePool;
+        this->pipelinePool = pipelinePool;
+        this->rootSignaturePool = rootSignaturePool;
+    }
+
+    void deferredReleaseResource(const QD3D12ObjectHandle &handle);
+    void deferredReleaseResourceWithViews(const QD3D12ObjectHandle &handle,
+                                          QD3D12CpuDescriptorPool *pool,
+                                          const QD3D12Descriptor &viewsStart,
+                                          int viewCount);
+    void deferredReleasePipeline(const QD3D12ObjectHandle &handle);
+    void deferredReleaseRootSignature(const QD3D12ObjectHandle &handle);
+    void deferredReleaseCallback(std::function<void(void*)> callback, void *userData);
+    void deferredReleaseResourceAndAllocation(ID3D12Resource *resource,
+                                              D3D12MA::Allocation *allocation);
+    void deferredReleaseDescriptorHeap(ID3D12DescriptorHeap *heap);
+    void deferredReleaseViews(QD3D12CpuDescriptorPool *pool,
+                              const QD3D12Descriptor &viewsStart,
+                              int viewCount);
+
+    void activatePendingDeferredReleaseRequests(int frameSlot);
+    void executeDeferredReleases(int frameSlot, bool forced = false);
+    void releaseAll();
+
+    struct DeferredReleaseEntry {
+        enum Type {
+            Resource,
+            Pipeline,
+            RootSignature,
+            Callback,
+            ResourceAndAllocation,
+            DescriptorHeap,
+            Views
+        };
+        Type type = Resource;
+        QD3D12ObjectHandle handle;
+        QD3D12CpuDescriptorPool *poolForViews = nullptr;
+        QD3D12Descriptor viewsStart;
+        int viewCount = 0;
+        std::function<void(void*)> callback = nullptr;
+        void *callbackUserData = nullptr;
+        QPair<ID3D12Resource *, D3D12MA::Allocation *> resourceAndAllocation = {};
+        ID3D12DescriptorHeap *descriptorHeap = nullptr;
+    };
+    // Requests made since the last activation, and the ones to be released
+    // once the given frame slot comes around again.
+    QVector<DeferredReleaseEntry> pending;
+    QVector<DeferredReleaseEntry> slotQueues[QD3D12_FRAMES_IN_FLIGHT];
+    void releaseEntries(QVector<DeferredReleaseEntry> *entries);
+    QD3D12ObjectPool<QD3D12Resource> *resourcePool = nullptr;
+    QD3D12ObjectPool<QD3D12Pipeline> *pipelinePool = nullptr;
+    QD3D12ObjectPool<QD3D12RootSignature> *rootSignaturePool = nullptr;
+};
+
+struct QD3D12CommandBuffer;
+
+struct QD3D12ResourceBarrierGenerator
+{
+    static const int PREALLOC = 16;
+
+    void create(QD3D12ObjectPool<QD3D12Resource> *resourcePool)
+    {
+        this->resourcePool = resourcePool;
+    }
+
+    void addTransitionBarrier(const QD3D12ObjectHandle &resourceHandle, D3D12_RESOURCE_STATES stateAfter);
+    void enqueueBufferedTransitionBarriers(QD3D12CommandBuffer *cbD);
+    void enqueueSubresourceTransitionBarrier(QD3D12CommandBuffer *cbD,
+                                             const QD3D12ObjectHandle &resourceHandle,
+                                             UINT subresource,
+                                             D3D12_RESOURCE_STATES stateBefore,
+                                             D3D12_RESOURCE_STATES stateAfter);
+    void enqueueUavBarrier(QD3D12CommandBuffer *cbD, const QD3D12ObjectHandle &resourceHandle);
+
+    struct TransitionResourceBarrier {
+        QD3D12ObjectHandle resourceHandle;
+        D3D12_RESOURCE_STATES stateBefore;
+        D3D12_RESOURCE_STATES stateAfter;
+    };
+    QVarLengthArray<TransitionResourceBarrier, PREALLOC> transitionResourceBarriers;
+    QD3D12ObjectPool<QD3D12Resource> *resourcePool = nullptr;
+};
+
+struct QD3D12ShaderBytecodeCache
+{
+    struct Shader {
+        Shader() = default;
+        Shader(const QByteArray &bytecode, const QShader::NativeResourceBindingMap &rbm)
+            : bytecode(bytecode), nativeResourceBindingMap(rbm)
+        { }
+        QByteArray bytecode;
+        QShader::NativeResourceBindingMap nativeResourceBindingMap;
+    };
+
+    QHash<QRhiShaderStage, Shader> data;
+
+    void insertWithCapacityLimit(const QRhiShaderStage &key, const Shader &s);
+};
+
+struct QD3D12ShaderVisibleDescriptorHeap
+{
+    bool create(ID3D12Device *device, D3D12_DESCRIPTOR_HEAP_TYPE type, quint32 perFrameDescriptorCount);
+    void destroy();
+    void destroyWithDeferredRelease(QD3D12ReleaseQueue *releaseQueue);
+
+    QD3D12DescriptorHeap heap;
+    QD3D12DescriptorHeap perFrameHeapSlice[QD3D12_FRAMES_IN_FLIGHT];
+};
+
+// wrap foreach_shader_stage_type
+enum QD3D12Stage { VS = 0, HS, DS, GS, PS, CS };
+
+static inline QD3D12Stage qd3d12_stage(QRhiShaderStage::Type type)
+{
+    switch (type) {
+    case QRhiShaderStage::Vertex:
+        return VS;
+    case QRhiShaderStage::TessellationControl:
+        return HS;
+    case QRhiShaderStage::TessellationEvaluation:
+        return DS;
+    case QRhiShaderStage::Geometry:
+        return GS;
+    case QRhiShaderStage::Fragment:
+        return PS;
+    case QRhiShaderStage::Compute:
+        return CS;
+    }
+    Q_UNREACHABLE_RETURN(VS);
+}
+
+static inline D3D12_SHADER_VISIBILITY qd3d12_stageToVisibility(QD3D12Stage s)
+{
+    switch (s) {
+    case VS:
+        return D3D12_SHADER_VISIBILITY_VERTEX;
+    case HS:
+        return D3D12_SHADER_VISIBILITY_HULL;
+    case DS:
+        return D3D12_SHADER_VISIBILITY_DOMAIN;
+    case GS:
+        return D3D12_SHADER_VISIBILITY_GEOMETRY;
+    case PS:
+        return D3D12_SHADER_VISIBILITY_PIXEL;
+    case CS:
+        return D3D12_SHADER_VISIBILITY_ALL;
+    }
+    Q_UNREACHABLE_RETURN(D3D12_SHADER_VISIBILITY_ALL);
+}
+
+static inline QRhiShaderResourceBinding::StageFlag qd3d12_stageToSrb(QD3D12Stage s)
+{
+    switch (s) {
+    case VS:
+        return QRhiShaderResourceBinding::VertexStage;
+    case HS:
+        return QRhiShaderResourceBinding::TessellationControlStage;
+    case DS:
+        return QRhiShaderResourceBinding::TessellationEvaluationStage;
+    case GS:
+        return QRhiShaderResourceBinding::GeometryStage;
+    case PS:
+        return QRhiShaderResourceBinding::FragmentStage;
+    case CS:
+        return QRhiShaderResourceBinding::ComputeStage;
+    }
+    Q_UNREACHABLE_RETURN(QRhiShaderResourceBinding::VertexStage);
+}
+
+struct QD3D12ShaderStageData
+{
+    bool valid = false; // to allow simple arrays where unused stages are indicated by !valid
+    QD3D12Stage stage = VS;
+    QShader::NativeResourceBindingMap nativeResourceBindingMap;
+};
+
+struct QD3D12ShaderResourceBindings;
+
+struct QD3D12ShaderResourceVisitor
+{
+    enum StorageOp { Load = 0, Store, LoadStore };
+
+    QD3D12ShaderResourceVisitor(const QD3D12ShaderResourceBindings *srb,
+                                const QD3D12ShaderStageData *stageData,
+                                int stageCount)
+        : srb(srb),
+          stageData(stageData),
+          stageCount(stageCount)
+    {
+    }
+
+    std::function<void(QD3D12Stage, const QRhiShaderResourceBinding::Data::UniformBufferData &, int, int)> uniformBuffer = nullptr;
+    std::function<void(QD3D12Stage, const QRhiShaderResourceBinding::TextureAndSampler &, int)> texture = nullptr;
+    std::function<void(QD3D12Stage, const QRhiShaderResourceBinding::TextureAndSampler &, int)> sampler = nullptr;
+    std::function<void(QD3D12Stage, const QRhiShaderResourceBinding::Data::StorageImageData &, StorageOp, int)> storageImage = nullptr;
+    std::function<void(QD3D12Stage, const QRhiShaderResourceBinding::Data::StorageBufferData &, StorageOp, int)> storageBuffer = nullptr;
+
+    void visit();
+
+    const QD3D12ShaderResourceBindings *srb;
+    const QD3D12ShaderStageData *stageData;
+    int stageCount;
+};
+
+struct QD3D12SamplerDescriptor
+{
+    D3D12_SAMPLER_DESC desc;
+};
+
+inline bool operator==(const QD3D12SamplerDescriptor &a, const QD3D12SamplerDescriptor &b) noexcept
+{
+    return !memcmp(&a.desc, &b.desc, sizeof(D3D12_SAMPLER_DESC));
+}
+
+inline bool operator!=(const QD3D12SamplerDescriptor &a, const QD3D12SamplerDescriptor &b) noexcept
+{
+    return !(a == b);
+}
+
+inline size_t qHash(const QD3D12SamplerDescriptor &key, size_t seed = 0) noexcept
+{
+    return qHashBits(&key.desc, sizeof(key.desc), seed);
+}
+
+struct QD3D12SamplerManager
+{
+    const quint32 MAX_SAMPLERS = 512;
+
+    bool create(ID3D12Device *device);
+    void destroy();
+
+    QD3D12Descriptor getShaderVisibleDescriptor(const D3D12_SAMPLER_DESC &desc);
+    void releaseShaderVisibleDescriptor(const QD3D12Descriptor &descriptor, QD3D12ReleaseQueue *releaseQueue);
+
+    ID3D12Device *device = nullptr;
+    QD3D12ShaderVisibleDescriptorHeap shaderVisibleSamplerHeap;
+    QHash<QD3D12SamplerDescriptor, QD3D12Descriptor> gpuMap;
+
+    // Reference counts for the descriptors in gpuMap, keyed by the CPU
+    // handle, and the slots that are no longer used by any frame in flight.
+    struct Slot {
+        QD3D12SamplerDescriptor key;
+        int refCount = 0;
+        quint32 releaseSerial = 0;
+    };
+    QHash<SIZE_T, Slot> slots;
+    QVarLengthArray<QD3D12Descriptor, 16> freeList;
+    quint32 releaseSerial = 0;
+    quint32 recycledCount = 0;
+
+private:
+    void recycleShaderVisibleDescriptor(const QD3D12Descriptor &descriptor, quint32 serial);
+};
+
+struct QD3D12MipmapGenerator
+{
+    bool create(QRhiD3D12 *rhiD);
+    void destroy();
+    void generate(QD3D12CommandBuffer *cbD, const QD3D12ObjectHandle &textureHandle);
+
+    QRhiD3D12 *rhiD;
+    QD3D12ObjectHandle rootSigHandle;
+    QD3D12ObjectHandle pipelineHandle;
+};
+
+struct QD3D12MemoryAllocator
+{
+    bool create(ID3D12Device *device, IDXGIAdapter1 *adapter);
+    void destroy();
+
+    HRESULT createResource(D3D12_HEAP_TYPE heapType,
+                           const D3D12_RESOURCE_DESC *resourceDesc,
+                           D3D12_RESOURCE_STATES initialState,
+                           const D3D12_CLEAR_VALUE *optimizedClearValue,
+                           D3D12MA::Allocation **maybeAllocation,
+                           REFIID riidResource,
+                           void **ppvResource);
+
+    void getBudget(D3D12MA::Budget *localBudget, D3D12MA::Budget *nonLocalBudget);
+
+    bool isUsingD3D12MA() const { return allocator != nullptr; }
+
+    ID3D12Device *device = nullptr;
+    D3D12MA::Allocator *allocator = nullptr;
+};
+
+struct QD3D12Buffer : public QRhiBuffer
+{
+    QD3D12Buffer(QRhiImplementation *rhi, Type type, UsageFlags usage, quint32 size);
+    ~QD3D12Buffer();
+    void destroy() override;
+    bool create() override;
+    QRhiBuffer::NativeBuffer nativeBuffer() override;
+    char *beginFullDynamicBufferUpdateForCurrentFrame() override;
+    void endFullDynamicBufferUpdateForCurrentFrame() override;
+
+    void executeHostWritesForFrameSlot(int frameSlot);
+
+    QD3D12ObjectHandle handles[QD3D12_FRAMES_IN_FLIGHT] = {};
+    // The writes not yet applied to a frame slot's buffer, cleared whenever
+    // the slot is flushed.
+    using HostWrite = QRhiD3D::HostWrite;
+    using HostWrites = QRhiD3D::HostWrites;
+    HostWrites pendingHostWrites[QD3D12_FRAMES_IN_FLIGHT];
+    friend class QRhiD3D12;
+    friend struct QD3D12CommandBuffer;
+};
+
+struct QD3D12RenderBuffer : public QRhiRenderBuffer
+{
+    QD3D12RenderBuffer(QRhiImplementation *rhi,
+                       Type type,
+                       const QSize &pixelSize,
+                       int sampleCount,
+                       Flags flags,
+                       QRhiTexture::Format backingFormatHint);
+    ~QD3D12RenderBuffer();
+    void destroy() override;
+    bool create() override;
+    QRhiTexture::Format backingFormat() const override;
+
+    static const DXGI_FORMAT DS_FORMAT = DXGI_FORMAT_D24_UNORM_S8_UINT;
+
+    QD3D12ObjectHandle handle;
+    QD3D12Descriptor rtv;
+    QD3D12Descriptor dsv;
+    DXGI_FORMAT dxgiFormat;
+    DXGI_SAMPLE_DESC sampleDesc;
+    uint generation = 0;
+    friend class QRhiD3D12;
+};
+
+struct QD3D12Texture : public QRhiTexture
+{
+    QD3D12Texture(QRhiImplementation *rhi, Format format, const QSize &pixelSize, int depth,
+                  int arraySize, int sampleCount, Flags flags);
+    ~QD3D12Texture();
+    void destroy() override;
+    bool create() override;
+    bool createFrom(NativeTexture src) override;
+    NativeTexture nativeTexture() override;
+    void setNativeLayout(int layout) override;
+
+    bool prepareCreate(QSize *adjustedSize = nullptr);
+    bool finishCreate();
+
+    QD3D12ObjectHandle handle;
+    QD3D12Descriptor srv;
+    DXGI_FORMAT dxgiFormat;
+    DXGI_FORMAT srvFormat;
+    DXGI_FORMAT rtFormat;
+    uint mipLevelCount;
+    DXGI_SAMPLE_DESC sampleDesc;
+    uint generation = 0;
+    friend class QRhiD3D12;
+    friend struct QD3D12CommandBuffer;
+};
+
+struct QD3D12Sampler : public QRhiSampler
+{
+    QD3D12Sampler(QRhiImplementation *rhi, Filter magFilter, Filter minFilter, Filter mipmapMode,
+                  AddressMode u, AddressMode v, AddressMode w);
+    ~QD3D12Sampler();
+    void destroy() override;
+    bool create() override;
+
+    QD3D12Descriptor lookupOrCreateShaderVisibleDescriptor();
+
+    D3D12_SAMPLER_DESC desc = {};
+    QD3D12Descriptor shaderVisibleDescriptor;
+};
+
+struct QD3D12RenderPassDescriptor : public QRhiRenderPassDescriptor
+{
+    QD3D12RenderPassDescriptor(QRhiImplementation *rhi);
+    ~QD3D12RenderPassDescriptor();
+    void destroy() override;
+    bool isCompatible(const QRhiRenderPassDescriptor *other) const override;
+    QRhiRenderPassDescriptor *newCompatibleRenderPassDescriptor() const override;
+    QVector<quint32> serializedFormat() const override;
+
+    void updateSerializedFormat();
+
+    static const int MAX_COLOR_ATTACHMENTS = 8;
+    int colorAttachmentCount = 0;
+    bool hasDepthStencil = false;
+    int colorFormat[MAX_COLOR_ATTACHMENTS];
+    int dsFormat;
+    QVector<quint32> serializedFormatData;
+};
+
+struct QD3D12RenderTargetData
+{
+    QD3D12RenderTargetData(QRhiImplementation *) { }
+
+    QD3D12RenderPassDescriptor *rp = nullptr;
+    QSize pixelSize;
+    float dpr = 1;
+    int sampleCount = 1;
+    int colorAttCount = 0;
+    int dsAttCount = 0;
+    QRhiRenderTargetAttachmentTracker::ResIdList currentResIdList;
+    static const int MAX_COLOR_ATTACHMENTS = QD3D12RenderPassDescriptor::MAX_COLOR_ATTACHMENTS;
+    D3D12_CPU_DESCRIPTOR_HANDLE rtv[MAX_COLOR_ATTACHMENTS];
+    D3D12_CPU_DESCRIPTOR_HANDLE dsv;
+};
+
+struct QD3D12SwapChainRenderTarget : public QRhiSwapChainRenderTarget
+{
+    QD3D12SwapChainRenderTarget(QRhiImplementation *rhi, QRhiSwapChain *swapchain);
+    ~QD3D12SwapChainRenderTarget();
+    void destroy() override;
+
+    QSize pixelSize() const override;
+    float devicePixelRatio() const override;
+    int sampleCount() const override;
+
+    QD3D12RenderTargetData d;
+};
+
+struct QD3D12TextureRenderTarget : public QRhiTextureRenderTarget
+{
+    QD3D12TextureRenderTarget(QRhiImplementation *rhi,
+                              const QRhiTextureRenderTargetDescription &desc,
+                              Flags flags);
+    ~QD3D12TextureRenderTarget();
+    void destroy() override;
+
+    QSize pixelSize() const override;
+    float devicePixelRatio() const override;
+    int sampleCount() const override;
+
+    QRhiRenderPassDescriptor *newCompatibleRenderPassDescriptor() override;
+    bool create() override;
+
+    QD3D12RenderTargetData d;
+    bool ownsRtv[QD3D12RenderTargetData::MAX_COLOR_ATTACHMENTS];
+    QD3D12Descriptor rtv[QD3D12RenderTargetData::MAX_COLOR_ATTACHMENTS];
+    bool ownsDsv = false;
+    QD3D12Descriptor dsv;
+    friend class QRhiD3D12;
+};
+
+struct QD3D12ShaderResourceBindings : public QRhiShaderResourceBindings
+{
+    QD3D12ShaderResourceBindings(QRhiImplementation *rhi);
+    ~QD3D12ShaderResourceBindings();
+    void destroy() override;
+    bool create() override;
+    void updateResources(UpdateFlags flags) override;
+
+    QD3D12ObjectHandle createRootSignature(const QD3D12ShaderStageData *stageData, int stageCount);
+
+    struct VisitorData {
+        QVarLengthArray<D3D12_ROOT_PARAMETER1, 2> cbParams[6];
+
+        D3D12_ROOT_PARAMETER1 srvTables[6] = {};
+        QVarLengthArray<D3D12_DESCRIPTOR_RANGE1, 4> srvRanges[6];
+        quint32 currentSrvRangeOffset[6] = {};
+
+        QVarLengthArray<D3D12_ROOT_PARAMETER1, 4> samplerTables[6];
+        std::array<D3D12_DESCRIPTOR_RANGE1, 16> samplerRanges[6] = {};
+        int samplerRangeHeads[6] = {};
+
+        D3D12_ROOT_PARAMETER1 uavTables[6] = {};
+        QVarLengthArray<D3D12_DESCRIPTOR_RANGE1, 4> uavRanges[6];
+        quint32 currentUavRangeOffset[6] = {};
+    } visitorData;
+
+    void visitUniformBuffer(QD3D12Stage s,
+                            const QRhiShaderResourceBinding::Data::UniformBufferData &d,
+                            int shaderRegister,
+                            int binding);
+    void visitTexture(QD3D12Stage s,
+                      const QRhiShaderResourceBinding::TextureAndSampler &d,
+                      int shaderRegister);
+    void visitSampler(QD3D12Stage s,
+                      const QRhiShaderResourceBinding::TextureAndSampler &d,
+                      int shaderRegister);
+    void visitStorageBuffer(QD3D12Stage s,
+                            const QRhiShaderResourceBinding::Data::StorageBufferData &d,
+                            QD3D12ShaderResourceVisitor::StorageOp op,
+                            int shaderRegister);
+    void visitStorageImage(QD3D12Stage s,
+                           const QRhiShaderResourceBinding::Data::StorageImageData &d,
+                           QD3D12ShaderResourceVisitor::StorageOp op,
+                           int shaderRegister);
+
+    bool hasDynamicOffset = false;
+    uint generation = 0;
+
+    friend class QRhiD3D12;
+    friend struct QD3D12ShaderResourceVisitor;
+};
+
+template<typename T, D3D12_PIPELINE_STATE_SUBOBJECT_TYPE Type>
+struct alignas(void*) QD3D12PipelineStateSubObject
+{
+    D3D12_PIPELINE_STATE_SUBOBJECT_TYPE type = Type;
+    T object = {};
+};
+
+struct QD3D12GraphicsPipeline : public QRhiGraphicsPipeline
+{
+    QD3D12GraphicsPipeline(QRhiImplementation *rhi);
+    ~QD3D12GraphicsPipeline();
+    void destroy() override;
+    bool create() override;
+
+    QD3D12ObjectHandle handle;
+    QD3D12ObjectHandle rootSigHandle;
+    std::array<QD3D12ShaderStageData, 5> stageData;
+    D3D12_PRIMITIVE_TOPOLOGY topology;
+    UINT viewInstanceMask = 0;
+    uint generation = 0;
+    friend class QRhiD3D12;
+};
+
+struct QD3D12ComputePipeline : public QRhiComputePipeline
+{
+    QD3D12ComputePipeline(QRhiImplementation *rhi);
+    ~QD3D12ComputePipeline();
+    void destroy() override;
+    bool create() override;
+
+    QD3D12ObjectHandle handle;
+    QD3D12ObjectHandle rootSigHandle;
+    QD3D12ShaderStageData stageData;
+    uint generation = 0;
+    friend class QRhiD3D12;
+};
+
+struct QD3D12CommandBuffer : public QRhiCommandBuffer
+{
+    QD3D12CommandBuffer(QRhiImplementation *rhi);
+    ~QD3D12CommandBuffer();
+    void destroy() override;
+
+    const QRhiNativeHandles *nativeHandles();
+
+    ID3D12GraphicsCommandList1 *cmdList = nullptr; // not owned
+    QRhiD3D12CommandBufferNativeHandles nativeHandlesStruct;
+
+    enum PassType {
+        NoPass,
+        RenderPass,
+        ComputePass
+    };
+
+    void resetState()
+    {
+        recordingPass = NoPass;
+        readbackConversions.clear();
+        // do not zero lastGpuTime
+        currentTarget = nullptr;
+
+        resetPerPassState();
+    }
+
+    void resetPerPassState()
+    {
+        currentGraphicsPipeline = nullptr;
+        currentComputePipeline = nullptr;
+        currentPipelineGeneration = 0;
+        currentGraphicsSrb = nullptr;
+        currentComputeSrb = nullptr;
+        currentSrbGeneration = 0;
+        currentIndexBuffer = {};
+        currentIndexOffset = 0;
+        currentIndexFormat = DXGI_FORMAT_R16_UINT;
+        currentVertexBuffers = {};
+        currentVertexOffsets = {};
+    }
+
+    PassType recordingPass;
+    double lastGpuTime = 0;
+    QRhiRenderTarget *currentTarget;
+    // see qt_rhi_d3d12_set_readback_conversion()
+    QHash<const QRhiReadbackResult *, QRhiD3D::PixelConversion> readbackConversions;
+    QD3D12GraphicsPipeline *currentGraphicsPipeline;
+    QD3D12ComputePipeline *currentComputePipeline;
+    uint currentPipelineGeneration;
+    QRhiShaderResourceBindings *currentGraphicsSrb;
+    QRhiShaderResourceBindings *currentComputeSrb;
+    uint currentSrbGeneration;
+    QD3D12ObjectHandle currentIndexBuffer;
+    quint32 currentIndexOffset;
+    DXGI_FORMAT currentIndexFormat;
+    std::array<QD3D12ObjectHandle, D3D12_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT> currentVertexBuffers;
+    std::array<quint32, D3D12_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT> currentVertexOffsets;
+
+    // Accumulating visitor data for the current set of shader resource
+    // bindings, only used while setShaderResources() is running.
+    struct VisitorData {
+        QVarLengthArray<QPair<QD3D12ObjectHandle, quint32>, 4> cbufs[6];
+        QVarLengthArray<QD3D12Descriptor, 8> srvs[6];
+        QVarLengthArray<QD3D12Descriptor, 8> samplers[6];
+        QVarLengthArray<QPair<QD3D12ObjectHandle, D3D12_UNORDERED_ACCESS_VIEW_DESC>, 4> uavs[6];
+    } visitorData;
+
+    void visitUniformBuffer(QD3D12Stage s,
+                            const QRhiShaderResourceBinding::Data::UniformBufferData &d,
+                            int shaderRegister,
+                            int binding,
+                            int dynamicOffsetCount,
+                            const QRhiCommandBuffer::DynamicOffset *dynamicOffsets);
+    void visitTexture(QD3D12Stage s,
+                      const QRhiShaderResourceBinding::TextureAndSampler &d,
+                      int shaderRegister);
+    void visitSampler(QD3D12Stage s,
+                      const QRhiShaderResourceBinding::TextureAndSampler &d,
+                      int shaderRegister);
+    void visitStorageBuffer(QD3D12Stage s,
+                            const QRhiShaderResourceBinding::Data::StorageBufferData &d,
+                            QD3D12ShaderResourceVisitor::StorageOp op,
+                            int shaderRegister);
+    void visitStorageImage(QD3D12Stage s,
+                           const QRhiShaderResourceBinding::Data::StorageImageData &d,
+                           QD3D12ShaderResourceVisitor::StorageOp op,
+                           int shaderRegister);
+};
+
+struct QD3D12SwapChain : public QRhiSwapChain
+{
+    QD3D12SwapChain(QRhiImplementation *rhi);
+    ~QD3D12SwapChain();
+    void destroy() override;
+
+    QRhiCommandBuffer *currentFrameCommandBuffer() override;
+    QRhiRenderTarget *currentFrameRenderTarget() override;
+    QRhiRenderTarget *currentFrameRenderTarget(StereoTargetBuffer targetBuffer) override;
+
+    QSize surfacePixelSize() override;
+    bool isFormatSupported(Format f) override;
+    QRhiSwapChainHdrInfo hdrInfo() override;
+
+    QRhiRenderPassDescriptor *newCompatibleRenderPassDescriptor() override;
+    bool createOrResize() override;
+
+    void releaseBuffers();
+    void waitCommandCompletionForFrameSlot(int frameSlot);
+    void addCommandCompletionSignalForCurrentFrameSlot();
+    void chooseFormats();
+
+    QWindow *window = nullptr;
+    IDXGISwapChain1 *sourceSwapChain1 = nullptr;
+    IDXGISwapChain3 *swapChain = nullptr;
+    QSize pixelSize;
+    UINT swapInterval = 1;
+    UINT swapChainFlags = 0;
+    BOOL stereo = false;
+    DXGI_FORMAT colorFormat;
+    DXGI_FORMAT srgbAdjustedColorFormat;
+    DXGI_COLOR_SPACE_TYPE hdrColorSpace;
+    IDCompositionTarget *dcompTarget = nullptr;
+    IDCompositionVisual *dcompVisual = nullptr;
+    static const UINT BUFFER_COUNT = 3;
+    QD3D12ObjectHandle colorBuffers[BUFFER_COUNT];
+    QD3D12Descriptor rtvs[BUFFER_COUNT];
+    QD3D12Descriptor rtvsRight[BUFFER_COUNT];
+    DXGI_SAMPLE_DESC sampleDesc;
+    QD3D12ObjectHandle msaaBuffers[BUFFER_COUNT];
+    QD3D12Descriptor msaaRtvs[BUFFER_COUNT];
+    QD3D12RenderBuffer *ds = nullptr;
+    UINT currentBackBufferIndex = 0;
+    QD3D12SwapChainRenderTarget rtWrapper;
+    QD3D12SwapChainRenderTarget rtWrapperRight;
+    QD3D12CommandBuffer cbWrapper;
+    HANDLE frameLatencyWaitableObject = nullptr;
+    int lastFrameLatencyWaitSlot = -1;
+
+    struct FrameResources {
+        ID3D12Fence *fence = nullptr;
+        HANDLE fenceEvent = nullptr;
+        UINT64 fenceCounter = 0;
+        ID3D12GraphicsCommandList1 *cmdList = nullptr;
+    } frameRes[QD3D12_FRAMES_IN_FLIGHT];
+
+    int currentFrameSlot = 0; // index in frameRes
+};
+
+// Descriptor tables copied into the per-frame slices of the shader-visible
+// CBV/SRV/UAV heap, keyed by the (non-shader-visible) source descriptors. An
+// SRB bound several times in a frame, or bound again just for new dynamic
+// offsets, then does not need to copy the same descriptors again.
+struct QD3D12DescriptorTableCache
+{
+    using SourceHandles = QVarLengthArray<SIZE_T, 16>;
+
+    struct Table {
+        SourceHandles srcHandles;
+        QD3D12Descriptor start;
+    };
+
+    // a new shader-visible heap invalidates everything
+    void setHeap(ID3D12DescriptorHeap *h)
+    {
+        if (heap != h) {
+            heap = h;
+            for (int i = 0; i < QD3D12_FRAMES_IN_FLIGHT; ++i)
+                tables[i].clear();
+        }
+    }
+
+    static size_t key(const SourceHandles &srcHandles)
+    {
+        return qHashBits(srcHandles.constData(), srcHandles.count() * sizeof(SIZE_T));
+    }
+
+    QD3D12Descriptor lookup(int frameSlot, size_t k, const SourceHandles &srcHandles) const
+    {
+        auto it = tables[frameSlot].constFind(k);
+        if (it != tables[frameSlot].cend() && it->srcHandles == srcHandles)
+            return it->start;
+        return {};
+    }
+
+    // a colliding entry is simply replaced
+    void insert(int frameSlot, size_t k, const SourceHandles &srcHandles, const QD3D12Descriptor &start)
+    {
+        tables[frameSlot].insert(k, { srcHandles, start });
+    }
+
+    // to be called whenever the frame slot's heap slice is reset
+    void reset(int frameSlot)
+    {
+        tables[frameSlot].clear();
+    }
+
+    ID3D12DescriptorHeap *heap = nullptr;
+    QHash<size_t, Table> tables[QD3D12_FRAMES_IN_FLIGHT];
+};
+
+// Root signatures keyed by their serialized form. Pipelines with the same
+// resource layout and stage visibility then share one ID3D12RootSignature:
+// each still gets its own handle in rootSignaturePool, but the handles refer
+// to the same object, kept alive by COM refcounting. The cache holds one
+// reference of its own. Also used by the pipeline warm-up threads, hence the
+// mutex.
+struct QD3D12RootSignatureCache
+{
+    QMutex mutex;
+    QHash<QByteArray, ID3D12RootSignature *> rootSigs;
+    QHash<const ID3D12RootSignature *, QByteArray> serializedForms;
+    quint64 hits = 0;
+    quint64 misses = 0;
+};
+
+// Graphics pipelines created in this run, returned from pipelineCacheData(),
+// and the pipeline state objects created on worker threads from the records
+// passed to setPipelineCacheData(). A warmed-up pipeline is handed over to the
+// first QD3D12GraphicsPipeline::create() with a matching record. A record that
+// is in tasks has not been created yet; create() claims it while it is still
+// queued, or waits for the worker while it is running, so that no pipeline
+// state object gets created twice.
+struct QD3D12PipelineWarmup
+{
+    struct WarmedPipeline {
+        ID3D12PipelineState *pso;
+        ID3D12RootSignature *rootSig;
+    };
+    enum TaskState {
+        Queued,
+        Running
+    };
+
+    QMutex mutex;
+    QWaitCondition taskDone;
+    QThreadPool *threadPool = nullptr;
+    QList<QByteArray> records;
+    QSet<QByteArray> recordSet;
+    QHash<QByteArray, TaskState> tasks;
+    QHash<QByteArray, WarmedPipeline> warmedPipelines;
+    quint64 warmedPipelinesUsed = 0;
+};
+
+using QD3D12MemoryBudgetPolicy = QRhiD3D::MemoryBudgetPolicy;
+
+// The budgets sampled at the end of each frame.
+struct QD3D12MemoryBudgetMonitor
+{
+    QD3D12MemoryBudgetPolicy policy;
+    quint64 localUsage = 0;
+    quint64 localBudget = 0;
+    quint64 nonLocalUsage = 0;
+    quint64 nonLocalBudget = 0;
+    quint64 trimCount = 0;
+};
+
+struct QD3D12Readback
+{
+    // common
+    int frameSlot = -1;
+    QRhiReadbackResult *result = nullptr;
+    QD3D12StagingArea staging;
+    quint32 byteSize;
+    // textures
+    quint32 bytesPerLine;
+    QSize pixelSize;
+    QRhiTexture::Format format;
+    quint32 stagingRowPitch;
+    QRhiD3D::PixelConversion conversion;
+};
+
+class QRhiD3D12 : public QRhiImplementation
+{
+public:
+    QRhiD3D12(QRhiD3D12InitParams *params, QRhiD3D12NativeHandles *importDevice = nullptr);
+
+    bool create(QRhi::Flags flags) override;
+    void destroy() override;
+
+    QRhiGraphicsPipeline *createGraphicsPipeline() override;
+    QRhiComputePipeline *createComputePipeline() override;
+    QRhiShaderResourceBindings *createShaderResourceBindings() override;
+    QRhiBuffer *createBuffer(QRhiBuffer::Type type,
+                             QRhiBuffer::UsageFlags usage,
+                             quint32 size) override;
+    QRhiRenderBuffer *createRenderBuffer(QRhiRenderBuffer::Type type,
+                                         const QSize &pixelSize,
+                                         int sampleCount,
+                                         QRhiRenderBuffer::Flags flags,
+                                         QRhiTexture::Format backingFormatHint) override;
+    QRhiTexture *createTexture(QRhiTexture::Format format,
+                               const QSize &pixelSize,
+                               int depth,
+                               int arraySize,
+                               int sampleCount,
+                               QRhiTexture::Flags flags) override;
+    QRhiSampler *createSampler(QRhiSampler::Filter magFilter,
+                               QRhiSampler::Filter minFilter,
+                               QRhiSampler::Filter mipmapMode,
+                               QRhiSampler:: AddressMode u,
+                               QRhiSampler::AddressMode v,
+                               QRhiSampler::AddressMode w) override;
+
+    QRhiTextureRenderTarget *createTextureRenderTarget(const QRhiTextureRenderTargetDescription &desc,
+                                                       QRhiTextureRenderTarget::Flags flags) override;
+
+    QRhiSwapChain *createSwapChain() override;
+    QRhi::FrameOpResult beginFrame(QRhiSwapChain *swapChain, QRhi::BeginFrameFlags flags) override;
+    QRhi::FrameOpResult endFrame(QRhiSwapChain *swapChain, QRhi::EndFrameFlags flags) override;
+    QRhi::FrameOpResult beginOffscreenFrame(QRhiCommandBuffer **cb, QRhi::BeginFrameFlags flags) override;
+    QRhi::FrameOpResult endOffscreenFrame(QRhi::EndFrameFlags flags) override;
+    QRhi::FrameOpResult finish() override;
+
+    void resourceUpdate(QRhiCommandBuffer *cb, QRhiResourceUpdateBatch *resourceUpdates) override;
+
+    void beginPass(QRhiCommandBuffer *cb,
+                   QRhiRenderTarget *rt,
+                   const QColor &colorClearValue,
+                   const QRhiDepthStencilClearValue &depthStencilClearValue,
+                   QRhiResourceUpdateBatch *resourceUpdates,
+                   QRhiCommandBuffer::BeginPassFlags flags) override;
+    void endPass(QRhiCommandBuffer *cb, QRhiResourceUpdateBatch *resourceUpdates) override;
+
+    void setGraphicsPipeline(QRhiCommandBuffer *cb,
+                             QRhiGraphicsPipeline *ps) override;
+
+    void setShaderResources(QRhiCommandBuffer *cb,
+                            QRhiShaderResourceBindings *srb,
+                            int dynamicOffsetCount,
+                            const QRhiCommandBuffer::DynamicOffset *dynamicOffsets) override;
+
+    void setVertexInput(QRhiCommandBuffer *cb,
+                        int startBinding, int bindingCount, const QRhiCommandBuffer::VertexInput *bindings,
+                        QRhiBuffer *indexBuf, quint32 indexOffset,
+                        QRhiCommandBuffer::IndexFormat indexFormat) override;
+
+    void setViewport(QRhiCommandBuffer *cb, const QRhiViewport &viewport) override;
+    void setScissor(QRhiCommandBuffer *cb, const QRhiScissor &scissor) override;
+    void setBlendConstants(QRhiCommandBuffer *cb, const QColor &c) override;
+    void setStencilRef(QRhiCommandBuffer *cb, quint32 refValue) override;
+
+    void draw(QRhiCommandBuffer *cb, quint32 vertexCount,
+              quint32 instanceCount, quint32 firstVertex, quint32 firstInstance) override;
+
+    void drawIndexed(QRhiCommandBuffer *cb, quint32 indexCount,
+                     quint32 instanceCount, quint32 firstIndex,
+                     qint32 vertexOffset, quint32 firstInstance) override;
+
+    void debugMarkBegin(QRhiCommandBuffer *cb, const QByteArray &name) override;
+    void debugMarkEnd(QRhiCommandBuffer *cb) override;
+    void debugMarkMsg(QRhiCommandBuffer *cb, const QByteArray &msg) override;
+
+    void beginComputePass(QRhiCommandBuffer *cb,
+                          QRhiResourceUpdateBatch *resourceUpdates,
+                          QRhiCommandBuffer::BeginPassFlags flags) override;
+    void endComputePass(QRhiCommandBuffer *cb, QRhiResourceUpdateBatch *resourceUpdates) override;
+    void setComputePipeline(QRhiCommandBuffer *cb, QRhiComputePipeline *ps) override;
+    void dispatch(QRhiCommandBuffer *cb, int x, int y, int z) override;
+
+    const QRhiNativeHandles *nativeHandles(QRhiCommandBuffer *cb) override;
+    void beginExternal(QRhiCommandBuffer *cb) override;
+    void endExternal(QRhiCommandBuffer *cb) override;
+    double lastCompletedGpuTime(QRhiCommandBuffer *cb) override;
+
+    QList<int> supportedSampleCounts() const override;
+    int ubufAlignment() const override;
+    bool isYUpInFramebuffer() const override;
+    bool isYUpInNDC() const override;
+    bool isClipDepthZeroToOne() const override;
+    QMatrix4x4 clipSpaceCorrMatrix() const override;
+    bool isTextureFormatSupported(QRhiTexture::Format format, QRhiTexture::Flags flags) const override;
+    bool isFeatureSupported(QRhi::Feature feature) const override;
+    int resourceLimit(QRhi::ResourceLimit limit) const override;
+    const QRhiNativeHandles *nativeHandles() override;
+    QRhiDriverInfo driverInfo() const override;
+    QRhiStats statistics() override;
+    bool makeThreadLocalNativeContextCurrent() override;
+    void releaseCachedResources() override;
+    bool isDeviceLost() const override;
+
+    QByteArray pipelineCacheData() override;
+    void setPipelineCacheData(const QByteArray &data) override;
+
+    void waitGpu();
+    DXGI_SAMPLE_DESC effectiveSampleDesc(int sampleCount, DXGI_FORMAT format) const;
+    bool ensureDirectCompositionDevice();
+    bool startCommandListForCurrentFrameSlot(ID3D12GraphicsCommandList1 **cmdList);
+    void enqueueResourceUpdates(QD3D12CommandBuffer *cbD, QRhiResourceUpdateBatch *resourceUpdates);
+    void finishActiveReadbacks(bool forced = false);
+    bool ensureShaderVisibleDescriptorHeapCapacity(QD3D12ShaderVisibleDescriptorHeap *h,
+                                                   D3D12_DESCRIPTOR_HEAP_TYPE type,
+                                                   int frameSlot,
+                                                   quint32 neededDescriptorCount,
+                                                   bool *gotNew);
+    void bindShaderVisibleHeaps(QD3D12CommandBuffer *cbD);
+
+    bool debugLayer = false;
+    UINT maxFrameLatency = 2; // 1-16, use 2 for lowest latency
+    ID3D12Device2 *dev = nullptr;
+    D3D_FEATURE_LEVEL minimumFeatureLevel = D3D_FEATURE_LEVEL(0);
+    LUID adapterLuid = {};
+    bool importedDevice = false;
+    bool importedCommandQueue = false;
+    QRhi::Flags rhiFlags;
+    IDXGIFactory2 *dxgiFactory = nullptr;
+    bool supportsAllowTearing = false;
+    IDXGIAdapter1 *activeAdapter = nullptr;
+    QRhiDriverInfo driverInfoStruct;
+    QRhiD3D12NativeHandles nativeHandlesStruct;
+    bool deviceLost = false;
+    ID3D12CommandQueue *cmdQueue = nullptr;
+    ID3D12Fence *fullFence = nullptr;
+    HANDLE fullFenceEvent = nullptr;
+    UINT64 fullFenceCounter = 0;
+    ID3D12CommandAllocator *cmdAllocators[QD3D12_FRAMES_IN_FLIGHT] = {};
+    QD3D12MemoryAllocator vma;
+    QD3D12CpuDescriptorPool rtvPool;
+    QD3D12CpuDescriptorPool dsvPool;
+    QD3D12CpuDescriptorPool cbvSrvUavPool;
+    QD3D12ObjectPool<QD3D12Resource> resourcePool;
+    QD3D12ObjectPool<QD3D12Pipeline> pipelinePool;
+    QD3D12ObjectPool<QD3D12RootSignature> rootSignaturePool;
+    QD3D12ReleaseQueue releaseQueue;
+    QD3D12ResourceBarrierGenerator barrierGen;
+    QD3D12SamplerManager samplerMgr;
+    QD3D12MipmapGenerator mipmapGen;
+    QD3D12StagingArea smallStagingAreas[QD3D12_FRAMES_IN_FLIGHT];
+    QD3D12ShaderVisibleDescriptorHeap shaderVisibleCbvSrvUavHeap;
+    QD3D12DescriptorTableCache descriptorTableCache;
+    QD3D12RootSignatureCache rootSignatureCache;
+    QD3D12PipelineWarmup pipelineWarmup;
+    QD3D12MemoryBudgetMonitor memoryBudgetMonitor;
+
+    // Counters not representable in QRhiStats, snapshotted under the
+    // respective locks.
+    struct Statistics {
+        int rootSignatureCacheEntries = 0;
+        quint64 rootSignatureCacheHits = 0;
+        quint64 rootSignatureCacheMisses = 0;
+        int warmupRecords = 0;
+        int warmedPipelinesUnused = 0;
+        quint64 warmedPipelinesUsed = 0;
+        quint32 recycledSamplerDescriptors = 0;
+        quint64 localMemoryUsage = 0;
+        quint64 localMemoryBudget = 0;
+        quint64 nonLocalMemoryUsage = 0;
+        quint64 nonLocalMemoryBudget = 0;
+        QD3D12MemoryBudgetPolicy::Level memoryPressureLevel = QD3D12MemoryBudgetPolicy::Normal;
+        quint64 memoryTrimCount = 0;
+    };
+    Statistics backendStatistics();
+
+    UINT64 timestampTicksPerSecond = 0;
+    QD3D12QueryHeap timestampQueryHeap;
+    QD3D12StagingArea timestampReadbackArea;
+    IDCompositionDevice *dcompDevice = nullptr;
+    QD3D12SwapChain *currentSwapChain = nullptr;
+    QSet<QD3D12SwapChain *> swapchains;
+    QD3D12ShaderBytecodeCache shaderBytecodeCache;
+    QVarLengthArray<QD3D12Readback, 2> activeReadbacks;
+    bool offscreenActive = false;
+    QD3D12CommandBuffer *offscreenCb[QD3D12_FRAMES_IN_FLIGHT] = {};
+
+    struct {
+        bool multiView = false;
+        bool textureViewFormat = false;
+    } caps;
+
+    static const quint32 SMALL_STAGING_AREA_BYTES_PER_FRAME = 16 * 1024 * 1024;
+    static const quint32 SHADER_VISIBLE_CBV_SRV_UAV_HEAP_PER_FRAME_START_SIZE = 16384;
+    static const int MAX_SHADER_CACHE_ENTRIES = 1024;
+};
+
+Q_GUI_EXPORT void qt_rhi_d3d12_set_readback_conversion(QRhiCommandBuffer *cb,
+                                                      const QRhiReadbackResult *result,
+                                                      QRhiD3D::PixelConversion conversion);
+Q_GUI_EXPORT void qt_rhi_d3d12_set_memory_budget_callback(QRhi *rhi,
+                                                          QRhiD3D12MemoryBudgetCallback callback,
+                                                          void *userData);
+
+QT_END_NAMESPACE
+
+#endif // __ID3D12Device2_INTERFACE_DEFINED__
+
+#endif
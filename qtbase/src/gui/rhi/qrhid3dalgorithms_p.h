@@ -0,0 +1,228 @@
+// Copyright (C) 2023 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QRHID3DALGORITHMS_P_H
+#define QRHID3DALGORITHMS_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include <QtCore/qalgorithms.h>
+#include <QtCore/qbytearray.h>
+#include <QtCore/qpoint.h>
+#include <QtCore/qsize.h>
+#include <QtCore/qvarlengtharray.h>
+#include <algorithm>
+#include <cstring>
+
+QT_BEGIN_NAMESPACE
+
+// Bookkeeping used by the D3D11 and D3D12 backends that does not depend on
+// D3D at all.
+
+namespace QRhiD3D {
+
+// Places the rectangles on shelves, tallest first, in an area at most
+// maxSize wide and high. Returns the size of the area used, or an empty size
+// when the rectangles do not fit.
+inline QSize packUploadRects(const QSize *sizes, int count, int maxSize, QPoint *positions)
+{
+    QVarLengthArray<int, 64> order(count);
+    for (int i = 0; i < count; ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [sizes](int a, int b) {
+        return sizes[a].height() > sizes[b].height();
+    });
+
+    int x = 0;
+    int y = 0;
+    int shelfHeight = 0;
+    int usedWidth = 0;
+    for (int i : order) {
+        const QSize &size(sizes[i]);
+        if (size.width() > maxSize)
+            return {};
+        if (x + size.width() > maxSize) {
+            y += shelfHeight;
+            x = 0;
+            shelfHeight = 0;
+        }
+        positions[i] = QPoint(x, y);
+        x += size.width();
+        shelfHeight = qMax(shelfHeight, size.height());
+        usedWidth = qMax(usedWidth, x);
+    }
+    if (y + shelfHeight > maxSize)
+        return {};
+
+    return QSize(usedWidth, y + shelfHeight);
+}
+
+struct MipmapDispatch
+{
+    quint32 level; // source level
+    quint32 numGenMips; // levels written, 1..4
+    quint32 width; // size of level + 1, also the thread group count
+    quint32 height;
+};
+
+// Splits a mip chain into dispatches. One dispatch writes up to 4 levels from
+// its source level, reducing further in groupshared memory for as long as the
+// dimensions stay even.
+inline QVarLengthArray<MipmapDispatch, 8> planMipmapDispatches(quint32 width, quint32 height,
+                                                               quint32 mipLevelCount)
+{
+    QVarLengthArray<MipmapDispatch, 8> dispatches;
+    for (quint32 level = 0; level < mipLevelCount - 1;) {
+        quint32 levelPlusOneMipWidth = width >> (level + 1);
+        quint32 levelPlusOneMipHeight = height >> (level + 1);
+        const quint32 dw = levelPlusOneMipWidth == 1 ? levelPlusOneMipHeight : levelPlusOneMipWidth;
+        const quint32 dh = levelPlusOneMipHeight == 1 ? levelPlusOneMipWidth : levelPlusOneMipHeight;
+        // number of times the size can be halved while still resulting in an even dimension
+        const quint32 additionalMips = qCountTrailingZeroBits(dw | dh);
+        const quint32 numGenMips = qMin(1u + qMin(3u, additionalMips), mipLevelCount - 1u - level);
+        levelPlusOneMipWidth = qMax(1u, levelPlusOneMipWidth);
+        levelPlusOneMipHeight = qMax(1u, levelPlusOneMipHeight);
+        dispatches.append({ level, numGenMips, levelPlusOneMipWidth, levelPlusOneMipHeight });
+        level += numGenMips;
+    }
+    return dispatches;
+}
+
+// Decides the memory pressure level from the usage and budget reported by
+// the OS. The level only changes to a lower one when the usage dropped below
+// the threshold by a margin, so that usage hovering around a threshold does
+// not lead to trimming every frame.
+struct MemoryBudgetPolicy
+{
+    enum Level {
+        Normal,
+        Elevated,
+        Critical
+    };
+
+    static constexpr double ELEVATED_THRESHOLD = 0.80;
+    static constexpr double CRITICAL_THRESHOLD = 0.95;
+    static constexpr double HYSTERESIS = 0.05;
+
+    static Level levelFor(double usageRatio, double margin)
+    {
+        if (usageRatio >= CRITICAL_THRESHOLD - margin)
+            return Critical;
+        if (usageRatio >= ELEVATED_THRESHOLD - margin)
+            return Elevated;
+        return Normal;
+    }
+
+    // Returns true when the level changed.
+    bool update(quint64 usageBytes, quint64 budgetBytes)
+    {
+        if (!budgetBytes)
+            return false;
+        const double usageRatio = double(usageBytes) / double(budgetBytes);
+        Level newLevel = level;
+        const Level upper = levelFor(usageRatio, 0.0);
+        const Level lower = levelFor(usageRatio, HYSTERESIS);
+        if (upper > level)
+            newLevel = upper;
+        else if (lower < level)
+            newLevel = lower;
+        if (newLevel == level)
+            return false;
+        level = newLevel;
+        return true;
+    }
+
+    Level level = Normal;
+};
+
+// Writes to a host visible buffer not yet applied: sorted, non-overlapping
+// ranges, coalesced on insert, with the data kept in an arena that is reset
+// by clear().
+struct HostWrite
+{
+    quint32 offset;
+    quint32 size;
+    quint32 arenaOffset;
+};
+
+struct HostWrites
+{
+    void add(quint32 offset, const char *data, quint32 size)
+    {
+        if (!size)
+            return;
+
+        const quint32 end = offset + size;
+
+        // [first, last) are the ranges overlapping or touching [offset, end)
+        auto first = std::lower_bound(ranges.begin(), ranges.end(), offset,
+                                      [](const HostWrite &w, quint32 v) { return w.offset + w.size < v; });
+        auto last = first;
+        while (last != ranges.end() && last->offset <= end)
+            ++last;
+
+        const qsizetype index = first - ranges.begin();
+        if (first == last) {
+            const quint32 arenaOffset = quint32(arena.size());
+            arena.append(data, size);
+            ranges.insert(index, { offset, size, arenaOffset });
+            return;
+        }
+
+        const HostWrite head = *first;
+        const HostWrite tail = *(last - 1);
+        const quint32 mergedOffset = qMin(offset, head.offset);
+        const quint32 mergedEnd = qMax(end, tail.offset + tail.size);
+        const quint32 mergedSize = mergedEnd - mergedOffset;
+        const bool replacesAll = index == 0 && last == ranges.end()
+                && mergedOffset == offset && mergedEnd == end;
+        ranges.erase(first, last);
+
+        quint32 arenaOffset;
+        if (replacesAll) {
+            // nothing in the arena is needed anymore
+            arenaOffset = 0;
+            arena.resize(mergedSize);
+        } else if (head.offset == mergedOffset && head.arenaOffset + head.size == quint32(arena.size())) {
+            // the head was the last allocation, grow it in place
+            arenaOffset = head.arenaOffset;
+            arena.resize(arenaOffset + mergedSize);
+        } else {
+            arenaOffset = quint32(arena.size());
+            arena.resize(arenaOffset + mergedSize);
+            if (head.offset < offset)
+                memcpy(arena.data() + arenaOffset, arena.constData() + head.arenaOffset, offset - head.offset);
+        }
+
+        char *p = arena.data() + arenaOffset;
+        memcpy(p + (offset - mergedOffset), data, size);
+        if (tail.offset + tail.size > end) {
+            // may be the very same bytes when growing the head in place
+            memmove(p + (end - mergedOffset), arena.constData() + tail.arenaOffset + (end - tail.offset),
+                    tail.offset + tail.size - end);
+        }
+
+        ranges.insert(index, { mergedOffset, mergedSize, arenaOffset });
+    }
+
+    void clear() { ranges.clear(); arena.resize(0); }
+    bool isEmpty() const { return ranges.isEmpty(); }
+
+    QVarLengthArray<HostWrite, 16> ranges;
+    QByteArray arena;
+};
+
+} // namespace
+
+QT_END_NAMESPACE
+
+#endif
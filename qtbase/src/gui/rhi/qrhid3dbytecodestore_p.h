@@ -0,0 +1,151 @@
+// Copyright (C) 2023 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QRHID3DBYTECODESTORE_P_H
+#define QRHID3DBYTECODESTORE_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qcache.h>
+#include <QtCore/qcryptographichash.h>
+#include <QtCore/qhash.h>
+#include <QtCore/qmutex.h>
+
+QT_BEGIN_NAMESPACE
+
+namespace QRhiD3D {
+
+// Blake2s_128
+constexpr qsizetype BYTECODE_STORE_SOURCE_HASH_SIZE = 16;
+
+struct BytecodeStoreKey
+{
+    QByteArray sourceHash;
+    QByteArray target;
+    QByteArray entryPoint;
+    uint compileFlags = 0; // D3DCOMPILE_*
+};
+
+inline bool operator==(const BytecodeStoreKey &a, const BytecodeStoreKey &b) noexcept
+{
+    return a.sourceHash == b.sourceHash
+            && a.target == b.target
+            && a.entryPoint == b.entryPoint
+            && a.compileFlags == b.compileFlags;
+}
+
+inline bool operator!=(const BytecodeStoreKey &a, const BytecodeStoreKey &b) noexcept
+{
+    return !(a == b);
+}
+
+inline size_t qHash(const BytecodeStoreKey &k, size_t seed = 0) noexcept
+{
+    return qHashMulti(seed, k.sourceHash, k.target, k.entryPoint, k.compileFlags);
+}
+
+// Bytecode compiled at run time from HLSL source, shared by all QRhi
+// instances of the D3D11 and D3D12 backends in the process. Entries are
+// addressed by a 128-bit hash of the source, which is stable across runs and
+// is what the D3D11 pipeline cache data stores as well.
+//
+// Computing that hash is memoized, keyed by the size and qHash() of the
+// source, which is a lot cheaper than Blake2s, without keeping the sources
+// alive. Both the memo and the bytecode are bounded, evicting the least
+// recently used entries.
+//
+// Each backend instance holds a reference from create() to destroy(); the
+// store is emptied when the last one goes away.
+class BytecodeStore
+{
+public:
+    static BytecodeStore *instance()
+    {
+        static BytecodeStore store;
+        return &store;
+    }
+
+    void ref()
+    {
+        QMutexLocker lock(&mutex);
+        refCount += 1;
+    }
+
+    void deref()
+    {
+        QMutexLocker lock(&mutex);
+        Q_ASSERT(refCount > 0);
+        refCount -= 1;
+        if (refCount == 0) {
+            hashes.clear();
+            bytecode.clear();
+        }
+    }
+
+    QByteArray sourceHash(const QByteArray &source)
+    {
+        const MemoKey memoKey = { source.size(), qHash(source) };
+        QMutexLocker lock(&mutex);
+        if (const QByteArray *hash = hashes.object(memoKey))
+            return *hash;
+        lock.unlock();
+
+        const QByteArray hash = QCryptographicHash::hash(source, QCryptographicHash::Blake2s_128);
+        lock.relock();
+        hashes.insert(memoKey, new QByteArray(hash));
+        return hash;
+    }
+
+    QByteArray lookup(const BytecodeStoreKey &key)
+    {
+        QMutexLocker lock(&mutex);
+        const QByteArray *data = bytecode.object(key);
+        return data ? *data : QByteArray();
+    }
+
+    void insert(const BytecodeStoreKey &key, const QByteArray &data)
+    {
+        QMutexLocker lock(&mutex);
+        if (!bytecode.contains(key))
+            bytecode.insert(key, new QByteArray(data), qMax<qsizetype>(1, data.size()));
+    }
+
+private:
+    static const int MAX_MEMOIZED_HASHES = 4096;
+    static const qsizetype MAX_BYTECODE_BYTES = 32 * 1024 * 1024;
+
+    struct MemoKey
+    {
+        qsizetype size;
+        size_t contentHash;
+        bool operator==(const MemoKey &other) const noexcept
+        {
+            return size == other.size && contentHash == other.contentHash;
+        }
+        friend size_t qHash(const MemoKey &k, size_t seed = 0) noexcept
+        {
+            return qHashMulti(seed, k.size, k.contentHash);
+        }
+    };
+
+    QMutex mutex;
+    int refCount = 0;
+    QCache<MemoKey, QByteArray> hashes { MAX_MEMOIZED_HASHES };
+    QCache<BytecodeStoreKey, QByteArray> bytecode { MAX_BYTECODE_BYTES };
+};
+
+} // namespace
+
+QT_END_NAMESPACE
+
+#endif
@@ -0,0 +1,155 @@
+// Copyright (C) 2023 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QRHID3DPITCHEDCOPY_P_H
+#define QRHID3DPITCHEDCOPY_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include <QtCore/qglobal.h>
+#include <QtCore/qflags.h>
+#include <QtCore/private/qsimd_p.h>
+#include <QtGui/qrgb.h>
+#include <rhi/qrhi.h>
+#include <cstring>
+
+QT_BEGIN_NAMESPACE
+
+namespace QRhiD3D {
+
+// Conversions applied while copying 8 bit per channel, 4 channel pixels (RGBA8
+// and BGRA8, alpha last in both).
+enum PixelConversionFlag {
+    SwapRedBlue = 0x01,
+    Premultiply = 0x02
+};
+Q_DECLARE_FLAGS(PixelConversion, PixelConversionFlag)
+Q_DECLARE_OPERATORS_FOR_FLAGS(PixelConversion)
+
+inline bool canConvertPixels(QRhiTexture::Format format)
+{
+    return format == QRhiTexture::RGBA8 || format == QRhiTexture::BGRA8;
+}
+
+inline QRhiTexture::Format convertedFormat(QRhiTexture::Format format, PixelConversion conversion)
+{
+    if (!conversion.testFlag(SwapRedBlue))
+        return format;
+    return format == QRhiTexture::RGBA8 ? QRhiTexture::BGRA8 : QRhiTexture::RGBA8;
+}
+
+inline quint32 convertPixel(quint32 p, PixelConversion conversion)
+{
+    if (conversion.testFlag(SwapRedBlue))
+        p = (p & 0xff00ff00) | ((p & 0xff) << 16) | ((p >> 16) & 0xff);
+    // alpha is the top byte for both orders, like in QRgb
+    if (conversion.testFlag(Premultiply))
+        p = qPremultiply(p);
+    return p;
+}
+
+inline void convertPixelsScalar(quint32 *dst, const quint32 *src, int count, PixelConversion conversion)
+{
+    for (int i = 0; i < count; ++i) {
+        quint32 p;
+        memcpy(&p, src + i, sizeof(p));
+        p = convertPixel(p, conversion);
+        memcpy(dst + i, &p, sizeof(p));
+    }
+}
+
+// Gives the same results as convertPixelsScalar(). dst and src may be the
+// same but must not overlap otherwise. Neither needs to be aligned.
+inline void convertPixels(quint32 *dst, const quint32 *src, int count, PixelConversion conversion)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i redBlueMask = _mm_set1_epi32(0x00ff00ff);
+    const __m128i greenAlphaMask = _mm_set1_epi32(int(0xff00ff00));
+    const __m128i alphaMask = _mm_set1_epi32(int(0xff000000));
+    const __m128i lowByteMask = _mm_set1_epi32(0x000000ff);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(0x80);
+    // (c * a + ((c * a) >> 8) + 0x80) >> 8 per channel, as qPremultiply() does
+    const auto premultiply8 = [&half](__m128i c) {
+        __m128i a = _mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3));
+        a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i t = _mm_mullo_epi16(c, a);
+        t = _mm_add_epi16(t, _mm_srli_epi16(t, 8));
+        t = _mm_add_epi16(t, half);
+        return _mm_srli_epi16(t, 8);
+    };
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        if (conversion.testFlag(SwapRedBlue)) {
+            const __m128i rb = _mm_and_si128(p, redBlueMask);
+            const __m128i swapped = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(rb, lowByteMask), 16),
+                                                 _mm_srli_epi32(rb, 16));
+            p = _mm_or_si128(_mm_and_si128(p, greenAlphaMask), swapped);
+        }
+        if (conversion.testFlag(Premultiply)) {
+            const __m128i lo = premultiply8(_mm_unpacklo_epi8(p, zero));
+            const __m128i hi = premultiply8(_mm_unpackhi_epi8(p, zero));
+            const __m128i premultiplied = _mm_packus_epi16(lo, hi);
+            p = _mm_or_si128(_mm_andnot_si128(alphaMask, premultiplied), _mm_and_si128(p, alphaMask));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), p);
+    }
+#endif
+    convertPixelsScalar(dst + i, src + i, count - i, conversion);
+}
+
+// Copies rowCount rows of rowBytes each between pitched layouts. Staging data
+// often has no padding (e.g. widths that are a multiple of 64 pixels with
+// 32-bit formats), in which case this is a single copy instead of one per row.
+// With a conversion, rowBytes must be a multiple of 4 and the rows are
+// converted while copying.
+inline void copyPitchedRows(void *dst, quint32 dstPitch,
+                            const void *src, quint32 srcPitch,
+                            quint32 rowBytes, int rowCount,
+                            PixelConversion conversion = {})
+{
+    if (rowCount <= 0)
+        return;
+    if (conversion) {
+        Q_ASSERT(rowBytes % 4 == 0);
+        const bool unpadded = rowBytes == dstPitch && rowBytes == srcPitch;
+        const int pixelsPerCall = unpadded ? int(rowBytes / 4) * rowCount : int(rowBytes / 4);
+        const int callCount = unpadded ? 1 : rowCount;
+        uchar *d = static_cast<uchar *>(dst);
+        const uchar *s = static_cast<const uchar *>(src);
+        for (int y = 0; y < callCount; ++y) {
+            convertPixels(reinterpret_cast<quint32 *>(d), reinterpret_cast<const quint32 *>(s),
+                          pixelsPerCall, conversion);
+            d += dstPitch;
+            s += srcPitch;
+        }
+        return;
+    }
+    if (rowBytes == dstPitch && rowBytes == srcPitch) {
+        memcpy(dst, src, size_t(rowBytes) * size_t(rowCount));
+        return;
+    }
+    uchar *d = static_cast<uchar *>(dst);
+    const uchar *s = static_cast<const uchar *>(src);
+    for (int y = 0; y < rowCount; ++y) {
+        memcpy(d, s, rowBytes);
+        d += dstPitch;
+        s += srcPitch;
+    }
+}
+
+} // namespace
+
+QT_END_NAMESPACE
+
+#endif
@@ -0,0 +1,137 @@
+// Copyright (C) 2023 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QRHID3DTIMINGSCOPES_P_H
+#define QRHID3DTIMINGSCOPES_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qlist.h>
+#include <QtCore/qvarlengtharray.h>
+#include <QtCore/qjsonarray.h>
+#include <QtCore/qjsondocument.h>
+#include <QtCore/qjsonobject.h>
+
+QT_BEGIN_NAMESPACE
+
+namespace QRhiD3D {
+
+// Bookkeeping for nested GPU timing scopes. Query is the backend's query
+// handle (a pointer, default constructed meaning none); nothing in here
+// talks to the device, so it works the same with made-up handles and
+// timestamps.
+
+template<typename Query>
+struct TimingQueryFreeList
+{
+    QVarLengthArray<Query, 32> timestampQueries;
+    QVarLengthArray<Query, 4> disjointQueries;
+
+    Query takeTimestampQuery()
+    {
+        return timestampQueries.isEmpty() ? Query() : timestampQueries.takeLast();
+    }
+    Query takeDisjointQuery()
+    {
+        return disjointQueries.isEmpty() ? Query() : disjointQueries.takeLast();
+    }
+
+    template<typename ReleaseFunc>
+    void releaseAll(ReleaseFunc release)
+    {
+        for (Query q : std::as_const(timestampQueries))
+            release(q);
+        for (Query q : std::as_const(disjointQueries))
+            release(q);
+        timestampQueries.clear();
+        disjointQueries.clear();
+    }
+};
+
+template<typename Query>
+struct TimingFrame
+{
+    struct Scope {
+        QByteArray name;
+        int parent;
+        Query beginQuery;
+        Query endQuery;
+    };
+
+    Query disjointQuery = Query();
+    QList<Scope> scopes;
+    QVarLengthArray<int, 8> openScopes;
+
+    // Returns false when the scope could not get its queries. Something is
+    // pushed regardless, so that the matching closeScope() stays balanced.
+    bool openScope(const QByteArray &name, Query beginQuery, Query endQuery)
+    {
+        if (!beginQuery || !endQuery) {
+            openScopes.append(-1);
+            return false;
+        }
+        const int parent = openScopes.isEmpty() ? -1 : openScopes.last();
+        openScopes.append(int(scopes.count()));
+        scopes.append({ name, parent, beginQuery, endQuery });
+        return true;
+    }
+
+    // Returns the query to end for the innermost open scope, if any.
+    Query closeScope()
+    {
+        if (openScopes.isEmpty())
+            return Query();
+        const int index = openScopes.takeLast();
+        return index >= 0 ? scopes[index].endQuery : Query();
+    }
+
+    void recycle(TimingQueryFreeList<Query> *freeList)
+    {
+        if (disjointQuery)
+            freeList->disjointQueries.append(disjointQuery);
+        for (const Scope &scope : std::as_const(scopes)) {
+            freeList->timestampQueries.append(scope.beginQuery);
+            freeList->timestampQueries.append(scope.endQuery);
+        }
+        *this = {};
+    }
+};
+
+// Turns the resolved timestamps (begin and end for each scope, in the order
+// of frame.scopes) into a JSON array of {"name", "ms", "children"} objects.
+template<typename Query>
+QByteArray timingScopesToJson(const TimingFrame<Query> &frame, const quint64 *timestamps, quint64 frequency)
+{
+    // scopes are stored in begin order, so children always come after their parent
+    const qsizetype count = frame.scopes.count();
+    QVarLengthArray<QJsonArray, 32> children(count);
+    QJsonArray roots;
+    for (qsizetype i = count - 1; i >= 0; --i) {
+        const auto &scope(frame.scopes[i]);
+        const double ms = (timestamps[i * 2 + 1] - timestamps[i * 2]) / double(frequency) * 1000.0;
+        QJsonObject obj;
+        obj.insert(QLatin1String("name"), QString::fromUtf8(scope.name));
+        obj.insert(QLatin1String("ms"), ms);
+        if (!children[i].isEmpty())
+            obj.insert(QLatin1String("children"), children[i]);
+        QJsonArray &siblings(scope.parent >= 0 ? children[scope.parent] : roots);
+        siblings.prepend(obj);
+    }
+    return QJsonDocument(roots).toJson(QJsonDocument::Compact);
+}
+
+} // namespace
+
+QT_END_NAMESPACE
+
+#endif
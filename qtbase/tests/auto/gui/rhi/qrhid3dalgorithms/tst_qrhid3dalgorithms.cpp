@@ -0,0 +1,312 @@
+// Copyright (C) 2023 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR GPL-3.0-only
+
+#include <QTest>
+#include <QtCore/qjsonarray.h>
+#include <QtCore/qjsondocument.h>
+#include <QtCore/qjsonobject.h>
+#include <QtCore/qrandom.h>
+#include <QtCore/qrect.h>
+
+#include "qrhid3dalgorithms_p.h"
+#include "qrhid3dpitchedcopy_p.h"
+#include "qrhid3dtimingscopes_p.h"
+
+class tst_QRhiD3DAlgorithms : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void packUploadRects_data();
+    void packUploadRects();
+    void packUploadRectsTooLarge();
+    void planMipmapDispatches_data();
+    void planMipmapDispatches();
+    void planMipmapDispatchesCoverChain();
+    void memoryBudgetPolicy();
+    void hostWritesCoalesce();
+    void hostWritesRandom();
+    void convertPixels();
+    void copyPitchedRows();
+    void timingScopes();
+};
+
+void tst_QRhiD3DAlgorithms::packUploadRects_data()
+{
+    QTest::addColumn<QList<QSize>>("sizes");
+    QTest::addColumn<int>("maxSize");
+    QTest::addColumn<QSize>("expectedUsedSize");
+
+    QTest::newRow("single") << QList<QSize>{ { 10, 20 } } << 64 << QSize(10, 20);
+    QTest::newRow("one shelf") << QList<QSize>{ { 10, 5 }, { 20, 8 }, { 30, 3 } } << 64 << QSize(60, 8);
+    QTest::newRow("two shelves") << QList<QSize>{ { 40, 10 }, { 40, 6 }, { 20, 4 } } << 64 << QSize(60, 16);
+    QTest::newRow("exact fit") << QList<QSize>{ { 32, 32 }, { 32, 32 }, { 32, 32 }, { 32, 32 } } << 64 << QSize(64, 64);
+}
+
+void tst_QRhiD3DAlgorithms::packUploadRects()
+{
+    QFETCH(QList<QSize>, sizes);
+    QFETCH(int, maxSize);
+    QFETCH(QSize, expectedUsedSize);
+
+    QList<QPoint> positions(sizes.count());
+    const QSize usedSize = QRhiD3D::packUploadRects(sizes.constData(), int(sizes.count()), maxSize,
+                                                    positions.data());
+    QCOMPARE(usedSize, expectedUsedSize);
+
+    const QRect area(QPoint(0, 0), usedSize);
+    for (qsizetype i = 0; i < sizes.count(); ++i) {
+        const QRect r(positions[i], sizes[i]);
+        QVERIFY(area.contains(r));
+        for (qsizetype j = 0; j < i; ++j)
+            QVERIFY(!r.intersects(QRect(positions[j], sizes[j])));
+    }
+}
+
+void tst_QRhiD3DAlgorithms::packUploadRectsTooLarge()
+{
+    QPoint positions[4];
+    const QSize wide[] = { { 65, 1 } };
+    QVERIFY(QRhiD3D::packUploadRects(wide, 1, 64, positions).isEmpty());
+    const QSize tall[] = { { 40, 40 }, { 40, 40 } };
+    QVERIFY(QRhiD3D::packUploadRects(tall, 2, 64, positions).isEmpty());
+}
+
+using MipmapDispatchList = QList<QList<quint32>>; // level, numGenMips, width, height
+
+void tst_QRhiD3DAlgorithms::planMipmapDispatches_data()
+{
+    QTest::addColumn<QSize>("size");
+    QTest::addColumn<int>("mipLevelCount");
+    QTest::addColumn<MipmapDispatchList>("expected");
+
+    QTest::newRow("256x256") << QSize(256, 256) << 9
+                             << MipmapDispatchList{ { 0, 4, 128, 128 }, { 4, 4, 8, 8 } };
+    QTest::newRow("256x64") << QSize(256, 64) << 9
+                            << MipmapDispatchList{ { 0, 4, 128, 32 }, { 4, 2, 8, 2 }, { 6, 2, 2, 1 } };
+    QTest::newRow("odd") << QSize(100, 100) << 7
+                         << MipmapDispatchList{ { 0, 2, 50, 50 }, { 2, 3, 12, 12 }, { 5, 1, 1, 1 } };
+    QTest::newRow("two levels") << QSize(2, 2) << 2 << MipmapDispatchList{ { 0, 1, 1, 1 } };
+}
+
+void tst_QRhiD3DAlgorithms::planMipmapDispatches()
+{
+    QFETCH(QSize, size);
+    QFETCH(int, mipLevelCount);
+    QFETCH(MipmapDispatchList, expected);
+
+    const auto dispatches = QRhiD3D::planMipmapDispatches(quint32(size.width()), quint32(size.height()),
+                                                          quint32(mipLevelCount));
+    MipmapDispatchList actual;
+    for (const QRhiD3D::MipmapDispatch &d : dispatches)
+        actual.append(QList<quint32>{ d.level, d.numGenMips, d.width, d.height });
+    QCOMPARE(actual, expected);
+}
+
+void tst_QRhiD3DAlgorithms::planMipmapDispatchesCoverChain()
+{
+    for (quint32 w = 1; w <= 300; w += 7) {
+        for (quint32 h = 1; h <= 300; h += 11) {
+            quint32 mipLevelCount = 1;
+            for (quint32 s = qMax(w, h); s > 1; s >>= 1)
+                ++mipLevelCount;
+            quint32 level = 0;
+            for (const QRhiD3D::MipmapDispatch &d : QRhiD3D::planMipmapDispatches(w, h, mipLevelCount)) {
+                QCOMPARE(d.level, level);
+                QVERIFY(d.numGenMips >= 1 && d.numGenMips <= 4);
+                QCOMPARE(d.width, qMax(1u, w >> (level + 1)));
+                QCOMPARE(d.height, qMax(1u, h >> (level + 1)));
+                level += d.numGenMips;
+            }
+            QCOMPARE(level, mipLevelCount - 1);
+        }
+    }
+}
+
+void tst_QRhiD3DAlgorithms::memoryBudgetPolicy()
+{
+    using Policy = QRhiD3D::MemoryBudgetPolicy;
+    Policy policy;
+    QVERIFY(!policy.update(100, 0)); // no budget reported
+    QVERIFY(!policy.update(50, 100));
+    QCOMPARE(policy.level, Policy::Normal);
+
+    QVERIFY(policy.update(85, 100));
+    QCOMPARE(policy.level, Policy::Elevated);
+    // below the threshold, but not by the margin
+    QVERIFY(!policy.update(78, 100));
+    QCOMPARE(policy.level, Policy::Elevated);
+    QVERIFY(policy.update(74, 100));
+    QCOMPARE(policy.level, Policy::Normal);
+
+    // straight to the top
+    QVERIFY(policy.update(96, 100));
+    QCOMPARE(policy.level, Policy::Critical);
+    QVERIFY(!policy.update(91, 100));
+    QVERIFY(policy.update(89, 100));
+    QCOMPARE(policy.level, Policy::Elevated);
+}
+
+static QByteArray applyHostWrites(const QRhiD3D::HostWrites &writes, QByteArray buffer)
+{
+    for (const QRhiD3D::HostWrite &w : writes.ranges)
+        memcpy(buffer.data() + w.offset, writes.arena.constData() + w.arenaOffset, w.size);
+    return buffer;
+}
+
+void tst_QRhiD3DAlgorithms::hostWritesCoalesce()
+{
+    QRhiD3D::HostWrites writes;
+    writes.add(0, "abcd", 4);
+    writes.add(4, "efgh", 4);
+    QCOMPARE(writes.ranges.count(), 1);
+    QCOMPARE(writes.ranges[0].size, 8u);
+
+    writes.add(100, "xy", 2);
+    QCOMPARE(writes.ranges.count(), 2);
+    QVERIFY(writes.ranges[0].offset < writes.ranges[1].offset);
+
+    // overlapping both, bridging the gap
+    const QByteArray fill(100, 'z');
+    writes.add(2, fill.constData(), 99);
+    QCOMPARE(writes.ranges.count(), 1);
+    QCOMPARE(writes.ranges[0].offset, 0u);
+    QCOMPARE(writes.ranges[0].size, 102u);
+    const QByteArray result = applyHostWrites(writes, QByteArray(102, '\0'));
+    QCOMPARE(result, QByteArray("ab") + QByteArray(99, 'z') + QByteArray("y"));
+
+    // replacing everything starts the arena over
+    const QByteArray all(200, 'w');
+    writes.add(0, all.constData(), 200);
+    QCOMPARE(writes.ranges.count(), 1);
+    QCOMPARE(writes.arena.size(), 200);
+
+    writes.clear();
+    QVERIFY(writes.isEmpty());
+    QVERIFY(writes.arena.isEmpty());
+}
+
+void tst_QRhiD3DAlgorithms::hostWritesRandom()
+{
+    QRandomGenerator rng(1234);
+    const quint32 bufferSize = 512;
+    for (int iteration = 0; iteration < 200; ++iteration) {
+        QRhiD3D::HostWrites writes;
+        QByteArray expected(bufferSize, '\0');
+        const int writeCount = rng.bounded(1, 40);
+        for (int i = 0; i < writeCount; ++i) {
+            const quint32 offset = rng.bounded(bufferSize);
+            const quint32 size = rng.bounded(1u, qMin(64u, bufferSize - offset) + 1);
+            QByteArray data(size, Qt::Uninitialized);
+            for (char &c : data)
+                c = char(rng.bounded(256));
+            writes.add(offset, data.constData(), size);
+            memcpy(expected.data() + offset, data.constData(), size);
+        }
+        for (qsizetype i = 1; i < writes.ranges.count(); ++i) {
+            const QRhiD3D::HostWrite &prev(writes.ranges[i - 1]);
+            QVERIFY(prev.offset + prev.size < writes.ranges[i].offset);
+        }
+        QCOMPARE(applyHostWrites(writes, QByteArray(bufferSize, '\0')), expected);
+    }
+}
+
+void tst_QRhiD3DAlgorithms::convertPixels()
+{
+    using namespace QRhiD3D;
+    QCOMPARE(convertPixel(0x80112233, SwapRedBlue), 0x80332211u);
+    QCOMPARE(convertPixel(0x80ff4020, Premultiply), qPremultiply(0x80ff4020));
+    QCOMPARE(convertedFormat(QRhiTexture::RGBA8, SwapRedBlue), QRhiTexture::BGRA8);
+    QCOMPARE(convertedFormat(QRhiTexture::RGBA8, Premultiply), QRhiTexture::RGBA8);
+
+    QRandomGenerator rng(5678);
+    QList<quint32> src(37);
+    for (quint32 &p : src)
+        p = rng.generate();
+    const PixelConversion conversions[] = { SwapRedBlue, Premultiply, SwapRedBlue | Premultiply };
+    for (PixelConversion conversion : conversions) {
+        for (int count = 0; count <= src.count(); ++count) {
+            QList<quint32> expected(count), actual(count);
+            convertPixelsScalar(expected.data(), src.constData(), count, conversion);
+            QRhiD3D::convertPixels(actual.data(), src.constData(), count, conversion);
+            QCOMPARE(actual, expected);
+        }
+    }
+}
+
+void tst_QRhiD3DAlgorithms::copyPitchedRows()
+{
+    const quint32 rowBytes = 12;
+    const int rowCount = 3;
+    QByteArray src(16 * rowCount, '\0');
+    for (int i = 0; i < src.size(); ++i)
+        src[i] = char(i);
+
+    // padded to unpadded
+    QByteArray dst(rowBytes * rowCount, '\0');
+    QRhiD3D::copyPitchedRows(dst.data(), rowBytes, src.constData(), 16, rowBytes, rowCount);
+    for (int y = 0; y < rowCount; ++y)
+        QCOMPARE(dst.mid(y * rowBytes, rowBytes), src.mid(y * 16, rowBytes));
+
+    // unpadded, converted on the way
+    QByteArray converted(rowBytes * rowCount, '\0');
+    QRhiD3D::copyPitchedRows(converted.data(), rowBytes, dst.constData(), rowBytes, rowBytes, rowCount,
+                             QRhiD3D::SwapRedBlue);
+    for (int i = 0; i < converted.size(); i += 4) {
+        QCOMPARE(converted[i], dst[i + 2]);
+        QCOMPARE(converted[i + 1], dst[i + 1]);
+        QCOMPARE(converted[i + 2], dst[i]);
+        QCOMPARE(converted[i + 3], dst[i + 3]);
+    }
+}
+
+void tst_QRhiD3DAlgorithms::timingScopes()
+{
+    // made-up query handles, 0 meaning none
+    using Frame = QRhiD3D::TimingFrame<quintptr>;
+    QRhiD3D::TimingQueryFreeList<quintptr> freeList;
+    Frame frame;
+    frame.disjointQuery = 100;
+    QVERIFY(frame.openScope("frame", 1, 2));
+    QVERIFY(frame.openScope("a", 3, 4));
+    QCOMPARE(frame.closeScope(), quintptr(4));
+    QVERIFY(frame.openScope("b", 5, 6));
+    // no queries available, still balanced
+    QVERIFY(!frame.openScope("c", 7, 0));
+    QCOMPARE(frame.closeScope(), quintptr(0));
+    QCOMPARE(frame.closeScope(), quintptr(6));
+    QCOMPARE(frame.closeScope(), quintptr(2));
+    QCOMPARE(frame.closeScope(), quintptr(0));
+    QCOMPARE(frame.scopes.count(), 3);
+
+    // begin and end for each scope, ticks at 1 MHz
+    const quint64 timestamps[] = { 0, 3000, 100, 1100, 1200, 2700 };
+    const QByteArray json = QRhiD3D::timingScopesToJson(frame, timestamps, 1000000);
+    const QJsonArray roots = QJsonDocument::fromJson(json).array();
+    QCOMPARE(roots.count(), 1);
+    const QJsonObject root = roots[0].toObject();
+    QCOMPARE(root.value(QLatin1String("name")).toString(), QLatin1String("frame"));
+    QCOMPARE(root.value(QLatin1String("ms")).toDouble(), 3.0);
+    const QJsonArray children = root.value(QLatin1String("children")).toArray();
+    QCOMPARE(children.count(), 2);
+    QCOMPARE(children[0].toObject().value(QLatin1String("name")).toString(), QLatin1String("a"));
+    QCOMPARE(children[0].toObject().value(QLatin1String("ms")).toDouble(), 1.0);
+    QCOMPARE(children[1].toObject().value(QLatin1String("name")).toString(), QLatin1String("b"));
+    QCOMPARE(children[1].toObject().value(QLatin1String("ms")).toDouble(), 1.5);
+    QVERIFY(!children[0].toObject().contains(QLatin1String("children")));
+
+    frame.recycle(&freeList);
+    QVERIFY(frame.scopes.isEmpty());
+    QCOMPARE(freeList.timestampQueries.count(), 6);
+    QCOMPARE(freeList.takeDisjointQuery(), quintptr(100));
+    QCOMPARE(freeList.takeDisjointQuery(), quintptr(0));
+
+    int released = 0;
+    freeList.releaseAll([&released](quintptr) { ++released; });
+    QCOMPARE(released, 6);
+    QCOMPARE(freeList.takeTimestampQuery(), quintptr(0));
+}
+
+QTEST_APPLESS_MAIN(tst_QRhiD3DAlgorithms)
+
+#include "tst_qrhid3dalgorithms.moc"